@@ -0,0 +1,66 @@
+/* -*- c++ -*- */
+
+#include <atomic>
+#include "HttpAcceptCounters.h"
+#include "HttpAcceptThreadRegistry.h"
+
+namespace
+{
+    struct alignas(64) ThreadCounters
+    {
+        std::atomic<uint64_t> values[HttpAcceptCounters::kCounterCount];
+    };
+
+    struct CounterTotals
+    {
+        uint64_t values[HttpAcceptCounters::kCounterCount];
+    };
+
+    void merge(CounterTotals &totals, const ThreadCounters &thread)
+    {
+        for (unsigned i = 0; i < HttpAcceptCounters::kCounterCount; ++i)
+        {
+            totals.values[i] += thread.values[i].load(std::memory_order_relaxed);
+        }
+    }
+
+    typedef HttpAcceptThreadRegistry<ThreadCounters, CounterTotals, merge> Registry;
+}
+
+void HttpAcceptCounters::add(Counter counter, uint64_t value)
+{
+    // Only the owning thread writes its counters: a relaxed load and store is
+    // enough, and cheaper than an atomic read-modify-write.
+    std::atomic<uint64_t> &target = Registry::local().values[counter];
+    target.store(target.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+}
+
+HttpAcceptCounters::Stats HttpAcceptCounters::getStats()
+{
+    const CounterTotals totals = Registry::collect();
+    const uint64_t *values = totals.values;
+
+    Stats stats;
+    stats.negotiations = values[kNegotiations];
+    stats.earlyExits = values[kEarlyExits];
+    stats.scoredOffers = values[kScoredOffers];
+    stats.skippedOffers = values[kSkippedOffers];
+    stats.malformedRanges = values[kMalformedRanges];
+    stats.wildcardMisuse = values[kWildcardMisuse];
+    stats.missingEquals = values[kMissingEquals];
+    stats.invalidQualityValues = values[kInvalidQualityValues];
+    stats.clampedQualityValues = values[kClampedQualityValues];
+    stats.zeroQualityRanges = values[kZeroQualityRanges];
+    stats.invalidOffers = values[kInvalidOffers];
+    stats.emptyHeaderFallbacks = values[kEmptyHeaderFallbacks];
+    stats.unacceptableFallbacks = values[kUnacceptableFallbacks];
+    stats.invalidOfferFallbacks = values[kInvalidOfferFallbacks];
+    stats.shadowComparisons = values[kShadowComparisons];
+    stats.shadowMismatches = values[kShadowMismatches];
+    for (unsigned stage = 0; stage < kStageCount; ++stage)
+    {
+        stats.stages[stage].samples = values[kStageSamples + stage];
+        stats.stages[stage].ticks = values[kStageTicks + stage];
+    }
+    return stats;
+}
@@ -0,0 +1,119 @@
+/* -*- c++ -*- */
+
+#ifndef HTTP_ACCEPT_COUNTERS_H
+#define HTTP_ACCEPT_COUNTERS_H
+
+#include <cstdint>
+
+/**
+ * Process wide counters describing how negotiations are resolved, why
+ * ranges and offers are discarded and which fallbacks answer them, used to
+ * tune the caches and the fast paths against real traffic.
+ *
+ * Every thread increments its own cache-line aligned counters, allocated on
+ * first use, with relaxed stores, so counting never contends. getStats() sums
+ * the counters of the live threads and of the threads that have exited.
+ */
+class HttpAcceptCounters
+{
+public:
+
+    /**
+     * @brief Stages of a negotiation timed by the instrumentation of
+     * HttpAcceptInstrumentation.h.
+     */
+    enum Stage
+    {
+        kTokenize,          ///< Tokenization of the 'Accept' header, including the quality values.
+        kRankRanges,        ///< Ranking and indexing of the accepted ranges.
+        kNormalizeOffers,   ///< Normalization of the available content types not precompiled in an offer set.
+        kMatch,             ///< Scoring of the available content types, including their ranking.
+        kRankOffers,        ///< Ranking of the scored content types, for long lists only.
+        kStageCount
+    };
+
+    /**
+     * @brief Identifiers of the counters.
+     */
+    enum Counter
+    {
+        kNegotiations,                          ///< Offer lists negotiated against a non empty 'Accept' header.
+        kEarlyExits,                            ///< Negotiations that settled before scoring every offer.
+        kScoredOffers,                          ///< Offers scored against the accepted ranges.
+        kSkippedOffers,                         ///< Offers left unscored because they could not be selected.
+        kMalformedRanges,                       ///< Ranges discarded because their media type has no '/'.
+        kWildcardMisuse,                        ///< Ranges discarded because they have a wildcard type and a specific subtype.
+        kMissingEquals,                         ///< Ranges discarded because a parameter has no '='.
+        kInvalidQualityValues,                  ///< Ranges discarded because their quality value is not a number.
+        kClampedQualityValues,                  ///< Quality values out of the range 0.001 to 1, read as 1.
+        kZeroQualityRanges,                     ///< Ranges excluded by a quality value of 0.
+        kInvalidOffers,                         ///< Available content types ignored because they have no '/'.
+        kEmptyHeaderFallbacks,                  ///< Negotiations answered with the first offer because the header is empty.
+        kUnacceptableFallbacks,                 ///< Negotiations in which no offer is acceptable, answered with the best ranked one.
+        kInvalidOfferFallbacks,                 ///< Negotiations answered with the first offer as provided because no offer is valid.
+        kShadowComparisons,                     ///< Negotiations verified against HttpAcceptReference.
+        kShadowMismatches,                      ///< Verified negotiations in which HttpAcceptReference selects another content type.
+        kStageSamples,                          ///< Timed runs of every stage, in the order of Stage.
+        kStageTicks = kStageSamples + kStageCount, ///< Ticks spent in every stage, in the order of Stage.
+        kCounterCount = kStageTicks + kStageCount
+    };
+
+    /**
+     * @brief Time spent in a stage by the sampled negotiations.
+     */
+    struct StageStats
+    {
+        uint64_t samples;
+        uint64_t ticks;
+    };
+
+    /**
+     * @brief Snapshot of the counters.
+     */
+    struct Stats
+    {
+        uint64_t negotiations;
+        uint64_t earlyExits;
+        uint64_t scoredOffers;
+        uint64_t skippedOffers;
+        uint64_t malformedRanges;
+        uint64_t wildcardMisuse;
+        uint64_t missingEquals;
+        uint64_t invalidQualityValues;
+        uint64_t clampedQualityValues;
+        uint64_t zeroQualityRanges;
+        uint64_t invalidOffers;
+        uint64_t emptyHeaderFallbacks;
+        uint64_t unacceptableFallbacks;
+        uint64_t invalidOfferFallbacks;
+        uint64_t shadowComparisons;
+        uint64_t shadowMismatches;
+        StageStats stages[kStageCount];
+    };
+
+    /**
+     * Adds a value to a counter of the calling thread.
+     *
+     * @param[in] counter the counter.
+     * @param[in] value the value to add.
+     */
+    static void add(Counter counter, uint64_t value = 1);
+
+    /**
+     * Returns the sum of the counters of every thread.
+     *
+     * @return the counters.
+     */
+    static Stats getStats();
+
+private:
+
+    /**
+     * Constructor.
+     */
+    HttpAcceptCounters()
+    {
+    }
+};
+
+#endif // HTTP_ACCEPT_COUNTERS_H
@@ -0,0 +1,106 @@
+/* -*- c++ -*- */
+
+#ifndef HTTP_ACCEPT_HASH_H
+#define HTTP_ACCEPT_HASH_H
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+/**
+ * Non-cryptographic hashing helpers shared by the negotiation caches.
+ *
+ * The hash is deterministic across processes and runs, so values computed by
+ * one worker can be compared with values computed by another one.
+ */
+class HttpAcceptHash
+{
+public:
+
+    /**
+     * Hashes a sequence of bytes.
+     *
+     * @param[in] data bytes to hash.
+     * @param[in] length number of bytes to hash.
+     * @param[in] seed initial value, used to chain several hashes.
+     *
+     * @return the 64 bit hash value.
+     */
+    static uint64_t hash(const char *data, size_t length, uint64_t seed = 0)
+    {
+        uint64_t h = seed ^ (length * 0x9e3779b97f4a7c15ULL);
+        while (length >= 8)
+        {
+            uint64_t word;
+            std::memcpy(&word, data, 8);
+            h = mix(h ^ word);
+            data += 8;
+            length -= 8;
+        }
+        uint64_t tail = 0;
+        std::memcpy(&tail, data, length);
+        return mix(h ^ tail ^ 0x2545f4914f6cdd1dULL);
+    }
+
+    /**
+     * Hashes a string.
+     *
+     * @param[in] s string to hash.
+     * @param[in] seed initial value, used to chain several hashes.
+     *
+     * @return the 64 bit hash value.
+     */
+    static uint64_t hash(const std::string &s, uint64_t seed = 0)
+    {
+        return hash(s.data(), s.size(), seed);
+    }
+
+    /**
+     * Computes the fingerprint of a list of available content types. Lists
+     * holding the same strings in the same order have the same fingerprint;
+     * different lists collide with a probability of about 2^-64, which the
+     * caches keyed by fingerprint accept instead of comparing the lists.
+     *
+     * @param[in] availableContentTypes list of available content types.
+     *
+     * @return the 64 bit fingerprint.
+     */
+    static uint64_t fingerprint(const std::vector<std::string> &availableContentTypes)
+    {
+        uint64_t h = availableContentTypes.size();
+        for (const auto &contentType : availableContentTypes)
+        {
+            h = hash(contentType, h);
+        }
+        return h;
+    }
+
+    /**
+     * Finalizes a 64 bit value so that every input bit affects every output bit.
+     *
+     * @param[in] h value to mix.
+     *
+     * @return the mixed value.
+     */
+    static uint64_t mix(uint64_t h)
+    {
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33;
+        h *= 0xc4ceb9fe1a85ec53ULL;
+        h ^= h >> 33;
+        return h;
+    }
+
+private:
+
+    /**
+     * Constructor.
+     */
+    HttpAcceptHash()
+    {
+    }
+};
+
+#endif // HTTP_ACCEPT_HASH_H
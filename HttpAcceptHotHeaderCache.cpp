@@ -0,0 +1,629 @@
+/* -*- c++ -*- */
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include "HttpAcceptHotHeaderCache.h"
+#include "HttpAcceptHash.h"
+#include "HttpAcceptParser.h"
+#include "HttpAcceptRcu.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define HTTP_ACCEPT_SNAPSHOT_MMAP 1
+#endif
+
+namespace
+{
+    const char     kSnapshotMagic[8] = {'H', 'A', 'P', 'H', 'O', 'T', '\0', '\0'};
+    const uint32_t kByteOrderMark = 0x01020304;
+
+    // Must change whenever the layout or the negotiation results change, so
+    // that a snapshot written by a previous version is not loaded.
+    const uint32_t kSnapshotVersion = 1;
+
+    uint64_t roundUpToMultipleOfEight(uint64_t value)
+    {
+        return (value + 7) & ~static_cast<uint64_t>(7);
+    }
+}
+
+/**
+ * @brief Immutable open addressing table of promoted headers and their precomputed results.
+ *
+ * The table is a single position-independent image: a header, the
+ * fingerprints of the offer sets it references, the slots, and a pool of
+ * strings addressed by offset. The same image is used in memory and on disk,
+ * so a snapshot is loaded by mapping the file, without parsing it.
+ */
+struct HttpAcceptHotHeaderCache::HotTable
+{
+    struct FileHeader
+    {
+        char     magic[8];
+        uint32_t version;
+        uint32_t byteOrder;
+        uint64_t slotCount;
+        uint64_t entries;
+        uint64_t fingerprintCount;
+        uint64_t poolSize;
+        uint64_t checksum;       // Hash of everything that follows the header.
+        uint64_t reserved;
+    };
+
+    struct Slot
+    {
+        uint64_t hash;           // Zero marks an empty slot.
+        uint64_t fingerprint;
+        uint32_t acceptOffset;
+        uint32_t acceptLength;
+        uint32_t resultOffset;
+        uint32_t resultLength;
+    };
+
+    struct Entry
+    {
+        uint64_t           hash;
+        uint64_t           fingerprint;
+        const std::string *acceptValue;
+        std::string        result;
+    };
+
+    const FileHeader      *header;
+    const uint64_t        *fingerprints;
+    const Slot            *slots;
+    const char            *pool;
+    uint64_t               mask;
+    size_t                 size;
+    std::vector<uint64_t>  image;
+    void                  *mapping;
+
+    HotTable()
+        : header(nullptr), fingerprints(nullptr), slots(nullptr), pool(nullptr), mask(0), size(0), mapping(nullptr)
+    {
+    }
+
+    ~HotTable()
+    {
+#ifdef HTTP_ACCEPT_SNAPSHOT_MMAP
+        if (mapping)
+        {
+            munmap(mapping, size);
+        }
+#endif
+    }
+
+    static uint64_t slotHash(uint64_t hash)
+    {
+        return hash ? hash : 1;
+    }
+
+    const Slot *find(uint64_t hash, uint64_t fingerprint, const std::string &acceptValue) const
+    {
+        hash = slotHash(hash);
+        for (uint64_t index = hash & mask; slots[index].hash != 0; index = (index + 1) & mask)
+        {
+            const Slot &slot = slots[index];
+            if ((slot.hash == hash) && (slot.fingerprint == fingerprint) && (slot.acceptLength == acceptValue.size()) &&
+                (std::memcmp(pool + slot.acceptOffset, acceptValue.data(), slot.acceptLength) == 0))
+            {
+                return &slot;
+            }
+        }
+        return nullptr;
+    }
+
+    std::string result(const Slot &slot) const
+    {
+        return std::string(pool + slot.resultOffset, slot.resultLength);
+    }
+
+    /**
+     * Builds the image of a table holding the given entries.
+     */
+    static HotTable *build(const std::vector<Entry> &entries)
+    {
+        std::vector<uint64_t> fingerprints;
+        uint64_t poolSize = 0;
+        for (const auto &entry : entries)
+        {
+            fingerprints.push_back(entry.fingerprint);
+            poolSize += entry.acceptValue->size() + entry.result.size();
+        }
+        std::sort(fingerprints.begin(), fingerprints.end());
+        fingerprints.erase(std::unique(fingerprints.begin(), fingerprints.end()), fingerprints.end());
+
+        uint64_t slotCount = 8;
+        while (slotCount < 2 * entries.size())
+        {
+            slotCount <<= 1;
+        }
+        const uint64_t size = roundUpToMultipleOfEight(sizeof(FileHeader) + fingerprints.size() * sizeof(uint64_t) + slotCount * sizeof(Slot) + poolSize);
+
+        HotTable *table = new HotTable;
+        table->image.assign(size / sizeof(uint64_t), 0);
+        char *bytes = reinterpret_cast<char *>(table->image.data());
+        FileHeader *header = reinterpret_cast<FileHeader *>(bytes);
+        uint64_t *tableFingerprints = reinterpret_cast<uint64_t *>(bytes + sizeof(FileHeader));
+        Slot *slots = reinterpret_cast<Slot *>(tableFingerprints + fingerprints.size());
+        char *pool = reinterpret_cast<char *>(slots + slotCount);
+
+        std::memcpy(header->magic, kSnapshotMagic, sizeof(kSnapshotMagic));
+        header->version = kSnapshotVersion;
+        header->byteOrder = kByteOrderMark;
+        header->slotCount = slotCount;
+        header->entries = entries.size();
+        header->fingerprintCount = fingerprints.size();
+        header->poolSize = poolSize;
+        std::copy(fingerprints.begin(), fingerprints.end(), tableFingerprints);
+
+        uint64_t poolOffset = 0;
+        for (const auto &entry : entries)
+        {
+            const uint64_t hash = slotHash(entry.hash);
+            uint64_t index = hash & (slotCount - 1);
+            while (slots[index].hash != 0)
+            {
+                index = (index + 1) & (slotCount - 1);
+            }
+            Slot &slot = slots[index];
+            slot.hash = hash;
+            slot.fingerprint = entry.fingerprint;
+            slot.acceptOffset = static_cast<uint32_t>(poolOffset);
+            slot.acceptLength = static_cast<uint32_t>(entry.acceptValue->size());
+            std::memcpy(pool + poolOffset, entry.acceptValue->data(), entry.acceptValue->size());
+            poolOffset += entry.acceptValue->size();
+            slot.resultOffset = static_cast<uint32_t>(poolOffset);
+            slot.resultLength = static_cast<uint32_t>(entry.result.size());
+            std::memcpy(pool + poolOffset, entry.result.data(), entry.result.size());
+            poolOffset += entry.result.size();
+        }
+        header->checksum = HttpAcceptHash::hash(bytes + sizeof(FileHeader), size - sizeof(FileHeader));
+
+        table->bind(bytes, size);
+        return table;
+    }
+
+    /**
+     * Validates an image and points the table at it.
+     *
+     * @return False if the image is truncated, corrupted or was written by an incompatible version.
+     */
+    bool bind(const char *bytes, uint64_t length)
+    {
+        if (length < sizeof(FileHeader))
+        {
+            return false;
+        }
+        const FileHeader *candidate = reinterpret_cast<const FileHeader *>(bytes);
+        if ((std::memcmp(candidate->magic, kSnapshotMagic, sizeof(kSnapshotMagic)) != 0) ||
+            (candidate->version != kSnapshotVersion) || (candidate->byteOrder != kByteOrderMark) ||
+            (candidate->slotCount == 0) || ((candidate->slotCount & (candidate->slotCount - 1)) != 0) ||
+            (candidate->entries >= candidate->slotCount) ||
+            (candidate->slotCount > length / sizeof(Slot)) || (candidate->fingerprintCount > length / sizeof(uint64_t)) ||
+            (candidate->poolSize > length) ||
+            (length != roundUpToMultipleOfEight(sizeof(FileHeader) + candidate->fingerprintCount * sizeof(uint64_t) + candidate->slotCount * sizeof(Slot) + candidate->poolSize)) ||
+            (candidate->checksum != HttpAcceptHash::hash(bytes + sizeof(FileHeader), length - sizeof(FileHeader))))
+        {
+            return false;
+        }
+
+        const uint64_t *candidateFingerprints = reinterpret_cast<const uint64_t *>(bytes + sizeof(FileHeader));
+        const Slot *candidateSlots = reinterpret_cast<const Slot *>(candidateFingerprints + candidate->fingerprintCount);
+        uint64_t entries = 0;
+        for (uint64_t index = 0; index < candidate->slotCount; ++index)
+        {
+            const Slot &slot = candidateSlots[index];
+            if (slot.hash == 0)
+            {
+                continue;
+            }
+            if ((static_cast<uint64_t>(slot.acceptOffset) + slot.acceptLength > candidate->poolSize) ||
+                (static_cast<uint64_t>(slot.resultOffset) + slot.resultLength > candidate->poolSize))
+            {
+                return false;
+            }
+            ++entries;
+        }
+        if (entries != candidate->entries)
+        {
+            return false;
+        }
+
+        header = candidate;
+        fingerprints = candidateFingerprints;
+        slots = candidateSlots;
+        pool = reinterpret_cast<const char *>(candidateSlots + candidate->slotCount);
+        mask = candidate->slotCount - 1;
+        size = length;
+        return true;
+    }
+
+    /**
+     * Maps a snapshot file and points the table at it.
+     */
+    bool load(const std::string &path)
+    {
+#ifdef HTTP_ACCEPT_SNAPSHOT_MMAP
+        const int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+        {
+            return false;
+        }
+        struct stat status;
+        if ((fstat(fd, &status) != 0) || (status.st_size < static_cast<off_t>(sizeof(FileHeader))))
+        {
+            close(fd);
+            return false;
+        }
+        void *memory = mmap(nullptr, static_cast<size_t>(status.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (memory == MAP_FAILED)
+        {
+            return false;
+        }
+        mapping = memory;
+        size = static_cast<size_t>(status.st_size);
+        return bind(static_cast<const char *>(memory), size);
+#else
+        std::ifstream file(path.c_str(), std::ios::binary | std::ios::ate);
+        const std::streamoff length = file ? static_cast<std::streamoff>(file.tellg()) : -1;
+        if ((length < static_cast<std::streamoff>(sizeof(FileHeader))) || (length % sizeof(uint64_t) != 0))
+        {
+            return false;
+        }
+        image.assign(static_cast<size_t>(length) / sizeof(uint64_t), 0);
+        file.seekg(0);
+        if (!file.read(reinterpret_cast<char *>(image.data()), length))
+        {
+            return false;
+        }
+        return bind(reinterpret_cast<const char *>(image.data()), static_cast<uint64_t>(length));
+#endif
+    }
+};
+
+namespace
+{
+    // Calls left before the current thread takes its next sample.
+    thread_local unsigned t_sampleCountdown = 0;
+
+    uint64_t roundUpToPowerOfTwo(uint64_t value)
+    {
+        uint64_t result = 1;
+        while (result < value)
+        {
+            result <<= 1;
+        }
+        return result;
+    }
+    // Maximum number of headers tracked as candidates for promotion.
+    size_t candidateCapacity(const HttpAcceptHotHeaderCache::Options &options)
+    {
+        return std::max<size_t>(4 * static_cast<size_t>(options.topK), 16);
+    }
+}
+
+HttpAcceptHotHeaderCache::Options::Options()
+    : sampleRate(16), promotionInterval(4096), topK(64), minCount(8), sketchWidth(4096), sketchDepth(4), maxHeaderLength(512)
+{
+}
+
+HttpAcceptHotHeaderCache::StripedCounter::StripedCounter()
+{
+    for (auto &stripe : m_stripes)
+    {
+        stripe.value.store(0, std::memory_order_relaxed);
+    }
+}
+
+void HttpAcceptHotHeaderCache::StripedCounter::increment()
+{
+    // Threads hash to a stripe once, so that concurrent callers rarely share a cache line.
+    static std::atomic<unsigned> nextStripe(0);
+    thread_local const unsigned stripe = nextStripe.fetch_add(1, std::memory_order_relaxed) % kStripes;
+    m_stripes[stripe].value.fetch_add(1, std::memory_order_relaxed);
+}
+
+uint64_t HttpAcceptHotHeaderCache::StripedCounter::load() const
+{
+    uint64_t total = 0;
+    for (const auto &stripe : m_stripes)
+    {
+        total += stripe.value.load(std::memory_order_relaxed);
+    }
+    return total;
+}
+
+size_t HttpAcceptHotHeaderCache::CandidateKeyHash::operator()(const CandidateKey &key) const
+{
+    return static_cast<size_t>(HttpAcceptHash::hash(key.acceptValue, key.fingerprint));
+}
+
+HttpAcceptHotHeaderCache::HttpAcceptHotHeaderCache()
+    : HttpAcceptHotHeaderCache(Options())
+{
+}
+
+HttpAcceptHotHeaderCache::HttpAcceptHotHeaderCache(const Options &options)
+    : m_options(options), m_table(nullptr), m_sketchMask(0), m_samplesSincePromotion(0),
+      m_samples(0), m_droppedSamples(0), m_promotions(0), m_newlyPromoted(0)
+{
+    m_options.sampleRate = std::max(m_options.sampleRate, 1u);
+    m_options.sketchDepth = std::max(m_options.sketchDepth, 1u);
+    const uint64_t width = roundUpToPowerOfTwo(std::max(m_options.sketchWidth, 64u));
+    m_sketchMask = width - 1;
+    m_sketch.assign(width * m_options.sketchDepth, 0);
+}
+
+HttpAcceptHotHeaderCache::~HttpAcceptHotHeaderCache()
+{
+    // No reader can use the cache while it is being destroyed.
+    delete m_table.load();
+}
+
+std::string HttpAcceptHotHeaderCache::parse(const std::string &acceptValue, const std::vector<std::string> &availableContentTypes)
+{
+    if (acceptValue.empty())
+    {
+        return HttpAcceptParser::parse(acceptValue, availableContentTypes);
+    }
+
+    m_lookups.increment();
+    const uint64_t fingerprint = HttpAcceptHash::fingerprint(availableContentTypes);
+    const uint64_t hash = HttpAcceptHash::hash(acceptValue, fingerprint);
+
+    // Hits are sampled too, otherwise promoted headers would stop being counted
+    // and would be demoted by the next promotion.
+    if ((acceptValue.size() <= m_options.maxHeaderLength) && (++t_sampleCountdown >= m_options.sampleRate))
+    {
+        t_sampleCountdown = 0;
+        sample(fingerprint, hash, acceptValue, availableContentTypes);
+    }
+
+    {
+        HttpAcceptRcu::ReadGuard guard;
+        const HotTable *table = m_table.load();
+        if (table)
+        {
+            const HotTable::Slot *slot = table->find(hash, fingerprint, acceptValue);
+            if (slot)
+            {
+                m_hits.increment();
+                return table->result(*slot);
+            }
+        }
+    }
+
+    return HttpAcceptParser::parse(acceptValue, availableContentTypes);
+}
+
+HttpAcceptHotHeaderCache::Stats HttpAcceptHotHeaderCache::getStats() const
+{
+    Stats stats;
+    stats.lookups = m_lookups.load();
+    stats.hits = m_hits.load();
+    stats.samples = m_samples.load(std::memory_order_relaxed);
+    stats.droppedSamples = m_droppedSamples.load(std::memory_order_relaxed);
+    stats.promotions = m_promotions.load(std::memory_order_relaxed);
+    stats.newlyPromoted = m_newlyPromoted.load(std::memory_order_relaxed);
+    {
+        HttpAcceptRcu::ReadGuard guard;
+        const HotTable *table = m_table.load();
+        stats.promotedHeaders = table ? table->header->entries : 0;
+    }
+    return stats;
+}
+
+void HttpAcceptHotHeaderCache::sample(uint64_t fingerprint, uint64_t hash, const std::string &acceptValue, const std::vector<std::string> &availableContentTypes)
+{
+    // Sampling never blocks the request path: if another thread is updating
+    // the sketch the sample is simply dropped.
+    std::unique_lock<std::mutex> lock(m_sampleMutex, std::try_to_lock);
+    if (!lock.owns_lock())
+    {
+        m_droppedSamples.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    m_samples.fetch_add(1, std::memory_order_relaxed);
+
+    // Conservative update: only the smallest counters are incremented, which
+    // keeps the over-estimation of the Count-Min sketch low.
+    const uint64_t width = m_sketchMask + 1;
+    const uint64_t step = HttpAcceptHash::mix(hash) | 1;
+    uint32_t estimate = UINT32_MAX;
+    for (unsigned row = 0; row < m_options.sketchDepth; ++row)
+    {
+        estimate = std::min(estimate, m_sketch[row * width + ((hash + row * step) & m_sketchMask)]);
+    }
+    if (estimate != UINT32_MAX)
+    {
+        ++estimate;
+    }
+    for (unsigned row = 0; row < m_options.sketchDepth; ++row)
+    {
+        uint32_t &counter = m_sketch[row * width + ((hash + row * step) & m_sketchMask)];
+        counter = std::max(counter, estimate);
+    }
+
+    // Track the heavy hitters. A header becomes a candidate once it is heavy
+    // enough to be promoted; when the candidates are full, new ones wait for
+    // the next promotion to make room, so that sampling stays constant time.
+    CandidateKey key{fingerprint, acceptValue};
+    auto candidate = m_candidates.find(key);
+    if (candidate != m_candidates.end())
+    {
+        candidate->second = estimate;
+    }
+    else if ((estimate >= m_options.minCount) && (m_candidates.size() < candidateCapacity(m_options)))
+    {
+        m_candidates.emplace(std::move(key), estimate);
+        if (m_offerSets.find(fingerprint) == m_offerSets.end())
+        {
+            m_offerSets.emplace(fingerprint, availableContentTypes);
+        }
+    }
+
+    ++m_samplesSincePromotion;
+}
+
+bool HttpAcceptHotHeaderCache::promoteIfDue()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_sampleMutex);
+        if (m_samplesSincePromotion < m_options.promotionInterval)
+        {
+            return false;
+        }
+    }
+    promote();
+    return true;
+}
+
+void HttpAcceptHotHeaderCache::promote()
+{
+    // Promotions are serialized, and so are the other writers of the table,
+    // so the previous table cannot be retired while it is read here.
+    std::lock_guard<std::mutex> promoting(m_promoteMutex);
+
+    // The candidates are ranked and copied under the sampling mutex, but the
+    // promoted headers are negotiated after releasing it, so that samples are
+    // only dropped for the time of the copy.
+    std::vector<CandidateKey> promoted;
+    std::unordered_map<uint64_t, std::vector<std::string>> offerSets;
+    {
+        std::lock_guard<std::mutex> lock(m_sampleMutex);
+        m_samplesSincePromotion = 0;
+
+        // Rank the candidates by estimated frequency and keep the top K.
+        std::vector<std::pair<uint32_t, const CandidateKey *>> ranked;
+        for (const auto &candidate : m_candidates)
+        {
+            if (candidate.second >= m_options.minCount)
+            {
+                ranked.emplace_back(candidate.second, &candidate.first);
+            }
+        }
+        const size_t count = std::min<size_t>(ranked.size(), m_options.topK);
+        std::partial_sort(ranked.begin(), ranked.begin() + count, ranked.end(),
+            [](const std::pair<uint32_t, const CandidateKey *> &a, const std::pair<uint32_t, const CandidateKey *> &b) { return a.first > b.first; });
+        promoted.reserve(count);
+        for (size_t i = 0; i < count; ++i)
+        {
+            const CandidateKey &key = *ranked[i].second;
+            promoted.push_back(key);
+            if (offerSets.find(key.fingerprint) == offerSets.end())
+            {
+                offerSets.emplace(key.fingerprint, m_offerSets[key.fingerprint]);
+            }
+        }
+
+        // Age every count so that headers which are no longer sent fall out of the table.
+        for (auto &counter : m_sketch)
+        {
+            counter >>= 1;
+        }
+        for (auto it = m_candidates.begin(); it != m_candidates.end();)
+        {
+            it->second >>= 1;
+            it = (it->second == 0) ? m_candidates.erase(it) : std::next(it);
+        }
+
+        // Keep the heaviest half of the candidates, to make room for new ones.
+        const size_t kept = candidateCapacity(m_options) / 2;
+        if (m_candidates.size() > kept)
+        {
+            std::vector<uint32_t> counts;
+            counts.reserve(m_candidates.size());
+            for (const auto &candidate : m_candidates)
+            {
+                counts.push_back(candidate.second);
+            }
+            std::nth_element(counts.begin(), counts.begin() + kept, counts.end(), std::greater<uint32_t>());
+            const uint32_t threshold = counts[kept];
+            for (auto it = m_candidates.begin(); it != m_candidates.end();)
+            {
+                it = (it->second <= threshold) ? m_candidates.erase(it) : std::next(it);
+            }
+        }
+        for (auto it = m_offerSets.begin(); it != m_offerSets.end();)
+        {
+            const uint64_t fingerprint = it->first;
+            const bool referenced = std::any_of(m_candidates.begin(), m_candidates.end(),
+                [fingerprint](const std::pair<const CandidateKey, uint32_t> &candidate) { return candidate.first.fingerprint == fingerprint; });
+            it = referenced ? std::next(it) : m_offerSets.erase(it);
+        }
+    }
+
+    // Precompute the result of every promoted header against its offer set.
+    std::vector<HotTable::Entry> entries;
+    entries.reserve(promoted.size());
+    const HotTable *previous = m_table.load();
+    uint64_t newlyPromoted = 0;
+    for (const auto &key : promoted)
+    {
+        const uint64_t hash = HttpAcceptHash::hash(key.acceptValue, key.fingerprint);
+        entries.push_back(HotTable::Entry{hash, key.fingerprint, &key.acceptValue, HttpAcceptParser::parse(key.acceptValue, offerSets[key.fingerprint])});
+        if (!previous || !previous->find(hash, key.fingerprint, key.acceptValue))
+        {
+            ++newlyPromoted;
+        }
+    }
+    const HotTable *table = HotTable::build(entries);
+
+    HttpAcceptRcu::retire(m_table.exchange(table));
+    m_promotions.fetch_add(1, std::memory_order_relaxed);
+    m_newlyPromoted.store(newlyPromoted, std::memory_order_relaxed);
+}
+
+bool HttpAcceptHotHeaderCache::saveSnapshot(const std::string &path) const
+{
+    HttpAcceptRcu::ReadGuard guard;
+    const HotTable *table = m_table.load();
+    if (!table)
+    {
+        return false;
+    }
+
+    // Write a temporary file and rename it, so that a process starting
+    // concurrently never maps a partially written snapshot.
+    const std::string temporaryPath = path + ".tmp";
+    {
+        std::ofstream file(temporaryPath.c_str(), std::ios::binary | std::ios::trunc);
+        if (!file.write(reinterpret_cast<const char *>(table->header), static_cast<std::streamsize>(table->size)) || !file.flush())
+        {
+            std::remove(temporaryPath.c_str());
+            return false;
+        }
+    }
+    return std::rename(temporaryPath.c_str(), path.c_str()) == 0;
+}
+
+bool HttpAcceptHotHeaderCache::loadSnapshot(const std::string &path, const std::vector<uint64_t> &fingerprints)
+{
+    std::unique_ptr<HotTable> table(new HotTable);
+    if (!table->load(path))
+    {
+        return false;
+    }
+
+    // Results computed against an offer set that is no longer configured are
+    // stale: the whole snapshot is rejected and the cache warms up normally.
+    for (uint64_t index = 0; index < table->header->fingerprintCount; ++index)
+    {
+        if (std::find(fingerprints.begin(), fingerprints.end(), table->fingerprints[index]) == fingerprints.end())
+        {
+            return false;
+        }
+    }
+
+    std::lock_guard<std::mutex> promoting(m_promoteMutex);
+    HttpAcceptRcu::retire(m_table.exchange(table.release()));
+    return true;
+}
@@ -0,0 +1,213 @@
+/* -*- c++ -*- */
+
+#ifndef HTTP_ACCEPT_HOT_HEADER_CACHE_H
+#define HTTP_ACCEPT_HOT_HEADER_CACHE_H
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * Adaptive cache of negotiation results for the most frequent 'Accept' headers.
+ *
+ * A sample of the calls to parse() is counted in a Count-Min sketch. Every
+ * few thousand samples the heaviest hitters become due for promotion into an
+ * immutable exact-match table holding the precomputed result for each offer
+ * set, which is published to readers through HttpAcceptRcu. Promotion runs
+ * in promoteIfDue(), which the application calls off the request path, so
+ * that parse() never pays for it. Counts decay on every promotion, so the
+ * table follows browser releases instead of going stale. The table can be
+ * saved to a file and mapped back by the next process.
+ */
+class HttpAcceptHotHeaderCache
+{
+public:
+
+    /**
+     * @brief Tuning parameters of the cache.
+     */
+    struct Options
+    {
+        /**
+         * Constructor. Initializes every option to its default value.
+         */
+        Options();
+
+        unsigned sampleRate;         ///< One call out of sampleRate is counted (default 16).
+        unsigned promotionInterval;  ///< Number of samples after which a promotion is due (default 4096).
+        unsigned topK;               ///< Maximum number of promoted headers (default 64).
+        unsigned minCount;           ///< Minimum estimated sample count to be promoted (default 8).
+        unsigned sketchWidth;        ///< Counters per sketch row, rounded to a power of two (default 4096).
+        unsigned sketchDepth;        ///< Number of sketch rows (default 4).
+        unsigned maxHeaderLength;    ///< Longer headers are never sampled (default 512).
+    };
+
+    /**
+     * @brief Counters describing the activity of the cache.
+     */
+    struct Stats
+    {
+        uint64_t lookups;            ///< Calls to parse() with a non empty 'Accept' header.
+        uint64_t hits;               ///< Calls answered from the promoted table.
+        uint64_t samples;            ///< Calls counted in the sketch.
+        uint64_t droppedSamples;     ///< Samples skipped because another thread was updating the sketch.
+        uint64_t promotions;         ///< Number of promoted tables published so far.
+        uint64_t promotedHeaders;    ///< Number of entries in the current table.
+        uint64_t newlyPromoted;      ///< Entries of the current table that were not in the previous one.
+    };
+
+    /**
+     * Constructor.
+     */
+    HttpAcceptHotHeaderCache();
+
+    /**
+     * Constructor.
+     *
+     * @param[in] options tuning parameters.
+     */
+    explicit HttpAcceptHotHeaderCache(const Options &options);
+
+    /**
+     * Destructor.
+     */
+    ~HttpAcceptHotHeaderCache();
+
+    /**
+     * Same as HttpAcceptParser::parse(), answered from the promoted table when
+     * the header is hot.
+     *
+     * @param[in] acceptValue value of the 'Accept' header.
+     * @param[in] availableContentTypes list of available content types.
+     *
+     * @return the selected content type.
+     */
+    std::string parse(const std::string &acceptValue, const std::vector<std::string> &availableContentTypes);
+
+    /**
+     * Promotes the current heavy hitters if promotionInterval samples were
+     * counted since the last promotion. Call it periodically from a timer or
+     * an idle handler: it ranks the candidates and negotiates every promoted
+     * header, which parse() leaves to it.
+     *
+     * @return True if a new table was published. Returns False otherwise.
+     */
+    bool promoteIfDue();
+
+    /**
+     * Promotes the current heavy hitters immediately instead of waiting for
+     * the next promotion interval.
+     */
+    void promote();
+
+    /**
+     * Writes the current promoted table to a file. The file is versioned,
+     * checksummed and position independent, so that a new process can map it
+     * with loadSnapshot() and serve hot headers from its first request.
+     *
+     * @param[in] path destination file, replaced atomically.
+     *
+     * @return False if nothing has been promoted yet or the file cannot be written. Returns True otherwise.
+     */
+    bool saveSnapshot(const std::string &path) const;
+
+    /**
+     * Maps a file written by saveSnapshot() and publishes it as the promoted
+     * table. The snapshot is rejected if it is corrupted, was written by an
+     * incompatible version, or references an offer set that is not listed.
+     *
+     * @param[in] path snapshot file.
+     * @param[in] fingerprints fingerprints of the offer sets currently configured,
+     * as returned by HttpAcceptHash::fingerprint() or HttpAcceptParser::OfferSet::fingerprint().
+     *
+     * @return False if the snapshot was rejected. Returns True otherwise.
+     */
+    bool loadSnapshot(const std::string &path, const std::vector<uint64_t> &fingerprints);
+
+    /**
+     * Returns a snapshot of the cache counters.
+     *
+     * @return the counters.
+     */
+    Stats getStats() const;
+
+private:
+
+    HttpAcceptHotHeaderCache(const HttpAcceptHotHeaderCache &);
+    HttpAcceptHotHeaderCache &operator=(const HttpAcceptHotHeaderCache &);
+
+    struct HotTable;
+
+    /**
+     * @brief Key of a sampled header: the header itself and the offer set it was negotiated against.
+     */
+    struct CandidateKey
+    {
+        uint64_t    fingerprint;
+        std::string acceptValue;
+
+        bool operator==(const CandidateKey &other) const
+        {
+            return (fingerprint == other.fingerprint) && (acceptValue == other.acceptValue);
+        }
+    };
+
+    struct CandidateKeyHash
+    {
+        size_t operator()(const CandidateKey &key) const;
+    };
+
+    /**
+     * @brief Counter striped over several cache lines to keep the hit path free of contention.
+     */
+    class StripedCounter
+    {
+    public:
+        StripedCounter();
+        void increment();
+        uint64_t load() const;
+
+    private:
+        struct alignas(64) Stripe
+        {
+            std::atomic<uint64_t> value;
+        };
+
+        static const unsigned kStripes = 16;
+        Stripe m_stripes[kStripes];
+    };
+
+    /**
+     * Counts a sampled header in the sketch, and tracks it as a candidate for
+     * promotion once its estimated count reaches minCount.
+     *
+     * @param[in] fingerprint fingerprint of the offer set.
+     * @param[in] hash hash of the header and offer set.
+     * @param[in] acceptValue value of the 'Accept' header.
+     * @param[in] availableContentTypes list of available content types.
+     */
+    void sample(uint64_t fingerprint, uint64_t hash, const std::string &acceptValue, const std::vector<std::string> &availableContentTypes);
+
+    Options                                                     m_options;
+    std::atomic<const HotTable *>                               m_table;
+    std::mutex                                                  m_promoteMutex;
+
+    std::mutex                                                  m_sampleMutex;
+    std::vector<uint32_t>                                       m_sketch;
+    uint64_t                                                    m_sketchMask;
+    std::unordered_map<CandidateKey, uint32_t, CandidateKeyHash> m_candidates;
+    std::unordered_map<uint64_t, std::vector<std::string>>      m_offerSets;
+    uint64_t                                                    m_samplesSincePromotion;
+
+    StripedCounter                                              m_lookups;
+    StripedCounter                                              m_hits;
+    std::atomic<uint64_t>                                       m_samples;
+    std::atomic<uint64_t>                                       m_droppedSamples;
+    std::atomic<uint64_t>                                       m_promotions;
+    std::atomic<uint64_t>                                       m_newlyPromoted;
+};
+
+#endif // HTTP_ACCEPT_HOT_HEADER_CACHE_H
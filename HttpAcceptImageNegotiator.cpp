@@ -0,0 +1,130 @@
+/* -*- c++ -*- */
+
+#include <cstring>
+#include "HttpAcceptImageNegotiator.h"
+
+namespace
+{
+    const unsigned kAllFormats = HttpAcceptImageNegotiator::kAvif | HttpAcceptImageNegotiator::kWebp | HttpAcceptImageNegotiator::kJxl |
+        HttpAcceptImageNegotiator::kPng | HttpAcceptImageNegotiator::kJpeg;
+
+    // Image 'Accept' headers sent by browsers.
+    const char kChrome[] = "image/avif,image/webp,image/apng,image/svg+xml,image/*,*/*;q=0.8";
+    const char kChromeWithoutAvif[] = "image/webp,image/apng,image/*,*/*;q=0.8";
+    const char kFirefox[] = "image/avif,image/webp,image/png,image/svg+xml,image/*;q=0.8,*/*;q=0.5";
+    const char kFirefoxWithoutPng[] = "image/avif,image/webp,*/*";
+    const char kFirefoxWithoutAvif[] = "image/webp,*/*";
+    const char kSafari[] = "image/webp,image/avif,image/jxl,image/heic,image/heic-sequence,video/*;q=0.8,image/png,image/svg+xml,image/*;q=0.8,*/*;q=0.5";
+    const char kSafariWithoutAvif[] = "image/webp,image/png,image/svg+xml,image/*;q=0.8,video/*;q=0.8,*/*;q=0.5";
+    const char kSafariWithoutWebp[] = "image/png,image/svg+xml,image/*;q=0.8,video/*;q=0.8,*/*;q=0.5";
+    const char kAnything[] = "*/*";
+
+    // A known header and the formats that get its highest quality. They are
+    // tied, so the first of them in the list of available formats wins.
+    struct KnownHeader
+    {
+        const char *value;
+        size_t      length;
+        unsigned    formats;
+    };
+
+    const KnownHeader kKnownHeaders[] =
+    {
+        { kChrome, sizeof(kChrome) - 1, kAllFormats },
+        { kChromeWithoutAvif, sizeof(kChromeWithoutAvif) - 1, kAllFormats },
+        { kFirefox, sizeof(kFirefox) - 1, HttpAcceptImageNegotiator::kAvif | HttpAcceptImageNegotiator::kWebp | HttpAcceptImageNegotiator::kPng },
+        { kFirefoxWithoutPng, sizeof(kFirefoxWithoutPng) - 1, kAllFormats },
+        { kFirefoxWithoutAvif, sizeof(kFirefoxWithoutAvif) - 1, kAllFormats },
+        { kSafari, sizeof(kSafari) - 1, HttpAcceptImageNegotiator::kWebp | HttpAcceptImageNegotiator::kAvif | HttpAcceptImageNegotiator::kJxl | HttpAcceptImageNegotiator::kPng },
+        { kSafariWithoutAvif, sizeof(kSafariWithoutAvif) - 1, HttpAcceptImageNegotiator::kWebp | HttpAcceptImageNegotiator::kPng },
+        { kSafariWithoutWebp, sizeof(kSafariWithoutWebp) - 1, HttpAcceptImageNegotiator::kPng },
+        { kAnything, sizeof(kAnything) - 1, kAllFormats }
+    };
+
+    const size_t kKnownHeaderCount = sizeof(kKnownHeaders) / sizeof(kKnownHeaders[0]);
+
+    std::vector<std::string> contentTypes(const std::vector<HttpAcceptImageNegotiator::Format> &formats)
+    {
+        std::vector<std::string> availableContentTypes;
+        for (const auto format : formats)
+        {
+            availableContentTypes.push_back(HttpAcceptImageNegotiator::contentType(format));
+        }
+        return availableContentTypes;
+    }
+}
+
+HttpAcceptImageNegotiator::HttpAcceptImageNegotiator(const std::vector<Format> &formats)
+    : m_formats(formats), m_offers(contentTypes(formats))
+{
+    // The format served to every known header is decided once. When none of
+    // the formats it prefers is available, the general engine decides.
+    for (size_t i = 0; i < kKnownHeaderCount; ++i)
+    {
+        Format selected = kNone;
+        for (const auto format : m_formats)
+        {
+            if (kKnownHeaders[i].formats & format)
+            {
+                selected = format;
+                break;
+            }
+        }
+        if ((selected == kNone) && !m_formats.empty())
+        {
+            const int index = HttpAcceptParser::select(std::string(kKnownHeaders[i].value, kKnownHeaders[i].length), m_offers);
+            selected = m_formats[index];
+        }
+        m_selected.push_back(selected);
+    }
+}
+
+HttpAcceptImageNegotiator::~HttpAcceptImageNegotiator()
+{
+}
+
+HttpAcceptImageNegotiator::Format HttpAcceptImageNegotiator::negotiate(const std::string &acceptValue) const
+{
+    unsigned formats;
+    const int known = recognize(acceptValue, formats);
+    if (known >= 0)
+    {
+        return m_selected[known];
+    }
+
+    const int selected = HttpAcceptParser::select(acceptValue, m_offers);
+    return (selected >= 0) ? m_formats[selected] : kNone;
+}
+
+int HttpAcceptImageNegotiator::recognize(const std::string &acceptValue, unsigned &formats)
+{
+    for (size_t i = 0; i < kKnownHeaderCount; ++i)
+    {
+        const KnownHeader &knownHeader = kKnownHeaders[i];
+        if ((acceptValue.size() == knownHeader.length) && (std::memcmp(acceptValue.data(), knownHeader.value, knownHeader.length) == 0))
+        {
+            formats = knownHeader.formats;
+            return static_cast<int>(i);
+        }
+    }
+    return -1;
+}
+
+const char *HttpAcceptImageNegotiator::contentType(Format format)
+{
+    switch (format)
+    {
+    case kAvif:
+        return "image/avif";
+    case kWebp:
+        return "image/webp";
+    case kJxl:
+        return "image/jxl";
+    case kPng:
+        return "image/png";
+    case kJpeg:
+        return "image/jpeg";
+    default:
+        return "";
+    }
+}
@@ -0,0 +1,84 @@
+/* -*- c++ -*- */
+
+#ifndef HTTP_ACCEPT_IMAGE_NEGOTIATOR_H
+#define HTTP_ACCEPT_IMAGE_NEGOTIATOR_H
+
+#include <string>
+#include <vector>
+#include "HttpAcceptParser.h"
+
+/**
+ * Negotiates the format of an image against a fixed list of image formats,
+ * for media servers that negotiate every image request.
+ *
+ * Browsers send a handful of long 'Accept' headers for images. They are
+ * recognized by their exact value and mapped to the set of formats they
+ * prefer, so the format served to them is decided when the negotiator is
+ * built. Other headers are negotiated by HttpAcceptParser, and both paths
+ * select the same format.
+ */
+class HttpAcceptImageNegotiator
+{
+public:
+
+    /**
+     * @brief Image formats, as bits of a set of formats.
+     */
+    enum Format
+    {
+        kNone = 0,
+        kAvif = 1 << 0,
+        kWebp = 1 << 1,
+        kJxl  = 1 << 2,
+        kPng  = 1 << 3,
+        kJpeg = 1 << 4
+    };
+
+    /**
+     * Constructor.
+     *
+     * @param[in] formats list of available formats ordered by preference.
+     */
+    explicit HttpAcceptImageNegotiator(const std::vector<Format> &formats);
+
+    /**
+     * Destructor.
+     */
+    ~HttpAcceptImageNegotiator();
+
+    /**
+     * Selects a format according to a HTTP 'Accept' header.
+     *
+     * @param[in] acceptValue value of the 'Accept' header.
+     *
+     * @return the selected format, as HttpAcceptParser::parse() would select
+     * its content type, or kNone if no format is available.
+     */
+    Format negotiate(const std::string &acceptValue) const;
+
+    /**
+     * Recognizes the image 'Accept' header of a known browser.
+     *
+     * @param[in] acceptValue value of the 'Accept' header.
+     * @param[out] formats set of the formats with the highest quality in the header.
+     *
+     * @return the position of the header in the list of known headers, or -1 if it is not known.
+     */
+    static int recognize(const std::string &acceptValue, unsigned &formats);
+
+    /**
+     * Returns the content type of a format, such as "image/webp".
+     */
+    static const char *contentType(Format format);
+
+private:
+
+    HttpAcceptImageNegotiator(const HttpAcceptImageNegotiator &);
+    HttpAcceptImageNegotiator &operator=(const HttpAcceptImageNegotiator &);
+
+    std::vector<Format>        m_formats;
+    HttpAcceptParser::OfferSet m_offers;
+    std::vector<Format>        m_selected;
+};
+
+#endif // HTTP_ACCEPT_IMAGE_NEGOTIATOR_H
@@ -0,0 +1,181 @@
+/* -*- c++ -*- */
+
+#ifndef HTTP_ACCEPT_INSTRUMENTATION_H
+#define HTTP_ACCEPT_INSTRUMENTATION_H
+
+#include "HttpAcceptCounters.h"
+
+/**
+ * Optional timing of the stages of a negotiation, enabled by compiling the
+ * library with HTTP_ACCEPT_PARSER_INSTRUMENTATION defined. Without it the
+ * hooks expand to nothing.
+ *
+ * One negotiation out of kSamplePeriod per thread is timed, with the time
+ * stamp counter on x86 and the monotonic clock elsewhere. The time of every
+ * stage is added to the per-thread counters of HttpAcceptCounters, so
+ * HttpAcceptCounters::getStats() reports it.
+ */
+#ifdef HTTP_ACCEPT_PARSER_INSTRUMENTATION
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#else
+#include <ctime>
+#endif
+
+class HttpAcceptInstrumentation
+{
+public:
+
+    /**
+     * One negotiation out of kSamplePeriod is timed.
+     */
+    static const unsigned kSamplePeriod = 1024;
+
+    /**
+     * Returns the current time, in time stamp counter ticks on x86 and in
+     * nanoseconds elsewhere.
+     */
+    static uint64_t ticks()
+    {
+#if defined(__x86_64__) || defined(__i386__)
+        return __rdtsc();
+#else
+        timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        return static_cast<uint64_t>(now.tv_sec) * 1000000000ULL + now.tv_nsec;
+#endif
+    }
+
+    /**
+     * Decides whether the negotiation starting on the calling thread is timed.
+     */
+    static void beginNegotiation()
+    {
+        unsigned &countdown = state().countdown;
+        state().sampled = (countdown == 0);
+        countdown = (countdown == 0) ? kSamplePeriod - 1 : countdown - 1;
+    }
+
+    /**
+     * @brief Adds the time spent in its scope, or until it is stopped, to a
+     * stage, if the current negotiation is timed. Negotiations that are not
+     * timed only test a flag.
+     */
+    class StageTimer
+    {
+    public:
+
+        explicit StageTimer(HttpAcceptCounters::Stage stage)
+            : m_stage(stage), m_start(__builtin_expect(state().sampled, 0) ? ticks() : 0)
+        {
+        }
+
+        ~StageTimer()
+        {
+            stop();
+        }
+
+        void stop()
+        {
+            // A time of 0 means the negotiation is not timed.
+            if (__builtin_expect(m_start != 0, 0))
+            {
+                record(m_stage, m_start);
+                m_start = 0;
+            }
+        }
+
+    private:
+
+        StageTimer(const StageTimer &);
+        StageTimer &operator=(const StageTimer &);
+
+        HttpAcceptCounters::Stage m_stage;
+        uint64_t                  m_start;
+    };
+
+private:
+
+    struct State
+    {
+        unsigned countdown;
+        bool     sampled;
+    };
+
+    static State &state()
+    {
+        static thread_local State t_state = { 0, false };
+        return t_state;
+    }
+
+    __attribute__((noinline, cold)) static void record(HttpAcceptCounters::Stage stage, uint64_t start)
+    {
+        HttpAcceptCounters::add(static_cast<HttpAcceptCounters::Counter>(HttpAcceptCounters::kStageSamples + stage));
+        HttpAcceptCounters::add(static_cast<HttpAcceptCounters::Counter>(HttpAcceptCounters::kStageTicks + stage), ticks() - start);
+    }
+
+    /**
+     * Constructor.
+     */
+    HttpAcceptInstrumentation()
+    {
+    }
+};
+
+#define HTTP_ACCEPT_BEGIN_NEGOTIATION() HttpAcceptInstrumentation::beginNegotiation()
+#define HTTP_ACCEPT_STAGE(stage) HttpAcceptInstrumentation::StageTimer httpAcceptStageTimer##stage(HttpAcceptCounters::stage)
+#define HTTP_ACCEPT_STAGE_END(stage) httpAcceptStageTimer##stage.stop()
+
+#else
+
+#define HTTP_ACCEPT_BEGIN_NEGOTIATION() ((void)0)
+#define HTTP_ACCEPT_STAGE(stage) ((void)0)
+#define HTTP_ACCEPT_STAGE_END(stage) ((void)0)
+
+#endif // HTTP_ACCEPT_PARSER_INSTRUMENTATION
+
+/**
+ * Optional count of the elementary operations of the negotiations, enabled
+ * by compiling the library with HTTP_ACCEPT_PARSER_COUNT_OPERATIONS defined,
+ * for the fuzzer to bound the work per input byte. Every scanned segment of
+ * the header, normalized offer, comparison of two content types, range
+ * visited while matching, probe of the range index and lookup of an
+ * interned string counts as one operation. Without it the hooks expand to
+ * nothing.
+ */
+#ifdef HTTP_ACCEPT_PARSER_COUNT_OPERATIONS
+
+class HttpAcceptOperations
+{
+public:
+
+    /**
+     * Returns the number of operations of the calling thread, which the
+     * caller can read and reset.
+     */
+    static uint64_t &count()
+    {
+        static thread_local uint64_t t_count = 0;
+        return t_count;
+    }
+
+private:
+
+    /**
+     * Constructor.
+     */
+    HttpAcceptOperations()
+    {
+    }
+};
+
+#define HTTP_ACCEPT_OPERATIONS(n) (HttpAcceptOperations::count() += (n))
+
+#else
+
+#define HTTP_ACCEPT_OPERATIONS(n) ((void)0)
+
+#endif // HTTP_ACCEPT_PARSER_COUNT_OPERATIONS
+
+#endif // HTTP_ACCEPT_INSTRUMENTATION_H
@@ -0,0 +1,601 @@
+/* -*- c++ -*- */
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include "HttpAcceptKernels.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define HTTP_ACCEPT_X86_KERNELS 1
+#define HTTP_ACCEPT_TARGET(isa) __attribute__((target(isa)))
+#endif
+
+namespace
+{
+    inline bool isWhitespace(const char c)
+    {
+        return (c == ' ') || (c == '\t') || (c == '\n') || (c == '\r') || (c == '\f') || (c == '\v');
+    }
+
+    inline unsigned countTrailingZeros(uint64_t value)
+    {
+#ifdef __GNUC__
+        return __builtin_ctzll(value);
+#else
+        unsigned count = 0;
+        for (; !(value & 1); value >>= 1)
+        {
+            ++count;
+        }
+        return count;
+#endif
+    }
+
+    inline unsigned countLeadingZeros(uint64_t value)
+    {
+#ifdef __GNUC__
+        return __builtin_clzll(value);
+#else
+        unsigned count = 0;
+        for (; !(value & (uint64_t(1) << 63)); value <<= 1)
+        {
+            ++count;
+        }
+        return count;
+#endif
+    }
+
+    // Accumulates the masks of a block of a segment scan, with one bit per
+    // byte: the delimiters, and the characters that are not whitespace.
+    // Returns whether the block contains the delimiter ending the segment.
+    inline bool scanMasks(uint64_t delimiters, uint64_t other, size_t offset, bool &found, size_t &begin, size_t &end)
+    {
+        if (delimiters)
+        {
+            other &= (delimiters & (0 - delimiters)) - 1;
+        }
+        if (other)
+        {
+            begin = found ? begin : offset + countTrailingZeros(other);
+            end = offset + 64 - countLeadingZeros(other);
+            found = true;
+        }
+        return delimiters != 0;
+    }
+
+    // The scalar kernels work on 8 bytes at a time (SWAR). The tests below
+    // take a word whose bytes have their high bit cleared, so that no carry
+    // crosses a byte, and set the high bit of every byte that passes.
+
+    const uint64_t kOnes = 0x0101010101010101ULL;
+    const uint64_t kHighBits = 0x8080808080808080ULL;
+
+    inline uint64_t broadcast(unsigned char c)
+    {
+        return kOnes * c;
+    }
+
+    inline uint64_t equalTo(uint64_t low, unsigned char c)
+    {
+        const uint64_t difference = low ^ broadcast(c);
+        return ~((difference + broadcast(0x7f)) | difference) & kHighBits;
+    }
+
+    inline uint64_t between(uint64_t low, unsigned char first, unsigned char last)
+    {
+        return (low + broadcast(0x80 - first)) & ~(low + broadcast(0x7f - last)) & kHighBits;
+    }
+
+    // Gathers the high bits of the bytes into one bit per byte, in memory order.
+    inline uint64_t gatherHighBits(uint64_t mask)
+    {
+        return ((mask >> 7) * 0x0102040810204080ULL) >> 56;
+    }
+
+    inline uint64_t loadWord(const char *s)
+    {
+        uint64_t word;
+        std::memcpy(&word, s, 8);
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+        word = __builtin_bswap64(word);
+#endif
+        return word;
+    }
+
+    inline void storeWord(char *s, uint64_t word)
+    {
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+        word = __builtin_bswap64(word);
+#endif
+        std::memcpy(s, &word, 8);
+    }
+
+    // Lowercases a word and flags the bytes that are neither token characters
+    // (RFC 7230 tchar) nor whitespace, delimiters, quotes or backslashes.
+    inline uint64_t lowerWord(uint64_t word, uint64_t &invalid)
+    {
+        const uint64_t low = word & ~kHighBits;
+        const uint64_t upper = between(low, 'A', 'Z') & ~word;
+        const uint64_t folded = low | broadcast(0x20);
+        invalid = (word & kHighBits) |
+            (between(low, 0x00, 0x1f) & ~equalTo(low, '\t')) |
+            between(low, '(', ')') |
+            equalTo(low, ':') |
+            equalTo(low, '<') |
+            between(low, '>', '@') |
+            equalTo(folded, '{') |
+            equalTo(folded, '}') |
+            equalTo(low, 0x7f);
+        return word | (upper >> 2);
+    }
+
+    bool lowerScalar(char *dst, const char *src, size_t length)
+    {
+        uint64_t invalid = 0;
+        size_t i = 0;
+        for (; i + 8 <= length; i += 8)
+        {
+            uint64_t flags;
+            storeWord(dst + i, lowerWord(loadWord(src + i), flags));
+            invalid |= flags;
+        }
+        if (i < length)
+        {
+            // The last bytes are padded with spaces, which are valid.
+            char block[8] = { ' ', ' ', ' ', ' ', ' ', ' ', ' ', ' ' };
+            std::memcpy(block, src + i, length - i);
+            uint64_t flags;
+            storeWord(block, lowerWord(loadWord(block), flags));
+            std::memcpy(dst + i, block, length - i);
+            invalid |= flags;
+        }
+        return invalid == 0;
+    }
+
+    size_t findScalar(const char *s, size_t length, char c)
+    {
+        const void *found = length ? std::memchr(s, c, length) : nullptr;
+        return found ? static_cast<size_t>(static_cast<const char *>(found) - s) : length;
+    }
+
+    size_t skipWhitespaceScalar(const char *s, size_t length)
+    {
+        size_t i = 0;
+        while ((i < length) && isWhitespace(s[i]))
+        {
+            ++i;
+        }
+        return i;
+    }
+
+    size_t scanSegmentScalar(const char *s, size_t length, size_t &begin, size_t &end)
+    {
+        bool found = false;
+        for (size_t i = 0; i < length; i += 8)
+        {
+            // The padding makes the whole word readable.
+            const uint64_t word = loadWord(s + i);
+            const uint64_t low = word & ~kHighBits;
+            const uint64_t valid = (length - i >= 8) ? 0xff : ((uint64_t(1) << (length - i)) - 1);
+            const uint64_t delimiters = gatherHighBits((equalTo(low, ',') | equalTo(low, ';') | equalTo(low, '=') | equalTo(low, '/')) & ~word) & valid;
+            const uint64_t whitespace = gatherHighBits((equalTo(low, ' ') | between(low, '\t', '\r')) & ~word);
+            if (scanMasks(delimiters, ~whitespace & valid, i, found, begin, end))
+            {
+                const size_t delimiter = i + countTrailingZeros(delimiters);
+                if (!found)
+                {
+                    begin = end = delimiter;
+                }
+                return delimiter;
+            }
+        }
+        if (!found)
+        {
+            begin = end = length;
+        }
+        return length;
+    }
+
+#ifdef HTTP_ACCEPT_X86_KERNELS
+
+    // Signed byte comparisons leave the bytes above 0x7f out of every range
+    // tested below, as non ASCII bytes must be.
+
+    // The valid characters are classified by their nibbles: a byte is valid if
+    // the classes of its low and high nibbles intersect. Bytes above 0x7f have
+    // no class. The tables are repeated for each 128-bit lane.
+    const char kLowNibbleClasses[64] =
+    {
+        0x76, 0x7e, 0x7e, 0x7e, 0x7e, 0x7e, 0x7e, 0x7e, 0x7c, 0x7d, 0x7a, 0x2e, 0x7a, 0x2e, 0x7a, 0x3a,
+        0x76, 0x7e, 0x7e, 0x7e, 0x7e, 0x7e, 0x7e, 0x7e, 0x7c, 0x7d, 0x7a, 0x2e, 0x7a, 0x2e, 0x7a, 0x3a,
+        0x76, 0x7e, 0x7e, 0x7e, 0x7e, 0x7e, 0x7e, 0x7e, 0x7c, 0x7d, 0x7a, 0x2e, 0x7a, 0x2e, 0x7a, 0x3a,
+        0x76, 0x7e, 0x7e, 0x7e, 0x7e, 0x7e, 0x7e, 0x7e, 0x7c, 0x7d, 0x7a, 0x2e, 0x7a, 0x2e, 0x7a, 0x3a
+    };
+    const char kHighNibbleClasses[64] =
+    {
+        0x01, 0x00, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+        0x01, 0x00, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+        0x01, 0x00, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+        0x01, 0x00, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00
+    };
+
+    HTTP_ACCEPT_TARGET("sse4.2")
+    bool lowerSse42(char *dst, const char *src, size_t length)
+    {
+        const __m128i aMinusOne = _mm_set1_epi8('A' - 1);
+        const __m128i zPlusOne = _mm_set1_epi8('Z' + 1);
+        const __m128i caseBit = _mm_set1_epi8(0x20);
+        const __m128i nibble = _mm_set1_epi8(0x0f);
+        const __m128i lowClasses = _mm_loadu_si128(reinterpret_cast<const __m128i *>(kLowNibbleClasses));
+        const __m128i highClasses = _mm_loadu_si128(reinterpret_cast<const __m128i *>(kHighNibbleClasses));
+        __m128i invalid = _mm_setzero_si128();
+        size_t i = 0;
+        for (; i + 16 <= length; i += 16)
+        {
+            const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i));
+            const __m128i upper = _mm_and_si128(_mm_cmpgt_epi8(v, aMinusOne), _mm_cmpgt_epi8(zPlusOne, v));
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i), _mm_add_epi8(v, _mm_and_si128(upper, caseBit)));
+            const __m128i classes = _mm_and_si128(_mm_shuffle_epi8(lowClasses, _mm_and_si128(v, nibble)),
+                _mm_shuffle_epi8(highClasses, _mm_and_si128(_mm_srli_epi16(v, 4), nibble)));
+            invalid = _mm_or_si128(invalid, _mm_cmpeq_epi8(classes, _mm_setzero_si128()));
+        }
+        const bool valid = lowerScalar(dst + i, src + i, length - i);
+        return valid && (_mm_movemask_epi8(invalid) == 0);
+    }
+
+    HTTP_ACCEPT_TARGET("sse4.2")
+    size_t findSse42(const char *s, size_t length, char c)
+    {
+        const __m128i needle = _mm_set1_epi8(c);
+        size_t i = 0;
+        for (; i + 16 <= length; i += 16)
+        {
+            const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(s + i));
+            const unsigned mask = static_cast<unsigned>(_mm_movemask_epi8(_mm_cmpeq_epi8(v, needle)));
+            if (mask)
+            {
+                return i + __builtin_ctz(mask);
+            }
+        }
+        return i + findScalar(s + i, length - i, c);
+    }
+
+    HTTP_ACCEPT_TARGET("sse4.2")
+    size_t skipWhitespaceSse42(const char *s, size_t length)
+    {
+        const __m128i space = _mm_set1_epi8(' ');
+        const __m128i tabMinusOne = _mm_set1_epi8('\t' - 1);
+        const __m128i crPlusOne = _mm_set1_epi8('\r' + 1);
+        size_t i = 0;
+        for (; i + 16 <= length; i += 16)
+        {
+            const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(s + i));
+            const __m128i whitespace = _mm_or_si128(_mm_cmpeq_epi8(v, space),
+                _mm_and_si128(_mm_cmpgt_epi8(v, tabMinusOne), _mm_cmpgt_epi8(crPlusOne, v)));
+            const unsigned mask = static_cast<unsigned>(_mm_movemask_epi8(whitespace)) ^ 0xffffu;
+            if (mask)
+            {
+                return i + __builtin_ctz(mask);
+            }
+        }
+        return i + skipWhitespaceScalar(s + i, length - i);
+    }
+
+    // The AVX2 kernels finish with the SSE4.2 ones, which are not VEX encoded:
+    // the upper halves of the registers are cleared first to avoid the
+    // transition penalty.
+
+    HTTP_ACCEPT_TARGET("avx2")
+    bool lowerAvx2(char *dst, const char *src, size_t length)
+    {
+        const __m256i aMinusOne = _mm256_set1_epi8('A' - 1);
+        const __m256i zPlusOne = _mm256_set1_epi8('Z' + 1);
+        const __m256i caseBit = _mm256_set1_epi8(0x20);
+        const __m256i nibble = _mm256_set1_epi8(0x0f);
+        const __m256i lowClasses = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(kLowNibbleClasses));
+        const __m256i highClasses = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(kHighNibbleClasses));
+        __m256i invalid = _mm256_setzero_si256();
+        size_t i = 0;
+        for (; i + 32 <= length; i += 32)
+        {
+            const __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + i));
+            const __m256i upper = _mm256_and_si256(_mm256_cmpgt_epi8(v, aMinusOne), _mm256_cmpgt_epi8(zPlusOne, v));
+            _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + i), _mm256_add_epi8(v, _mm256_and_si256(upper, caseBit)));
+            const __m256i classes = _mm256_and_si256(_mm256_shuffle_epi8(lowClasses, _mm256_and_si256(v, nibble)),
+                _mm256_shuffle_epi8(highClasses, _mm256_and_si256(_mm256_srli_epi16(v, 4), nibble)));
+            invalid = _mm256_or_si256(invalid, _mm256_cmpeq_epi8(classes, _mm256_setzero_si256()));
+        }
+        const bool valid = _mm256_movemask_epi8(invalid) == 0;
+        _mm256_zeroupper();
+        return lowerSse42(dst + i, src + i, length - i) && valid;
+    }
+
+    HTTP_ACCEPT_TARGET("avx2")
+    size_t findAvx2(const char *s, size_t length, char c)
+    {
+        const __m256i needle = _mm256_set1_epi8(c);
+        size_t i = 0;
+        for (; i + 32 <= length; i += 32)
+        {
+            const __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(s + i));
+            const unsigned mask = static_cast<unsigned>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, needle)));
+            if (mask)
+            {
+                return i + __builtin_ctz(mask);
+            }
+        }
+        _mm256_zeroupper();
+        return i + findSse42(s + i, length - i, c);
+    }
+
+    HTTP_ACCEPT_TARGET("avx2")
+    size_t skipWhitespaceAvx2(const char *s, size_t length)
+    {
+        const __m256i space = _mm256_set1_epi8(' ');
+        const __m256i tabMinusOne = _mm256_set1_epi8('\t' - 1);
+        const __m256i crPlusOne = _mm256_set1_epi8('\r' + 1);
+        size_t i = 0;
+        for (; i + 32 <= length; i += 32)
+        {
+            const __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(s + i));
+            const __m256i whitespace = _mm256_or_si256(_mm256_cmpeq_epi8(v, space),
+                _mm256_and_si256(_mm256_cmpgt_epi8(v, tabMinusOne), _mm256_cmpgt_epi8(crPlusOne, v)));
+            const unsigned mask = ~static_cast<unsigned>(_mm256_movemask_epi8(whitespace));
+            if (mask)
+            {
+                return i + __builtin_ctz(mask);
+            }
+        }
+        _mm256_zeroupper();
+        return i + skipWhitespaceSse42(s + i, length - i);
+    }
+
+    // AVX-512 handles the tail with masked loads and stores, which do not
+    // touch the bytes outside of the mask.
+
+    inline __mmask64 tailMask(size_t remaining)
+    {
+        return (remaining >= 64) ? ~static_cast<__mmask64>(0) : ((static_cast<__mmask64>(1) << remaining) - 1);
+    }
+
+    HTTP_ACCEPT_TARGET("avx512f,avx512bw")
+    bool lowerAvx512(char *dst, const char *src, size_t length)
+    {
+        const __m512i a = _mm512_set1_epi8('A');
+        const __m512i letters = _mm512_set1_epi8(26);
+        const __m512i caseBit = _mm512_set1_epi8(0x20);
+        const __m512i nibble = _mm512_set1_epi8(0x0f);
+        const __m512i lowClasses = _mm512_loadu_si512(kLowNibbleClasses);
+        const __m512i highClasses = _mm512_loadu_si512(kHighNibbleClasses);
+        __mmask64 invalid = 0;
+        for (size_t i = 0; i < length; i += 64)
+        {
+            const __mmask64 mask = tailMask(length - i);
+            const __m512i v = _mm512_maskz_loadu_epi8(mask, src + i);
+            const __mmask64 upper = _mm512_cmplt_epu8_mask(_mm512_sub_epi8(v, a), letters);
+            _mm512_mask_storeu_epi8(dst + i, mask, _mm512_mask_add_epi8(v, upper, v, caseBit));
+            invalid |= _mm512_mask_testn_epi8_mask(mask, _mm512_shuffle_epi8(lowClasses, _mm512_and_si512(v, nibble)),
+                _mm512_shuffle_epi8(highClasses, _mm512_and_si512(_mm512_srli_epi16(v, 4), nibble)));
+        }
+        return invalid == 0;
+    }
+
+    HTTP_ACCEPT_TARGET("avx512f,avx512bw")
+    size_t findAvx512(const char *s, size_t length, char c)
+    {
+        const __m512i needle = _mm512_set1_epi8(c);
+        for (size_t i = 0; i < length; i += 64)
+        {
+            const __mmask64 mask = tailMask(length - i);
+            const __m512i v = _mm512_maskz_loadu_epi8(mask, s + i);
+            const __mmask64 found = _mm512_cmpeq_epi8_mask(v, needle) & mask;
+            if (found)
+            {
+                return i + countTrailingZeros(found);
+            }
+        }
+        return length;
+    }
+
+    HTTP_ACCEPT_TARGET("avx512f,avx512bw")
+    size_t skipWhitespaceAvx512(const char *s, size_t length)
+    {
+        const __m512i space = _mm512_set1_epi8(' ');
+        const __m512i tab = _mm512_set1_epi8('\t');
+        const __m512i controls = _mm512_set1_epi8('\r' - '\t' + 1);
+        for (size_t i = 0; i < length; i += 64)
+        {
+            const __mmask64 mask = tailMask(length - i);
+            const __m512i v = _mm512_maskz_loadu_epi8(mask, s + i);
+            const __mmask64 whitespace = _mm512_cmpeq_epi8_mask(v, space) | _mm512_cmplt_epu8_mask(_mm512_sub_epi8(v, tab), controls);
+            const __mmask64 other = ~whitespace & mask;
+            if (other)
+            {
+                return i + countTrailingZeros(other);
+            }
+        }
+        return length;
+    }
+
+    // The segment scans look for the next delimiter and, in the same blocks,
+    // for the first and last characters that are not whitespace before it.
+
+    HTTP_ACCEPT_TARGET("sse4.2")
+    size_t scanSegmentSse42(const char *s, size_t length, size_t &begin, size_t &end)
+    {
+        // PCMPESTRI takes explicit lengths, so NUL bytes in a header are not
+        // mistaken for its end and the padding is ignored.
+        const __m128i delimiters = _mm_setr_epi8(',', ';', '=', '/', 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+        const __m128i whitespace = _mm_setr_epi8('\t', '\r', ' ', ' ', 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+        const int kFind = _SIDD_UBYTE_OPS | _SIDD_CMP_EQUAL_ANY | _SIDD_LEAST_SIGNIFICANT;
+        const int kFirst = _SIDD_UBYTE_OPS | _SIDD_CMP_RANGES | _SIDD_MASKED_NEGATIVE_POLARITY | _SIDD_LEAST_SIGNIFICANT;
+        const int kLast = _SIDD_UBYTE_OPS | _SIDD_CMP_RANGES | _SIDD_MASKED_NEGATIVE_POLARITY | _SIDD_MOST_SIGNIFICANT;
+        bool found = false;
+        for (size_t i = 0; i < length; i += 16)
+        {
+            // The padding makes the whole block readable.
+            const int remaining = static_cast<int>(std::min<size_t>(16, length - i));
+            const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(s + i));
+
+            const int delimiter = _mm_cmpestri(delimiters, 4, v, remaining, kFind);
+            const int prefix = std::min(delimiter, remaining);
+            if (!found)
+            {
+                const int first = _mm_cmpestri(whitespace, 4, v, prefix, kFirst);
+                if (first < prefix)
+                {
+                    begin = i + first;
+                    found = true;
+                }
+            }
+            if (found)
+            {
+                const int last = _mm_cmpestri(whitespace, 4, v, prefix, kLast);
+                if (last < prefix)
+                {
+                    end = i + last + 1;
+                }
+            }
+            if (delimiter < remaining)
+            {
+                if (!found)
+                {
+                    begin = end = i + delimiter;
+                }
+                return i + delimiter;
+            }
+        }
+        if (!found)
+        {
+            begin = end = length;
+        }
+        return length;
+    }
+
+    // The AVX2 scan classifies the bytes with plain comparisons, one per
+    // delimiter, and works on bit masks.
+
+    HTTP_ACCEPT_TARGET("avx2")
+    size_t scanSegmentAvx2(const char *s, size_t length, size_t &begin, size_t &end)
+    {
+        const __m256i comma = _mm256_set1_epi8(',');
+        const __m256i semicolon = _mm256_set1_epi8(';');
+        const __m256i equal = _mm256_set1_epi8('=');
+        const __m256i slash = _mm256_set1_epi8('/');
+        const __m256i space = _mm256_set1_epi8(' ');
+        const __m256i tabMinusOne = _mm256_set1_epi8('\t' - 1);
+        const __m256i crPlusOne = _mm256_set1_epi8('\r' + 1);
+        bool found = false;
+        for (size_t i = 0; i < length; i += 32)
+        {
+            // The padding makes the whole block readable.
+            const size_t remaining = std::min<size_t>(32, length - i);
+            const __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(s + i));
+
+            const uint64_t valid = (remaining == 32) ? 0xffffffffu : ((uint64_t(1) << remaining) - 1);
+            const __m256i delimiters = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, comma), _mm256_cmpeq_epi8(v, semicolon)),
+                _mm256_or_si256(_mm256_cmpeq_epi8(v, equal), _mm256_cmpeq_epi8(v, slash)));
+            const __m256i whitespace = _mm256_or_si256(_mm256_cmpeq_epi8(v, space),
+                _mm256_and_si256(_mm256_cmpgt_epi8(v, tabMinusOne), _mm256_cmpgt_epi8(crPlusOne, v)));
+            const uint64_t delimiterMask = static_cast<uint32_t>(_mm256_movemask_epi8(delimiters)) & valid;
+            const uint64_t otherMask = ~static_cast<uint64_t>(static_cast<uint32_t>(_mm256_movemask_epi8(whitespace))) & valid;
+            if (scanMasks(delimiterMask, otherMask, i, found, begin, end))
+            {
+                const size_t delimiter = i + countTrailingZeros(delimiterMask);
+                if (!found)
+                {
+                    begin = end = delimiter;
+                }
+                return delimiter;
+            }
+        }
+        if (!found)
+        {
+            begin = end = length;
+        }
+        return length;
+    }
+
+#endif // HTTP_ACCEPT_X86_KERNELS
+
+    const HttpAcceptKernels::Table kTables[] =
+    {
+        { lowerScalar, findScalar, skipWhitespaceScalar, scanSegmentScalar, HttpAcceptKernels::kScalar },
+#ifdef HTTP_ACCEPT_X86_KERNELS
+        { lowerSse42, findSse42, skipWhitespaceSse42, scanSegmentSse42, HttpAcceptKernels::kSse42 },
+        { lowerAvx2, findAvx2, skipWhitespaceAvx2, scanSegmentAvx2, HttpAcceptKernels::kAvx2 },
+        // Segments are a few bytes long, too short for 512-bit masked loads to pay off.
+        { lowerAvx512, findAvx512, skipWhitespaceAvx512, scanSegmentAvx2, HttpAcceptKernels::kAvx512 },
+#endif
+    };
+
+    const char *const kNames[] = { "scalar", "sse42", "avx2", "avx512" };
+}
+
+std::atomic<const HttpAcceptKernels::Table *> HttpAcceptKernels::s_table(nullptr);
+
+HttpAcceptKernels::Level HttpAcceptKernels::level()
+{
+    return table().level;
+}
+
+HttpAcceptKernels::Level HttpAcceptKernels::supportedLevel()
+{
+#ifdef HTTP_ACCEPT_X86_KERNELS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512bw"))
+    {
+        return kAvx512;
+    }
+    if (__builtin_cpu_supports("avx2"))
+    {
+        return kAvx2;
+    }
+    if (__builtin_cpu_supports("sse4.2"))
+    {
+        return kSse42;
+    }
+#endif
+    return kScalar;
+}
+
+bool HttpAcceptKernels::setLevel(Level level)
+{
+    if ((level < kScalar) || (level > supportedLevel()))
+    {
+        return false;
+    }
+    s_table.store(&kTables[level], std::memory_order_release);
+    return true;
+}
+
+const char *HttpAcceptKernels::name(Level level)
+{
+    return ((level >= kScalar) && (level <= kAvx512)) ? kNames[level] : "unknown";
+}
+
+const HttpAcceptKernels::Table &HttpAcceptKernels::resolve()
+{
+    Level level = supportedLevel();
+
+    // The environment can only lower the level: forcing an unsupported
+    // instruction set would crash on the first negotiation.
+    const char *requested = std::getenv("HTTP_ACCEPT_PARSER_ISA");
+    if (requested)
+    {
+        for (int candidate = kScalar; candidate < level; ++candidate)
+        {
+            if (std::strcmp(requested, kNames[candidate]) == 0)
+            {
+                level = static_cast<Level>(candidate);
+            }
+        }
+    }
+
+    // Concurrent first calls select the same level, so the race is benign.
+    s_table.store(&kTables[level], std::memory_order_release);
+    return kTables[level];
+}
@@ -0,0 +1,151 @@
+/* -*- c++ -*- */
+
+#ifndef HTTP_ACCEPT_KERNELS_H
+#define HTTP_ACCEPT_KERNELS_H
+
+#include <atomic>
+#include <cstddef>
+
+/**
+ * Byte scanning kernels used by HttpAcceptParser, with one implementation per
+ * instruction set level.
+ *
+ * The best level supported by the CPU is detected once, on first use, so a
+ * single binary built without -march flags runs the vectorized kernels where
+ * they are available. The HTTP_ACCEPT_PARSER_ISA environment variable
+ * ("scalar", "sse42", "avx2" or "avx512") lowers the detected level, which is
+ * useful to test every implementation on the same machine.
+ */
+class HttpAcceptKernels
+{
+public:
+
+    /**
+     * @brief Instruction set levels, from the most portable to the widest.
+     */
+    enum Level
+    {
+        kScalar = 0,
+        kSse42  = 1,
+        kAvx2   = 2,
+        kAvx512 = 3
+    };
+
+    /**
+     * Number of readable bytes that must follow a string passed to scanSegment().
+     */
+    static const size_t kPadding = 32;
+
+    /**
+     * @brief Kernels of one level.
+     */
+    struct Table
+    {
+        /**
+         * Copies a string, converting ASCII letters to lowercase, and checks
+         * in the same pass that it only contains token characters (RFC 7230
+         * tchar), spaces, tabs, delimiters, quotes and backslashes.
+         *
+         * @param[out] dst destination, which can be the source itself.
+         * @param[in] src string that will be converted.
+         * @param[in] length number of characters to convert.
+         *
+         * @return False if the string contains other characters. Returns True otherwise.
+         */
+        bool (*lower)(char *dst, const char *src, size_t length);
+
+        /**
+         * Finds the first occurrence of a character.
+         *
+         * @param[in] s string to scan.
+         * @param[in] length number of characters to scan.
+         * @param[in] c character to find.
+         *
+         * @return the position of the character, or length if it is not found.
+         */
+        size_t (*find)(const char *s, size_t length, char c);
+
+        /**
+         * Skips leading whitespace (" \t\n\r\f\v").
+         *
+         * @param[in] s string to scan.
+         * @param[in] length number of characters to scan.
+         *
+         * @return the position of the first character that is not whitespace, or length if there is none.
+         */
+        size_t (*skipWhitespace)(const char *s, size_t length);
+
+        /**
+         * Finds the first delimiter (',', ';', '=' or '/') and trims the
+         * segment preceding it in the same scan. The string must be followed
+         * by kPadding readable bytes, which are ignored.
+         *
+         * @param[in] s string to scan.
+         * @param[in] length number of characters to scan.
+         * @param[out] begin position of the first character of the segment that is not whitespace.
+         * @param[out] end position following the last character of the segment that is not whitespace.
+         * Both are set to the position of the delimiter if the segment is only whitespace.
+         *
+         * @return the position of the delimiter, or length if there is none.
+         */
+        size_t (*scanSegment)(const char *s, size_t length, size_t &begin, size_t &end);
+
+        Level level;
+    };
+
+    /**
+     * Returns the kernels of the current level, detecting it on first use.
+     */
+    static const Table &table()
+    {
+        const Table *table = s_table.load(std::memory_order_acquire);
+        return table ? *table : resolve();
+    }
+
+    /**
+     * Returns the current level.
+     */
+    static Level level();
+
+    /**
+     * Returns the widest level supported by the CPU, ignoring the environment.
+     */
+    static Level supportedLevel();
+
+    /**
+     * Changes the current level, e.g. to compare the levels in a benchmark.
+     * Negotiations running concurrently can switch to the new level between
+     * two kernel calls. Every call runs entirely at one level, and every level
+     * gives the same results, so a negotiation is not affected otherwise.
+     *
+     * @param[in] level the new level.
+     *
+     * @return False if the CPU does not support the level. Returns True otherwise.
+     */
+    static bool setLevel(Level level);
+
+    /**
+     * Returns the name of a level, as accepted by HTTP_ACCEPT_PARSER_ISA.
+     */
+    static const char *name(Level level);
+
+private:
+
+    /**
+     * Constructor.
+     */
+    HttpAcceptKernels()
+    {
+    }
+
+    /**
+     * Publishes the kernels of the level selected by the CPU and the environment.
+     *
+     * @return the published kernels.
+     */
+    static const Table &resolve();
+
+    static std::atomic<const Table *> s_table;
+};
+
+#endif // HTTP_ACCEPT_KERNELS_H
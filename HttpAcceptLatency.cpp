@@ -0,0 +1,206 @@
+/* -*- c++ -*- */
+
+#include <cstdio>
+#include <fstream>
+#include "HttpAcceptLatency.h"
+#include "HttpAcceptThreadRegistry.h"
+
+namespace
+{
+    const unsigned kHistogramCount = HttpAcceptLatency::kHeaderLengthClasses * HttpAcceptLatency::kOfferCountClasses;
+    const unsigned kSubBucketBits = 4;
+    static_assert((1u << kSubBucketBits) == HttpAcceptLatency::kSubBuckets, "kSubBuckets must be 2^kSubBucketBits");
+
+    const char *const kHeaderLengthLabels[HttpAcceptLatency::kHeaderLengthClasses] = { "0-31", "32-63", "64-127", "128-255", "256-511", "512+" };
+    const char *const kOfferCountLabels[HttpAcceptLatency::kOfferCountClasses] = { "0-1", "2-3", "4-7", "8-15", "16+" };
+    const double kQuantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+
+    struct ThreadHistogram
+    {
+        std::atomic<uint64_t> counts[HttpAcceptLatency::kBucketCount];
+        std::atomic<uint64_t> count;
+        std::atomic<uint64_t> sum;
+        std::atomic<uint64_t> max;
+    };
+
+    struct ThreadHistograms
+    {
+        ThreadHistogram histograms[kHistogramCount];
+    };
+
+    struct HistogramTotals
+    {
+        HttpAcceptLatency::Histogram histograms[kHistogramCount];
+    };
+
+    // Only the owning thread writes its histograms: a relaxed load and store
+    // is enough, and cheaper than an atomic read-modify-write.
+    inline void increase(std::atomic<uint64_t> &target, uint64_t value)
+    {
+        target.store(target.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+    }
+
+    void merge(HttpAcceptLatency::Histogram &histogram, const ThreadHistogram &thread)
+    {
+        for (unsigned bucket = 0; bucket < HttpAcceptLatency::kBucketCount; ++bucket)
+        {
+            histogram.counts[bucket] += thread.counts[bucket].load(std::memory_order_relaxed);
+        }
+        histogram.count += thread.count.load(std::memory_order_relaxed);
+        histogram.sum += thread.sum.load(std::memory_order_relaxed);
+        const uint64_t max = thread.max.load(std::memory_order_relaxed);
+        if (max > histogram.max)
+        {
+            histogram.max = max;
+        }
+    }
+
+    void merge(HistogramTotals &totals, const ThreadHistograms &thread)
+    {
+        for (unsigned i = 0; i < kHistogramCount; ++i)
+        {
+            merge(totals.histograms[i], thread.histograms[i]);
+        }
+    }
+
+    typedef HttpAcceptThreadRegistry<ThreadHistograms, HistogramTotals, merge> Registry;
+
+    unsigned sizeClass(size_t value, unsigned firstBits, unsigned classes)
+    {
+        unsigned sizeClass = 0;
+        for (value >>= firstBits; value && (sizeClass + 1 < classes); value >>= 1)
+        {
+            ++sizeClass;
+        }
+        return sizeClass;
+    }
+}
+
+std::atomic<bool> HttpAcceptLatency::s_enabled(false);
+
+uint64_t HttpAcceptLatency::Histogram::valueAtQuantile(double quantile) const
+{
+    if (!count)
+    {
+        return 0;
+    }
+
+    // The rank of the quantile, from 1 to count.
+    uint64_t rank = static_cast<uint64_t>(quantile * static_cast<double>(count) + 0.5);
+    rank = (rank < 1) ? 1 : ((rank > count) ? count : rank);
+    uint64_t seen = 0;
+    for (unsigned bucket = 0; bucket < kBucketCount; ++bucket)
+    {
+        seen += counts[bucket];
+        if (seen >= rank)
+        {
+            const uint64_t upperBound = bucketUpperBound(bucket);
+            return (upperBound < max) ? upperBound : max;
+        }
+    }
+    return max;
+}
+
+void HttpAcceptLatency::record(size_t headerLength, size_t offerCount, uint64_t nanoseconds)
+{
+    ThreadHistogram &histogram = Registry::local().histograms[histogramIndex(headerLength, offerCount)];
+    increase(histogram.counts[bucketIndex(nanoseconds)], 1);
+    increase(histogram.count, 1);
+    increase(histogram.sum, nanoseconds);
+    if (nanoseconds > histogram.max.load(std::memory_order_relaxed))
+    {
+        histogram.max.store(nanoseconds, std::memory_order_relaxed);
+    }
+}
+
+unsigned HttpAcceptLatency::histogramIndex(size_t headerLength, size_t offerCount)
+{
+    return sizeClass(headerLength, 5, kHeaderLengthClasses) * kOfferCountClasses + sizeClass(offerCount, 1, kOfferCountClasses);
+}
+
+unsigned HttpAcceptLatency::bucketIndex(uint64_t nanoseconds)
+{
+    if (nanoseconds < kSubBuckets)
+    {
+        return static_cast<unsigned>(nanoseconds);
+    }
+
+    // The power of two selects a group of kSubBuckets buckets, and the bits
+    // that follow the most significant one select the bucket in the group.
+    const unsigned msb = 63 - static_cast<unsigned>(__builtin_clzll(nanoseconds));
+    const unsigned bucket = (msb - kSubBucketBits + 1) * kSubBuckets + static_cast<unsigned>(nanoseconds >> (msb - kSubBucketBits)) - kSubBuckets;
+    return (bucket < kBucketCount) ? bucket : kBucketCount - 1;
+}
+
+uint64_t HttpAcceptLatency::bucketUpperBound(unsigned bucket)
+{
+    if (bucket < kSubBuckets)
+    {
+        return bucket;
+    }
+    if (bucket >= kBucketCount - 1)
+    {
+        return UINT64_MAX;
+    }
+    const unsigned group = bucket / kSubBuckets;
+    const uint64_t subBucket = bucket % kSubBuckets + kSubBuckets;
+    return ((subBucket + 1) << (group - 1)) - 1;
+}
+
+std::vector<HttpAcceptLatency::Histogram> HttpAcceptLatency::getHistograms()
+{
+    const HistogramTotals totals = Registry::collect();
+    return std::vector<Histogram>(totals.histograms, totals.histograms + kHistogramCount);
+}
+
+std::string HttpAcceptLatency::exportPrometheus(const std::string &name)
+{
+    const std::vector<Histogram> histograms = getHistograms();
+    std::string text = "# HELP " + name + " Duration of the HttpAcceptParser negotiations.\n# TYPE " + name + " summary\n";
+    char line[256];
+    for (unsigned headerLengthClass = 0; headerLengthClass < kHeaderLengthClasses; ++headerLengthClass)
+    {
+        for (unsigned offerCountClass = 0; offerCountClass < kOfferCountClasses; ++offerCountClass)
+        {
+            const Histogram &histogram = histograms[headerLengthClass * kOfferCountClasses + offerCountClass];
+            if (!histogram.count)
+            {
+                continue;
+            }
+
+            const char *headerLength = kHeaderLengthLabels[headerLengthClass];
+            const char *offerCount = kOfferCountLabels[offerCountClass];
+            for (const double quantile : kQuantiles)
+            {
+                std::snprintf(line, sizeof(line), "%s{header_bytes=\"%s\",offers=\"%s\",quantile=\"%g\"} %.9g\n", name.c_str(), headerLength, offerCount,
+                    quantile, static_cast<double>(histogram.valueAtQuantile(quantile)) * 1e-9);
+                text += line;
+            }
+            std::snprintf(line, sizeof(line), "%s_sum{header_bytes=\"%s\",offers=\"%s\"} %.9g\n", name.c_str(), headerLength, offerCount,
+                static_cast<double>(histogram.sum) * 1e-9);
+            text += line;
+            std::snprintf(line, sizeof(line), "%s_count{header_bytes=\"%s\",offers=\"%s\"} %llu\n", name.c_str(), headerLength, offerCount,
+                static_cast<unsigned long long>(histogram.count));
+            text += line;
+        }
+    }
+    return text;
+}
+
+bool HttpAcceptLatency::exportToFile(const std::string &path, const std::string &name)
+{
+    const std::string text = exportPrometheus(name);
+
+    // Write a temporary file and rename it, so that the collector never reads
+    // a partially written file.
+    const std::string temporaryPath = path + ".tmp";
+    {
+        std::ofstream file(temporaryPath.c_str(), std::ios::binary | std::ios::trunc);
+        if (!file.write(text.data(), static_cast<std::streamsize>(text.size())) || !file.flush())
+        {
+            std::remove(temporaryPath.c_str());
+            return false;
+        }
+    }
+    return std::rename(temporaryPath.c_str(), path.c_str()) == 0;
+}
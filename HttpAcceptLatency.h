@@ -0,0 +1,204 @@
+/* -*- c++ -*- */
+
+#ifndef HTTP_ACCEPT_LATENCY_H
+#define HTTP_ACCEPT_LATENCY_H
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/**
+ * Latency histograms of the negotiations, by length of the 'Accept' header
+ * and by number of offers, exported in the Prometheus text format.
+ *
+ * Recording is disabled until setEnabled(true) is called. When enabled, the
+ * entry points of HttpAcceptParser time every negotiation and add it to
+ * log-linear histograms of the calling thread: durations are bucketed by
+ * power of two, and every power of two is split into kSubBuckets linear
+ * buckets, so the relative error of a percentile is below 1/kSubBuckets.
+ *
+ * Only the owning thread writes its histograms, with relaxed stores, so
+ * recording never locks nor contends. getHistograms() merges the histograms
+ * of the live threads and of the threads that have exited.
+ */
+class HttpAcceptLatency
+{
+public:
+
+    /**
+     * Classes of 'Accept' header length: 0-31, 32-63, 64-127, 128-255, 256-511 and 512+ bytes.
+     */
+    static const unsigned kHeaderLengthClasses = 6;
+
+    /**
+     * Classes of offer count: 0-1, 2-3, 4-7, 8-15 and 16+ offers.
+     */
+    static const unsigned kOfferCountClasses = 5;
+
+    /**
+     * Linear buckets per power of two.
+     */
+    static const unsigned kSubBuckets = 16;
+
+    /**
+     * Number of buckets of a histogram. Durations of 2^24 ns (16.7 ms) and
+     * longer share the last bucket.
+     */
+    static const unsigned kBucketCount = kSubBuckets + 20 * kSubBuckets;
+
+    /**
+     * @brief Merged histogram of a header length class and an offer count class.
+     */
+    struct Histogram
+    {
+        uint64_t counts[kBucketCount]; ///< Negotiations per bucket.
+        uint64_t count;                ///< Negotiations.
+        uint64_t sum;                  ///< Total duration, in nanoseconds.
+        uint64_t max;                  ///< Longest duration, in nanoseconds.
+
+        /**
+         * Returns the duration under which a fraction of the negotiations completed.
+         *
+         * @param[in] quantile fraction of the negotiations, from 0 to 1 (0.99 for the p99).
+         *
+         * @return the highest duration of the bucket holding the quantile, in
+         * nanoseconds, or 0 if the histogram is empty.
+         */
+        uint64_t valueAtQuantile(double quantile) const;
+    };
+
+    /**
+     * Enables or disables recording, for every thread.
+     *
+     * @param[in] enabled True to record the negotiations.
+     */
+    static void setEnabled(bool enabled)
+    {
+        s_enabled.store(enabled, std::memory_order_relaxed);
+    }
+
+    /**
+     * Returns True if recording is enabled.
+     */
+    static bool isEnabled()
+    {
+        return s_enabled.load(std::memory_order_relaxed);
+    }
+
+    /**
+     * Adds a negotiation to the histograms of the calling thread.
+     *
+     * @param[in] headerLength length of the 'Accept' header.
+     * @param[in] offerCount number of available content types.
+     * @param[in] nanoseconds duration of the negotiation.
+     */
+    static void record(size_t headerLength, size_t offerCount, uint64_t nanoseconds);
+
+    /**
+     * Returns the position of the histogram of a negotiation in the list
+     * returned by getHistograms().
+     *
+     * @param[in] headerLength length of the 'Accept' header.
+     * @param[in] offerCount number of available content types.
+     *
+     * @return headerLengthClass * kOfferCountClasses + offerCountClass.
+     */
+    static unsigned histogramIndex(size_t headerLength, size_t offerCount);
+
+    /**
+     * Returns the bucket of a duration.
+     *
+     * @param[in] nanoseconds the duration.
+     *
+     * @return the bucket, lower than kBucketCount.
+     */
+    static unsigned bucketIndex(uint64_t nanoseconds);
+
+    /**
+     * Returns the highest duration of a bucket, in nanoseconds.
+     */
+    static uint64_t bucketUpperBound(unsigned bucket);
+
+    /**
+     * Returns the histograms of every thread, merged.
+     *
+     * @return kHeaderLengthClasses * kOfferCountClasses histograms, ordered as histogramIndex().
+     */
+    static std::vector<Histogram> getHistograms();
+
+    /**
+     * Exports the histograms in the Prometheus text exposition format, as a
+     * summary with the p50, p90, p99 and p999 quantiles in seconds, labelled
+     * with the header length class and the offer count class. Empty
+     * histograms are omitted.
+     *
+     * @param[in] name name of the metric.
+     *
+     * @return the exposition text.
+     */
+    static std::string exportPrometheus(const std::string &name = "http_accept_negotiation_seconds");
+
+    /**
+     * Writes exportPrometheus() to a file, for a collector reading text files
+     * such as the textfile collector of the node exporter.
+     *
+     * @param[in] path destination file, replaced atomically.
+     * @param[in] name name of the metric.
+     *
+     * @return False if the file cannot be written. Returns True otherwise.
+     */
+    static bool exportToFile(const std::string &path, const std::string &name = "http_accept_negotiation_seconds");
+
+    /**
+     * @brief Times a negotiation from its construction to its destruction, if
+     * recording is enabled.
+     */
+    class Scope
+    {
+    public:
+
+        Scope(size_t headerLength, size_t offerCount)
+            : m_headerLength(headerLength), m_offerCount(offerCount), m_enabled(isEnabled())
+        {
+            if (m_enabled)
+            {
+                m_start = std::chrono::steady_clock::now();
+            }
+        }
+
+        ~Scope()
+        {
+            if (m_enabled)
+            {
+                const auto elapsed = std::chrono::steady_clock::now() - m_start;
+                record(m_headerLength, m_offerCount, static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count()));
+            }
+        }
+
+    private:
+
+        Scope(const Scope &);
+        Scope &operator=(const Scope &);
+
+        size_t                                m_headerLength;
+        size_t                                m_offerCount;
+        bool                                  m_enabled;
+        std::chrono::steady_clock::time_point m_start;
+    };
+
+private:
+
+    /**
+     * Constructor.
+     */
+    HttpAcceptLatency()
+    {
+    }
+
+    static std::atomic<bool> s_enabled;
+};
+
+#endif // HTTP_ACCEPT_LATENCY_H
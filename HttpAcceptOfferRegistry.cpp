@@ -0,0 +1,92 @@
+/* -*- c++ -*- */
+
+#include "HttpAcceptOfferRegistry.h"
+#include "HttpAcceptRcu.h"
+
+HttpAcceptOfferRegistry::HttpAcceptOfferRegistry()
+    : m_routes(new Routes), m_generation(0)
+{
+}
+
+HttpAcceptOfferRegistry::~HttpAcceptOfferRegistry()
+{
+    // No reader can use the registry while it is being destroyed.
+    delete m_routes.load();
+}
+
+uint64_t HttpAcceptOfferRegistry::publish(const std::string &routeId, const std::vector<std::string> &availableContentTypes)
+{
+    std::lock_guard<std::mutex> lock(m_writerMutex);
+    const uint64_t generation = m_generation.load(std::memory_order_relaxed) + 1;
+
+    // Compile outside of the snapshot, then copy the snapshot: offer sets are
+    // shared between versions, so the copy only duplicates the index.
+    std::shared_ptr<const OfferSet> offerSet(new OfferSet(availableContentTypes, generation));
+    Routes *routes = new Routes(*m_routes.load());
+    (*routes)[routeId] = std::move(offerSet);
+
+    m_generation.store(generation, std::memory_order_relaxed);
+    publishLocked(routes);
+    return generation;
+}
+
+uint64_t HttpAcceptOfferRegistry::publish(const std::map<std::string, std::vector<std::string>> &routes)
+{
+    std::lock_guard<std::mutex> lock(m_writerMutex);
+    const uint64_t generation = m_generation.load(std::memory_order_relaxed) + 1;
+
+    Routes *snapshot = new Routes;
+    snapshot->reserve(routes.size());
+    for (const auto &route : routes)
+    {
+        snapshot->emplace(route.first, std::make_shared<const OfferSet>(route.second, generation));
+    }
+
+    m_generation.store(generation, std::memory_order_relaxed);
+    publishLocked(snapshot);
+    return generation;
+}
+
+bool HttpAcceptOfferRegistry::remove(const std::string &routeId)
+{
+    std::lock_guard<std::mutex> lock(m_writerMutex);
+    const Routes *current = m_routes.load();
+    if (current->find(routeId) == current->end())
+    {
+        return false;
+    }
+
+    Routes *routes = new Routes(*current);
+    routes->erase(routeId);
+    m_generation.fetch_add(1, std::memory_order_relaxed);
+    publishLocked(routes);
+    return true;
+}
+
+const HttpAcceptOfferRegistry::OfferSet *HttpAcceptOfferRegistry::find(const std::string &routeId) const
+{
+    const Routes *routes = m_routes.load();
+    const auto route = routes->find(routeId);
+    return (route != routes->end()) ? route->second.get() : nullptr;
+}
+
+std::string HttpAcceptOfferRegistry::parse(const std::string &routeId, const std::string &acceptValue, uint64_t *generation) const
+{
+    HttpAcceptRcu::ReadGuard guard;
+    const OfferSet *offerSet = find(routeId);
+    if (generation)
+    {
+        *generation = offerSet ? offerSet->generation() : 0;
+    }
+    return offerSet ? HttpAcceptParser::parse(acceptValue, *offerSet) : std::string();
+}
+
+uint64_t HttpAcceptOfferRegistry::generation() const
+{
+    return m_generation.load(std::memory_order_relaxed);
+}
+
+void HttpAcceptOfferRegistry::publishLocked(const Routes *routes)
+{
+    HttpAcceptRcu::retire(m_routes.exchange(routes));
+}
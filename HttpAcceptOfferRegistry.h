@@ -0,0 +1,117 @@
+/* -*- c++ -*- */
+
+#ifndef HTTP_ACCEPT_OFFER_REGISTRY_H
+#define HTTP_ACCEPT_OFFER_REGISTRY_H
+
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "HttpAcceptParser.h"
+
+/**
+ * Registry of precompiled offer sets keyed by route id, for configurations
+ * that are reloaded while requests are being served.
+ *
+ * Reads never block and never take a lock: the current version of the
+ * registry is an immutable snapshot published through HttpAcceptRcu. Writers
+ * are serialized, copy the snapshot, and publish the copy. Every offer set
+ * carries the registry generation at which it was published, so that caches
+ * keyed by generation are invalidated by a simple integer comparison.
+ */
+class HttpAcceptOfferRegistry
+{
+public:
+
+    typedef HttpAcceptParser::OfferSet OfferSet;
+
+    /**
+     * Constructor.
+     */
+    HttpAcceptOfferRegistry();
+
+    /**
+     * Destructor.
+     */
+    ~HttpAcceptOfferRegistry();
+
+    /**
+     * Compiles and publishes a new version of the offer set of a route.
+     *
+     * @param[in] routeId identifier of the route.
+     * @param[in] availableContentTypes list of available content types ordered by preference.
+     *
+     * @return the generation of the published offer set.
+     */
+    uint64_t publish(const std::string &routeId, const std::vector<std::string> &availableContentTypes);
+
+    /**
+     * Compiles and publishes the offer sets of every route at once, replacing
+     * the whole content of the registry. Readers observe either the previous
+     * configuration or the new one, never a mix of both.
+     *
+     * @param[in] routes list of available content types of every route.
+     *
+     * @return the generation of the published offer sets.
+     */
+    uint64_t publish(const std::map<std::string, std::vector<std::string>> &routes);
+
+    /**
+     * Unpublishes the offer set of a route.
+     *
+     * @param[in] routeId identifier of the route.
+     *
+     * @return False if the route was not registered. Returns True otherwise.
+     */
+    bool remove(const std::string &routeId);
+
+    /**
+     * Looks up the current offer set of a route. The returned pointer is only
+     * valid while the calling thread holds a HttpAcceptRcu::ReadGuard.
+     *
+     * @param[in] routeId identifier of the route.
+     *
+     * @return the offer set, or nullptr if the route is not registered.
+     */
+    const OfferSet *find(const std::string &routeId) const;
+
+    /**
+     * Negotiates an 'Accept' header against the current offer set of a route.
+     *
+     * @param[in] routeId identifier of the route.
+     * @param[in] acceptValue value of the 'Accept' header.
+     * @param[out] generation if not null, receives the generation of the offer set that was used (0 if none).
+     *
+     * @return the selected content type, or an empty string if the route is not registered.
+     */
+    std::string parse(const std::string &routeId, const std::string &acceptValue, uint64_t *generation = nullptr) const;
+
+    /**
+     * Returns the generation of the last publication.
+     */
+    uint64_t generation() const;
+
+private:
+
+    HttpAcceptOfferRegistry(const HttpAcceptOfferRegistry &);
+    HttpAcceptOfferRegistry &operator=(const HttpAcceptOfferRegistry &);
+
+    typedef std::unordered_map<std::string, std::shared_ptr<const OfferSet>> Routes;
+
+    /**
+     * Publishes a new snapshot of the routes. The writer mutex must be held.
+     *
+     * @param[in] routes new snapshot, owned by the registry from now on.
+     */
+    void publishLocked(const Routes *routes);
+
+    std::atomic<const Routes *> m_routes;
+    std::atomic<uint64_t>       m_generation;
+    std::mutex                  m_writerMutex;
+};
+
+#endif // HTTP_ACCEPT_OFFER_REGISTRY_H
@@ -1,83 +1,746 @@
 /* -*- c++ -*- */
 
-#include <sstream>
-#include <iostream>
 #include <algorithm>
+#include <cfloat>
+#include <chrono>
+#include <cstring>
 #include "HttpAcceptParser.h"
+#include "HttpAcceptCounters.h"
+#include "HttpAcceptHash.h"
+#include "HttpAcceptInstrumentation.h"
+#include "HttpAcceptKernels.h"
+#include "HttpAcceptLatency.h"
+#include "HttpAcceptReference.h"
+#include "HttpAcceptTrace.h"
+
+namespace
+{
+    // Working memory of the overloads that do not take a scratch argument.
+    thread_local HttpAcceptParser::NegotiationScratch t_scratch;
+
+    inline bool isWhitespace(const char c)
+    {
+        return (c == ' ') || (c == '\t') || (c == '\n') || (c == '\r') || (c == '\f') || (c == '\v');
+    }
+
+    inline size_t find(const char *s, size_t begin, size_t end, const char c)
+    {
+        return begin + HttpAcceptKernels::table().find(s + begin, end - begin, c);
+    }
+
+    inline bool equals(const char *a, size_t aLength, const char *b, size_t bLength)
+    {
+        return (aLength == bLength) && (std::memcmp(a, b, aLength) == 0);
+    }
+
+    inline bool isWildcard(const char *s, size_t length)
+    {
+        return (length == 1) && (s[0] == '*');
+    }
+
+    // Determines whether a subtype is a wildcard followed by a structured syntax suffix ("*+json").
+    inline bool isWildcardSuffix(const char *s, size_t length)
+    {
+        return (length > 2) && (s[0] == '*') && (s[1] == '+');
+    }
+
+    // Seed of the full hash of the ranges, drawn per process so that a
+    // client cannot craft distinct ranges that share a probe sequence.
+    const uint64_t g_rangeSeed = HttpAcceptHash::mix(static_cast<uint64_t>(std::chrono::steady_clock::now().time_since_epoch().count()) ^
+        reinterpret_cast<uintptr_t>(&t_scratch));
+
+    // Hashes a media-range from its lengths and its outer characters, which
+    // tell apart the types and subtypes found in practice, or in full. Slots
+    // are compared in full, so collisions only cost probes.
+    inline uint64_t hashRange(const char *type, size_t typeLength, const char *subtype, size_t subtypeLength, bool fullHash)
+    {
+        if (fullHash)
+        {
+            return HttpAcceptHash::hash(subtype, subtypeLength, HttpAcceptHash::hash(type, typeLength, g_rangeSeed));
+        }
+
+        uint64_t h = typeLength | (subtypeLength << 8);
+        if (typeLength)
+        {
+            h |= (static_cast<uint64_t>(static_cast<unsigned char>(type[0])) << 16) | (static_cast<uint64_t>(static_cast<unsigned char>(type[typeLength - 1])) << 24);
+        }
+        if (subtypeLength)
+        {
+            h |= (static_cast<uint64_t>(static_cast<unsigned char>(subtype[0])) << 32) | (static_cast<uint64_t>(static_cast<unsigned char>(subtype[subtypeLength - 1])) << 40);
+        }
+        return (h * 0x9e3779b97f4a7c15ULL) >> 24;
+    }
+
+    // Parses the common form of a quality value, up to 7 digits with at most
+    // one decimal point, without copying it. Both the digits and the power of
+    // ten are exact floats, so their quotient is rounded once, as strtof()
+    // would round the decimal string. Other forms are left to stringToFloat().
+    inline bool parseQualityValue(const char *s, size_t length, float *f)
+    {
+#if FLT_EVAL_METHOD == 0
+        static const float kPowersOfTen[] = { 1e0f, 1e1f, 1e2f, 1e3f, 1e4f, 1e5f, 1e6f, 1e7f };
+        if ((length == 0) || (length > 8))
+        {
+            return false;
+        }
+        uint32_t mantissa = 0;
+        size_t digits = 0;
+        size_t decimals = 0;
+        bool point = false;
+        for (size_t i = 0; i < length; ++i)
+        {
+            const unsigned digit = static_cast<unsigned char>(s[i]) - '0';
+            if (digit < 10)
+            {
+                mantissa = mantissa * 10 + digit;
+                ++digits;
+                decimals += point;
+            }
+            else if ((s[i] == '.') && !point)
+            {
+                point = true;
+            }
+            else
+            {
+                return false;
+            }
+        }
+        if ((digits == 0) || (digits > 7))
+        {
+            return false;
+        }
+        *f = static_cast<float>(mantissa) / kPowersOfTen[decimals];
+        return true;
+#else
+        (void)s;
+        (void)length;
+        (void)f;
+        return false;
+#endif
+    }
+
+    // Identifier of the parameters and strings that no available content type declares.
+    const uint64_t kNotInterned = ~static_cast<uint64_t>(0);
+
+    // Suffix identifier of the content types without a structured syntax
+    // suffix, and flag of the suffixes that follow a wildcard ("*+json").
+    const uint32_t kNoSuffix = ~static_cast<uint32_t>(0);
+    const uint32_t kWildcardSuffix = static_cast<uint32_t>(1) << 31;
+
+    // Removes the quotes around a parameter value.
+    inline void unquote(const char *s, size_t &begin, size_t &end)
+    {
+        if ((end - begin >= 2) && (s[begin] == '"') && (s[end - 1] == '"'))
+        {
+            ++begin;
+            --end;
+        }
+    }
+
+    // Returns the position of a string in a list, or kNotInterned if it is
+    // not there. The list is indexed by an open addressing table of positions
+    // plus one, which only the offer set fills, so a header cannot lengthen
+    // its probe sequences.
+    inline uint64_t lookup(const std::vector<std::string> &strings, const std::vector<uint32_t> &slots, const char *s, size_t length)
+    {
+        const size_t mask = slots.size() - 1;
+        for (size_t slot = slots.empty() ? 0 : (HttpAcceptHash::hash(s, length) & mask); !slots.empty() && (slots[slot] != 0); slot = (slot + 1) & mask)
+        {
+            HTTP_ACCEPT_OPERATIONS(1);
+            const std::string &string = strings[slots[slot] - 1];
+            if (equals(string.data(), string.size(), s, length))
+            {
+                return slots[slot] - 1;
+            }
+        }
+        return kNotInterned;
+    }
+
+    // Adds the string at a position of a list to the table indexing it.
+    void insertSlot(const std::vector<std::string> &strings, std::vector<uint32_t> &slots, size_t position)
+    {
+        const size_t mask = slots.size() - 1;
+        size_t slot = HttpAcceptHash::hash(strings[position]) & mask;
+        while (slots[slot] != 0)
+        {
+            slot = (slot + 1) & mask;
+        }
+        slots[slot] = static_cast<uint32_t>(position + 1);
+    }
+
+    // Returns the position of a string in an indexed list, appending it if it
+    // is not there. The table is kept at most half full.
+    uint64_t intern(std::vector<std::string> &strings, std::vector<uint32_t> &slots, const char *s, size_t length)
+    {
+        const uint64_t position = lookup(strings, slots, s, length);
+        if (position != kNotInterned)
+        {
+            return position;
+        }
+        strings.push_back(std::string(s, length));
+        if (2 * strings.size() > slots.size())
+        {
+            slots.assign(std::max<size_t>(16, 2 * slots.size()), 0);
+            for (size_t i = 0; i < strings.size(); ++i)
+            {
+                insertSlot(strings, slots, i);
+            }
+        }
+        else
+        {
+            insertSlot(strings, slots, strings.size() - 1);
+        }
+        return strings.size() - 1;
+    }
+
+    // Determines whether every key of a list is in another list.
+    inline bool containsKeys(const uint64_t *keys, size_t count, const uint64_t *requiredKeys, size_t requiredCount)
+    {
+        for (size_t i = 0; i < requiredCount; ++i)
+        {
+            if (std::find(keys, keys + count, requiredKeys[i]) == keys + count)
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Returns the number of distinct keys of a sorted list.
+    inline size_t countKeys(const uint64_t *keys, size_t count)
+    {
+        size_t distinct = 0;
+        for (size_t i = 0; i < count; ++i)
+        {
+            distinct += (i == 0) || (keys[i] != keys[i - 1]);
+        }
+        return distinct;
+    }
+
+    // Hashes the distinct keys of a sorted list.
+    inline uint64_t hashKeys(const uint64_t *keys, size_t count, uint64_t seed)
+    {
+        uint64_t h = seed;
+        for (size_t i = 0; i < count; ++i)
+        {
+            if ((i == 0) || (keys[i] != keys[i - 1]))
+            {
+                h = HttpAcceptHash::mix(h ^ keys[i]);
+            }
+        }
+        return h;
+    }
+
+    // Determines whether two sorted lists hold the same distinct keys.
+    inline bool equalKeys(const uint64_t *a, size_t aCount, const uint64_t *b, size_t bCount)
+    {
+        size_t i = 0;
+        size_t j = 0;
+        while ((i < aCount) && (j < bCount))
+        {
+            const uint64_t key = a[i];
+            if (b[j] != key)
+            {
+                return false;
+            }
+            while ((i < aCount) && (a[i] == key))
+            {
+                ++i;
+            }
+            while ((j < bCount) && (b[j] == key))
+            {
+                ++j;
+            }
+        }
+        return (i == aCount) && (j == bCount);
+    }
+
+    // Orders the retained parameters by the position of their media-range.
+    struct ParameterOrder
+    {
+        bool operator()(const HttpAcceptParser::NegotiationScratch::Parameter &parameter, int order) const
+        {
+            return parameter.order < order;
+        }
+
+        bool operator()(int order, const HttpAcceptParser::NegotiationScratch::Parameter &parameter) const
+        {
+            return order < parameter.order;
+        }
+    };
+
+    // Part of an 'Accept' header being tokenized.
+    enum ParseState
+    {
+        kMediaType,
+        kSubtype,
+        kParameterName,
+        kParameterValue
+    };
+
+    // Trimmed bounds of a piece of the header. A piece can span several
+    // scanned segments when it contains delimiters that do not end it, such
+    // as the '/' of a media-range or a '=' in a parameter value.
+    struct Piece
+    {
+        size_t begin;
+        size_t end;
+
+        Piece() : begin(0), end(0)
+        {
+        }
+
+        bool empty() const
+        {
+            return begin == end;
+        }
+
+        void append(size_t segmentBegin, size_t segmentEnd)
+        {
+            if (segmentBegin < segmentEnd)
+            {
+                begin = empty() ? segmentBegin : begin;
+                end = segmentEnd;
+            }
+        }
+    };
+}
+
+HttpAcceptParser::OfferSet::OfferSet(const std::vector<std::string> &availableContentTypes, uint64_t generation, unsigned flags)
+    : m_contentTypes(availableContentTypes), m_results(availableContentTypes), m_generation(generation),
+      m_fingerprint(HttpAcceptHash::fingerprint(availableContentTypes)), m_flags(flags)
+{
+    if (m_flags)
+    {
+        // The matching options change the results, so they are part of the fingerprint.
+        m_fingerprint = HttpAcceptHash::mix(m_fingerprint ^ m_flags);
+    }
+
+    // Normalize every content type in place, keeping the trimmed lowercase
+    // form of the valid ones as the result returned when they are selected.
+    std::string normalized;
+    for (size_t index = 0; index < m_results.size(); ++index)
+    {
+        std::string &contentTypeStr = m_results[index];
+        const size_t mediaTypeEnd = (m_flags & kMatchParameters) ? std::min(contentTypeStr.find(';'), contentTypeStr.size()) : contentTypeStr.size();
+        const size_t keyCount = m_parameterKeys.size();
+        ParsedContentType normalizedContentType;
+        if (normalizeContentType(&contentTypeStr[0], mediaTypeEnd, normalizedContentType))
+        {
+            normalized.assign(normalizedContentType.type, normalizedContentType.subtype + normalizedContentType.subtypeLength);
+            if (normalizeParameters(&contentTypeStr[0] + mediaTypeEnd, contentTypeStr.size() - mediaTypeEnd, normalized))
+            {
+                // The parameters of a content type are matched as a set, whose
+                // subsets are looked up in the range index in sorted order.
+                std::sort(m_parameterKeys.begin() + keyCount, m_parameterKeys.end());
+                m_parameterKeys.erase(std::unique(m_parameterKeys.begin() + keyCount, m_parameterKeys.end()), m_parameterKeys.end());
+                contentTypeStr = normalized;
+                m_parameterOffsets.push_back(static_cast<uint32_t>(keyCount));
+                m_indices.push_back(index);
+                continue;
+            }
+            m_parameterKeys.resize(keyCount);
+        }
+
+        // Invalid content types are returned as provided.
+        contentTypeStr = m_contentTypes[index];
+    }
+    m_parameterOffsets.push_back(static_cast<uint32_t>(m_parameterKeys.size()));
+
+    // The strings are not modified anymore, so they can be referenced.
+    for (size_t i = 0; i < m_indices.size(); ++i)
+    {
+        std::string &contentTypeStr = m_results[m_indices[i]];
+        const size_t mediaTypeEnd = (m_flags & kMatchParameters) ? std::min(contentTypeStr.find(';'), contentTypeStr.size()) : contentTypeStr.size();
+        ParsedContentType normalizedContentType;
+        normalizeContentType(&contentTypeStr[0], mediaTypeEnd, normalizedContentType);
+        normalizedContentType.order = static_cast<int>(i);
+        m_parsed.push_back(normalizedContentType);
+
+        if (m_flags & kMatchSuffixes)
+        {
+            // The suffix follows the last '+' of the subtype.
+            const char *subtypeEnd = normalizedContentType.subtype + normalizedContentType.subtypeLength;
+            const char *plus = subtypeEnd;
+            while ((plus > normalizedContentType.subtype) && (plus[-1] != '+'))
+            {
+                --plus;
+            }
+            const bool hasSuffix = (plus > normalizedContentType.subtype) && (plus < subtypeEnd);
+            m_suffixIds.push_back(hasSuffix ? static_cast<uint32_t>(intern(m_suffixes, m_suffixSlots, plus, subtypeEnd - plus)) : kNoSuffix);
+        }
+    }
+
+    // The subtypes of the ranges naming a suffix after a wildcard ("*+json").
+    for (const auto &suffix : m_suffixes)
+    {
+        m_wildcardSuffixes.push_back("*+" + suffix);
+    }
+}
+
+bool HttpAcceptParser::OfferSet::normalizeParameters(char *s, size_t length, std::string &normalized)
+{
+    stringToLower(s, s, length);
+
+    // ";" name "=" value, where the value can be a quoted string. Empty
+    // parameters, such as a trailing ';', are ignored.
+    for (size_t position = 1; position < length + 1; )
+    {
+        size_t begin = position;
+        size_t end = find(s, position, length, ';');
+        position = end + 1;
+        trim(s, begin, end);
+        if (begin == end)
+        {
+            continue;
+        }
+
+        const size_t indexEqual = find(s, begin, end, '=');
+        size_t nameBegin = begin;
+        size_t nameEnd = indexEqual;
+        size_t valueBegin = indexEqual + 1;
+        size_t valueEnd = end;
+        trim(s, nameBegin, nameEnd);
+        if ((indexEqual == end) || (nameBegin == nameEnd))
+        {
+            return false;
+        }
+        trim(s, valueBegin, valueEnd);
+        unquote(s, valueBegin, valueEnd);
+
+        normalized.append(1, ';').append(s + nameBegin, nameEnd - nameBegin).append(1, '=').append(s + valueBegin, valueEnd - valueBegin);
+        const uint64_t nameId = intern(m_parameterNames, m_parameterNameSlots, s + nameBegin, nameEnd - nameBegin);
+        const uint64_t valueId = intern(m_parameterValues, m_parameterValueSlots, s + valueBegin, valueEnd - valueBegin);
+        m_parameterKeys.push_back((nameId << 32) | valueId);
+    }
+    return true;
+}
+
+HttpAcceptParser::OfferSet::~OfferSet()
+{
+}
+
+HttpAcceptParser::NegotiationScratch::NegotiationScratch(size_t maxRetainedBytes)
+    : m_anyRange(-1), m_maxRangeParameters(0), m_maxRetainedBytes(maxRetainedBytes), m_fullRangeHash(false), m_rangeParameters(false),
+      m_invalidCharacters(false), m_retainParameters(false)
+{
+}
+
+HttpAcceptParser::NegotiationScratch::~NegotiationScratch()
+{
+}
+
+size_t HttpAcceptParser::NegotiationScratch::retainedBytes() const
+{
+    return m_text.capacity() + m_value.capacity() +
+        (m_accepted.capacity() + m_available.capacity() + m_selected.capacity()) * sizeof(ParsedContentType) +
+        m_rangeSlots.capacity() * sizeof(RangeSlot) + m_parameters.capacity() * sizeof(Parameter) +
+        m_parameterKeys.capacity() * sizeof(uint64_t) + m_acceptedParameters.capacity() * sizeof(std::pair<uint32_t, uint32_t>) +
+        m_acceptedSuffixes.capacity() * sizeof(uint32_t);
+}
+
+char *HttpAcceptParser::NegotiationScratch::prepare(size_t length)
+{
+    // The buffer only grows, so that its content is not needlessly zeroed.
+    // The padding lets the kernels load whole blocks at the end of the text.
+    if (m_text.size() < length + HttpAcceptKernels::kPadding)
+    {
+        m_text.resize(length + HttpAcceptKernels::kPadding);
+    }
+    return &m_text[0];
+}
+
+void HttpAcceptParser::NegotiationScratch::trim()
+{
+    if (retainedBytes() > m_maxRetainedBytes)
+    {
+        std::string().swap(m_text);
+        std::string().swap(m_value);
+        std::vector<ParsedContentType>().swap(m_accepted);
+        std::vector<ParsedContentType>().swap(m_available);
+        std::vector<ParsedContentType>().swap(m_selected);
+        std::vector<RangeSlot>().swap(m_rangeSlots);
+        std::vector<Parameter>().swap(m_parameters);
+        std::vector<uint64_t>().swap(m_parameterKeys);
+        std::vector<std::pair<uint32_t, uint32_t>>().swap(m_acceptedParameters);
+        std::vector<uint32_t>().swap(m_acceptedSuffixes);
+    }
+}
 
 std::string HttpAcceptParser::parse(const std::string & acceptValue, const std::vector<std::string> & availableContentTypes)
+{
+    return parse(acceptValue, availableContentTypes, t_scratch);
+}
+
+std::string HttpAcceptParser::parse(const std::string & acceptValue, const std::vector<std::string> & availableContentTypes, NegotiationScratch & scratch)
 {
     // If the 'Accept' header is empty then return the first available content type.
     if (acceptValue.empty())
     {
+        scratch.m_invalidCharacters = false;
         if (!availableContentTypes.empty())
         {
+            HttpAcceptCounters::add(HttpAcceptCounters::kEmptyHeaderFallbacks);
             return availableContentTypes.front();
         }
         return std::string();
     }
 
-    std::istringstream acceptStream(acceptValue);
-    std::vector<ParsedContentType> acceptedContentTypes;
+    HttpAcceptLatency::Scope latency(acceptValue.size(), availableContentTypes.size());
+    HTTP_ACCEPT_BEGIN_NEGOTIATION();
 
-    int order = 0;
-    for (std::string token; std::getline(acceptStream, token, ','); ++order)
+    // The header and the available content types are lowercased into a single buffer.
+    size_t length = acceptValue.size();
+    for (const auto &contentTypeStr : availableContentTypes)
     {
-        ParsedContentType contentType{std::move(token), "", "", 1.0f, order};
-        bool contentTypeIsAccepted = true;
-        std::istringstream tokenStream(trim(contentType.range));
+        length += contentTypeStr.size();
+    }
+    char *text = scratch.prepare(length);
+    parseAcceptedContentTypes(acceptValue, text, scratch);
+
+    scratch.m_available.clear();
+    text += acceptValue.size();
+    {
+        HTTP_ACCEPT_STAGE(kNormalizeOffers);
+        int order = 0;
+        for (const auto &contentTypeStr : availableContentTypes)
+        {
+            HTTP_ACCEPT_OPERATIONS(1);
+            ParsedContentType normalizedContentType;
+            std::memcpy(text, contentTypeStr.data(), contentTypeStr.size());
+            if (normalizeContentType(text, contentTypeStr.size(), normalizedContentType))
+            {
+                normalizedContentType.order = order++;
+                scratch.m_available.push_back(normalizedContentType);
+            }
+            else
+            {
+                HttpAcceptCounters::add(HttpAcceptCounters::kInvalidOffers);
+            }
+            text += contentTypeStr.size();
+        }
+    }
+
+    // Selects the most preferable content type from the available content types taking in consideration the accepted types.
+    // If no content types has been selected then return the first available content type.
+    std::string result;
+    const int selected = getPreferableContentType(scratch.m_available, scratch);
+    if (selected >= 0)
+    {
+        const ParsedContentType &selectedContentType = scratch.m_available[selected];
+        result.assign(selectedContentType.type, selectedContentType.subtype + selectedContentType.subtypeLength);
+    }
+    else if (!availableContentTypes.empty())
+    {
+        result = availableContentTypes.front();
+        HttpAcceptCounters::add(HttpAcceptCounters::kInvalidOfferFallbacks);
+    }
+
+    if (HttpAcceptTrace::sample())
+    {
+        // The positions of the normalized content types skip the invalid ones.
+        std::vector<size_t> indices;
+        for (size_t i = 0; (scratch.m_available.size() != availableContentTypes.size()) && (i < availableContentTypes.size()); ++i)
+        {
+            ParsedContentType normalizedContentType;
+            scratch.m_value = availableContentTypes[i];
+            if (normalizeContentType(&scratch.m_value[0], scratch.m_value.size(), normalizedContentType))
+            {
+                indices.push_back(i);
+            }
+        }
+        traceNegotiation(acceptValue, scratch.m_available, indices.empty() ? nullptr : indices.data(), HttpAcceptHash::fingerprint(availableContentTypes),
+            nullptr, scratch, (selected >= 0) ? static_cast<int>(indices.empty() ? selected : indices[selected]) : -1);
+    }
+    if (HttpAcceptReference::shadow())
+    {
+        HttpAcceptReference::verify(acceptValue, availableContentTypes, result);
+    }
 
-        // Parse token parameters
-        bool isFirstParameter = true;
-        for (std::string param; std::getline(tokenStream, param, ';') && contentTypeIsAccepted;)
+    scratch.trim();
+    return result;
+}
+
+std::string HttpAcceptParser::parse(const std::string & acceptValue, const OfferSet & availableContentTypes)
+{
+    // If the 'Accept' header is empty then return the first available content type as provided.
+    if (acceptValue.empty())
+    {
+        if (!availableContentTypes.size())
+        {
+            return std::string();
+        }
+        HttpAcceptCounters::add(HttpAcceptCounters::kEmptyHeaderFallbacks);
+        return availableContentTypes.contentTypes().front();
+    }
+
+    const int selected = select(acceptValue, availableContentTypes, t_scratch);
+    return (selected >= 0) ? availableContentTypes.result(selected) : std::string();
+}
+
+int HttpAcceptParser::select(const std::string & acceptValue, const OfferSet & availableContentTypes)
+{
+    return select(acceptValue, availableContentTypes, t_scratch);
+}
+
+int HttpAcceptParser::select(const std::string & acceptValue, const OfferSet & availableContentTypes, NegotiationScratch & scratch)
+{
+    if (acceptValue.empty() || availableContentTypes.m_parsed.empty())
+    {
+        scratch.m_invalidCharacters = false;
+        if (!availableContentTypes.size())
+        {
+            return -1;
+        }
+        HttpAcceptCounters::add(acceptValue.empty() ? HttpAcceptCounters::kEmptyHeaderFallbacks : HttpAcceptCounters::kInvalidOfferFallbacks);
+        return 0;
+    }
+
+    HttpAcceptLatency::Scope latency(acceptValue.size(), availableContentTypes.size());
+    HTTP_ACCEPT_BEGIN_NEGOTIATION();
+    const unsigned flags = availableContentTypes.m_flags;
+    parseAcceptedContentTypes(acceptValue, scratch.prepare(acceptValue.size()), scratch, flags);
+    if (flags)
+    {
+        internAcceptedContentTypes(availableContentTypes, scratch);
+        indexAcceptedContentTypes(scratch, (flags & OfferSet::kMatchParameters) != 0);
+    }
+    const int selected = getPreferableContentType(availableContentTypes.m_parsed, scratch, flags ? &availableContentTypes : nullptr);
+    if (HttpAcceptTrace::sample())
+    {
+        traceNegotiation(acceptValue, availableContentTypes.m_parsed, availableContentTypes.m_indices.data(), availableContentTypes.m_fingerprint,
+            flags ? &availableContentTypes : nullptr, scratch, static_cast<int>(availableContentTypes.m_indices[selected]));
+    }
+    if (!flags && HttpAcceptReference::shadow())
+    {
+        // Matching options select differently from the reference on purpose.
+        HttpAcceptReference::verify(acceptValue, availableContentTypes.m_contentTypes, availableContentTypes.result(availableContentTypes.m_indices[selected]));
+    }
+    scratch.trim();
+    return static_cast<int>(availableContentTypes.m_indices[selected]);
+}
+
+void HttpAcceptParser::parseAcceptedContentTypes(const std::string &acceptValue, char *text, NegotiationScratch &scratch, unsigned flags)
+{
+    const bool retainParameters = scratch.m_retainParameters || (flags & OfferSet::kMatchParameters);
+    const bool acceptSuffixRanges = (flags & OfferSet::kMatchSuffixes) != 0;
+    HTTP_ACCEPT_STAGE(kTokenize);
+    const HttpAcceptKernels::Table &kernels = HttpAcceptKernels::table();
+    const size_t length = acceptValue.size();
+    scratch.m_invalidCharacters = !kernels.lower(text, acceptValue.data(), length);
+    scratch.m_accepted.clear();
+    scratch.m_parameters.clear();
+
+    // The header is scanned once, from delimiter to delimiter. The pieces that
+    // the RFC grammar splits on ',', ';', '/' and '=' are trimmed from the
+    // bounds reported by the same scan.
+    size_t position = 0;
+    for (int order = 0; position < length; ++order)
+    {
+        ParsedContentType contentType{text + position, text + position, 0, 0, 1.0f, order};
+        const size_t parameterCount = scratch.m_parameters.size();
+        ParseState state = kMediaType;
+        Piece piece;
+        Piece key;
+        size_t indexSlash = 0;
+        bool contentTypeIsAccepted = true;
+        bool tokenIsComplete = false;
+        bool qualityIsParsed = false;
+        while (!tokenIsComplete)
         {
-            trim(param);
-            if (isFirstParameter)
+            HTTP_ACCEPT_OPERATIONS(1);
+            size_t begin;
+            size_t end;
+            const size_t delimiter = position + kernels.scanSegment(text + position, length - position, begin, end);
+            piece.append(position + begin, position + end);
+            position = delimiter + 1;
+
+            // The end of the header terminates the last token.
+            const char c = (delimiter < length) ? text[delimiter] : ',';
+            tokenIsComplete = (c == ',');
+            switch (state)
             {
-                // Parse the media-range
-                // ( "*/*" | ( type "/" "*" ) | ( type "/" subtype ) )
-                stringToLower(param);
-                contentType.range = std::move(param);
-                const auto indexSlash = contentType.range.find('/');
-                if (indexSlash == std::string::npos)
+            case kMediaType:
+                if (c == '/')
+                {
+                    // ( "*/*" | ( type "/" "*" ) | ( type "/" subtype ) )
+                    indexSlash = delimiter;
+                    piece.append(delimiter, delimiter + 1);
+                    state = kSubtype;
+                }
+                else if (c == '=')
+                {
+                    piece.append(delimiter, delimiter + 1);
+                }
+                else if (!tokenIsComplete || !piece.empty())
                 {
-                    // Invalid content type format.
+                    // Invalid content type format. An empty token is accepted as an empty media-range.
                     contentTypeIsAccepted = false;
-                    continue;
+                    HttpAcceptCounters::add(HttpAcceptCounters::kMalformedRanges);
+                }
+                break;
+
+            case kSubtype:
+                if ((c == '/') || (c == '='))
+                {
+                    piece.append(delimiter, delimiter + 1);
+                    break;
                 }
-                contentType.type = std::string(contentType.range.begin(), contentType.range.begin() + indexSlash);
-                contentType.subtype = std::string(contentType.range.begin() + indexSlash + 1, contentType.range.end());
-                if ((contentType.type == "*") && (contentType.subtype != "*"))
+                contentType.type = text + piece.begin;
+                contentType.typeLength = static_cast<uint32_t>(indexSlash - piece.begin);
+                contentType.subtype = text + indexSlash + 1;
+                contentType.subtypeLength = static_cast<uint32_t>(piece.end - indexSlash - 1);
+                if (isWildcard(contentType.type, contentType.typeLength) && !isWildcard(contentType.subtype, contentType.subtypeLength) &&
+                    !(acceptSuffixRanges && isWildcardSuffix(contentType.subtype, contentType.subtypeLength)))
                 {
-                    // Invalid content type. Contains wildcard type with a subtype.
+                    // Invalid content type. Contains wildcard type with a subtype other than a suffix wildcard ("*+json").
                     contentTypeIsAccepted = false;
-                    continue;
+                    HttpAcceptCounters::add(HttpAcceptCounters::kWildcardMisuse);
                 }
-                isFirstParameter = false;
-            }
-            else
-            {
-                // Parse the Quality parameter if present
-                // ";" ( "q" | "Q" ) "=" qvalue
-                const auto indexEqual = param.find('=');
-                if (indexEqual == std::string::npos)
+                piece = Piece();
+                state = kParameterName;
+                break;
+
+            case kParameterName:
+                if (c == '/')
                 {
-                    // Invalid syntax. A '=' token is expected, but no one is provided. Current content type should be discarded.
+                    piece.append(delimiter, delimiter + 1);
+                }
+                else if (c == '=')
+                {
+                    key = piece;
+                    piece = Piece();
+                    state = kParameterValue;
+                }
+                else if (!tokenIsComplete || !piece.empty())
+                {
+                    // Invalid syntax. A '=' token is expected, but no one is provided. Current content type should be
+                    // discarded. A trailing ';' does not start a parameter.
                     contentTypeIsAccepted = false;
-                    continue;
+                    HttpAcceptCounters::add(HttpAcceptCounters::kMissingEquals);
+                }
+                break;
+
+            case kParameterValue:
+                if ((c == '/') || (c == '='))
+                {
+                    piece.append(delimiter, delimiter + 1);
+                    break;
                 }
-                auto key = std::string(param.begin(), param.begin() + indexEqual);
-                trim(key);
-                auto value = std::string(param.begin() + indexEqual + 1, param.end());
-                trim(value);
 
-                if ((key == "q") || (key == "Q"))
+                // Parse the Quality parameter if present
+                // ";" ( "q" | "Q" ) "=" qvalue
+                // The header has been lowercased, so 'Q' has become 'q'.
+                if ((key.end - key.begin == 1) && (text[key.begin] == 'q'))
                 {
-                    if (!stringToFloat(value, &contentType.qvalue))
+                    qualityIsParsed = true;
+                    if (!parseQualityValue(text + piece.begin, piece.end - piece.begin, &contentType.qvalue) &&
+                        !stringToFloat(scratch.m_value.assign(text + piece.begin, piece.end - piece.begin), &contentType.qvalue))
                     {
                         // Invalid quality value. A valid float value is expected. Current content type should be discarded.
                         contentTypeIsAccepted = false;
-                        continue;
+                        HttpAcceptCounters::add(HttpAcceptCounters::kInvalidQualityValues);
+                        break;
                     }
 
                     // RFC 7231 Section 5.3.1
@@ -87,27 +750,79 @@ std::string HttpAcceptParser::parse(const std::string & acceptValue, const std::
                         // where 0.001 is the least preferred and 1 is the most preferred; A value of 0
                         // means "not acceptable".If no "q" parameter is present the default quality is 1.
                         contentType.qvalue = 1.0f;
+                        HttpAcceptCounters::add(HttpAcceptCounters::kClampedQualityValues);
                     }
                     else if (contentType.qvalue == 0)
                     {
                         // A value of 0 means "not acceptable".
                         contentType.qvalue = -1.0f;
+                        HttpAcceptCounters::add(HttpAcceptCounters::kZeroQualityRanges);
                     }
                 }
+                else if (retainParameters && !qualityIsParsed)
+                {
+                    // Other parameters are only sliced when the caller asked for them. Those following
+                    // the quality are accept-ext (RFC 7231 Section 5.3.2), not media-type parameters,
+                    // and are ignored.
+                    const NegotiationScratch::Parameter parameter{text + key.begin, text + piece.begin,
+                        static_cast<uint32_t>(key.end - key.begin), static_cast<uint32_t>(piece.end - piece.begin), order};
+                    scratch.m_parameters.push_back(parameter);
+                }
+                piece = Piece();
+                state = kParameterName;
+                break;
+            }
+
+            if (!contentTypeIsAccepted && !tokenIsComplete)
+            {
+                // Skip the rest of the discarded token.
+                position = find(text, position, length, ',') + 1;
+                tokenIsComplete = true;
             }
         }
 
         if (contentTypeIsAccepted)
         {
-            acceptedContentTypes.push_back(std::move(contentType));
+            scratch.m_accepted.push_back(contentType);
+        }
+        else
+        {
+            scratch.m_parameters.resize(parameterCount);
         }
     }
 
+    HTTP_ACCEPT_STAGE_END(kTokenize);
+
     // Sort accepted content types by priority
-    std::sort(acceptedContentTypes.begin(), acceptedContentTypes.end(), compareContentTypes);
+    HTTP_ACCEPT_STAGE(kRankRanges);
+    rankContentTypes(scratch.m_accepted);
 
-    // Selects the most preferable content type from the available content types taking in consideration the accepted types.
-    return getPreferableContentType(acceptedContentTypes, availableContentTypes);
+    // With matching options, the ranges are indexed once their parameters are interned.
+    if (!flags)
+    {
+        indexAcceptedContentTypes(scratch);
+    }
+}
+
+bool HttpAcceptParser::normalizeContentType(char *s, size_t length, ParsedContentType &contentType)
+{
+    stringToLower(s, s, length);
+    size_t begin = 0;
+    size_t end = length;
+    trim(s, begin, end);
+    const size_t indexSlash = find(s, begin, end, '/');
+    if (indexSlash == end)
+    {
+        // Invalid content type format.
+        return false;
+    }
+    contentType.type = s + begin;
+    contentType.typeLength = static_cast<uint32_t>(indexSlash - begin);
+    contentType.subtype = s + indexSlash + 1;
+    contentType.subtypeLength = static_cast<uint32_t>(end - indexSlash - 1);
+    contentType.qvalue = 0;
+    contentType.order = 0;
+    return true;
 }
 
 bool HttpAcceptParser::stringToFloat(const std::string &s, float *f)
@@ -123,32 +838,29 @@ bool HttpAcceptParser::stringToFloat(const std::string &s, float *f)
     }
 }
 
-inline std::string & HttpAcceptParser::rtrim(std::string &s, const char *t)
-{
-    s.erase(s.find_last_not_of(t) + 1);
-    return s;
-}
-
-inline std::string & HttpAcceptParser::ltrim(std::string &s, const char *t)
-{
-    s.erase(0, s.find_first_not_of(t));
-    return s;
-}
-
-std::string & HttpAcceptParser::trim(std::string &s)
+void HttpAcceptParser::trim(const char *s, size_t &begin, size_t &end)
 {
-    const char *charsToTrim = " \t\n\r\f\v";
-    return ltrim(rtrim(s, charsToTrim), charsToTrim);
+    // Most tokens do not start with whitespace, which spares the kernel call.
+    if ((begin < end) && isWhitespace(s[begin]))
+    {
+        begin += HttpAcceptKernels::table().skipWhitespace(s + begin, end - begin);
+    }
+    while ((end > begin) && isWhitespace(s[end - 1]))
+    {
+        --end;
+    }
 }
 
-std::string & HttpAcceptParser::stringToLower(std::string &s)
+void HttpAcceptParser::stringToLower(char *dst, const char *src, size_t length)
 {
-    std::transform(s.begin(), s.end(), s.begin(), [](const unsigned char c) { return std::tolower(c); });
-    return s;
+    // Only ASCII letters are converted, as std::tolower does in the "C" locale.
+    HttpAcceptKernels::table().lower(dst, src, length);
 }
 
 bool HttpAcceptParser::compareContentTypes(const ParsedContentType &a, const ParsedContentType &b)
 {
+    HTTP_ACCEPT_OPERATIONS(1);
+
     // Sort by quality score
     if (a.qvalue != b.qvalue)
     {
@@ -156,14 +868,14 @@ bool HttpAcceptParser::compareContentTypes(const ParsedContentType &a, const Par
     }
 
     // Sort by type
-    if (a.type != b.type)
+    if (!equals(a.type, a.typeLength, b.type, b.typeLength))
     {
-        if (a.type == "*")
+        if (isWildcard(a.type, a.typeLength))
         {
             return true;
         }
 
-        if (b.type == "*")
+        if (isWildcard(b.type, b.typeLength))
         {
             return false;
         }
@@ -172,14 +884,14 @@ bool HttpAcceptParser::compareContentTypes(const ParsedContentType &a, const Par
     }
 
     // Sort by subtype
-    if (a.subtype != b.subtype)
+    if (!equals(a.subtype, a.subtypeLength, b.subtype, b.subtypeLength))
     {
-        if (a.subtype == "*")
+        if (isWildcard(a.subtype, a.subtypeLength))
         {
             return true;
         }
 
-        if (b.subtype == "*")
+        if (isWildcard(b.subtype, b.subtypeLength))
         {
             return false;
         }
@@ -191,56 +903,588 @@ bool HttpAcceptParser::compareContentTypes(const ParsedContentType &a, const Par
     return a.order < b.order;
 }
 
-std::string HttpAcceptParser::getPreferableContentType(const std::vector<ParsedContentType> &acceptedContentTypes, const std::vector<std::string> &availableContentTypes)
+void HttpAcceptParser::rankContentTypes(std::vector<ParsedContentType> &contentTypes)
 {
-    std::vector<ParsedContentType> selectedContentTypes;
+    const size_t count = contentTypes.size();
+    if (count > kMaxInsertionSort)
+    {
+        std::sort(contentTypes.begin(), contentTypes.end(), compareContentTypes);
+        return;
+    }
 
-    int order = 0;
-    for (auto contentTypeStr : availableContentTypes)
+    // The comparison is not a strict weak ordering, so the exact sequence of
+    // comparisons matters: this is the insertion sort of libstdc++, inlined.
+    ParsedContentType *first = contentTypes.data();
+    for (size_t i = 1; i < count; ++i)
     {
-        stringToLower(trim(contentTypeStr));
-        ParsedContentType selectedContentType{contentTypeStr, "", "", 0, order};
-        auto indexSlash = contentTypeStr.find('/');
-        if (indexSlash == std::string::npos)
+        const ParsedContentType key = first[i];
+        size_t j = i;
+        if (compareContentTypes(key, first[0]))
         {
-            // Invalid content type format.
-            continue;
+            for (; j > 0; --j)
+            {
+                first[j] = first[j - 1];
+            }
+        }
+        else
+        {
+            for (; compareContentTypes(key, first[j - 1]); --j)
+            {
+                first[j] = first[j - 1];
+            }
+        }
+        first[j] = key;
+    }
+}
+
+void HttpAcceptParser::indexAcceptedContentTypes(NegotiationScratch &scratch, bool matchParameters)
+{
+    scratch.m_rangeSlots.clear();
+    scratch.m_anyRange = -1;
+    scratch.m_maxRangeParameters = 0;
+    scratch.m_fullRangeHash = false;
+    scratch.m_rangeParameters = matchParameters;
+    if (scratch.m_accepted.size() <= kMaxScannedRanges)
+    {
+        return;
+    }
+
+    // The table is kept at most half full, so that probe sequences stay short.
+    size_t slots = 2 * kMaxScannedRanges;
+    while (slots < 2 * scratch.m_accepted.size())
+    {
+        slots *= 2;
+    }
+    const RangeSlot emptySlot = { 0, -1, -1, -1 };
+    const size_t mask = slots - 1;
+
+    // Ranges crafted to collide on the cheap hash make a probe sequence longer
+    // than kMaxRangeProbes, and the index is then built again with the full
+    // hash, so that its cost stays linear in the number of ranges.
+    bool indexed = false;
+    while (!indexed)
+    {
+        scratch.m_rangeSlots.assign(slots, emptySlot);
+        scratch.m_anyRange = -1;
+        scratch.m_maxRangeParameters = 0;
+        indexed = true;
+        for (size_t i = 0; indexed && (i < scratch.m_accepted.size()); ++i)
+        {
+            const ParsedContentType &acceptedContentType = scratch.m_accepted[i];
+            const uint64_t *keys = nullptr;
+            size_t keyCount = 0;
+            if (matchParameters)
+            {
+                // A range naming a parameter that no available content type
+                // declares matches none, and the keys are sorted, so that its
+                // identifier comes last.
+                keys = scratch.m_parameterKeys.data() + scratch.m_acceptedParameters[i].first;
+                keyCount = scratch.m_acceptedParameters[i].second - scratch.m_acceptedParameters[i].first;
+                if (keyCount && (keys[keyCount - 1] == kNotInterned))
+                {
+                    continue;
+                }
+                scratch.m_maxRangeParameters = std::max(scratch.m_maxRangeParameters, countKeys(keys, keyCount));
+            }
+            const uint64_t hash = hashKeys(keys, keyCount, hashRange(acceptedContentType.type, acceptedContentType.typeLength, acceptedContentType.subtype,
+                acceptedContentType.subtypeLength, scratch.m_fullRangeHash));
+            for (size_t slot = hash & mask, probes = 1; ; slot = (slot + 1) & mask, ++probes)
+            {
+                HTTP_ACCEPT_OPERATIONS(1);
+                if ((probes > kMaxRangeProbes) && !scratch.m_fullRangeHash)
+                {
+                    scratch.m_fullRangeHash = true;
+                    indexed = false;
+                    break;
+                }
+                RangeSlot &rangeSlot = scratch.m_rangeSlots[slot];
+                if (rangeSlot.first < 0)
+                {
+                    rangeSlot.hash = hash;
+                    rangeSlot.first = static_cast<int>(i);
+                    rangeSlot.last = static_cast<int>(i);
+                    rangeSlot.best = static_cast<int>(i);
+                    break;
+                }
+                const ParsedContentType &slotContentType = scratch.m_accepted[rangeSlot.first];
+                const std::pair<uint32_t, uint32_t> *slotBounds = matchParameters ? &scratch.m_acceptedParameters[rangeSlot.first] : nullptr;
+                if ((rangeSlot.hash == hash) &&
+                    equals(slotContentType.type, slotContentType.typeLength, acceptedContentType.type, acceptedContentType.typeLength) &&
+                    equals(slotContentType.subtype, slotContentType.subtypeLength, acceptedContentType.subtype, acceptedContentType.subtypeLength) &&
+                    (!slotBounds || equalKeys(scratch.m_parameterKeys.data() + slotBounds->first, slotBounds->second - slotBounds->first, keys, keyCount)))
+                {
+                    // The ranges of a slot match the same content types, and
+                    // the one with the most parameters, counting duplicates,
+                    // is preferred to the others.
+                    rangeSlot.last = static_cast<int>(i);
+                    if (!matchParameters || (keyCount >= scratch.m_acceptedParameters[rangeSlot.best].second - scratch.m_acceptedParameters[rangeSlot.best].first))
+                    {
+                        rangeSlot.best = static_cast<int>(i);
+                    }
+                    break;
+                }
+            }
+
+            // The last '*/*' range. The '*/*+suffix' ranges, accepted with
+            // kMatchSuffixes, also have a wildcard type and are left out.
+            if (isWildcard(acceptedContentType.type, acceptedContentType.typeLength) && isWildcard(acceptedContentType.subtype, acceptedContentType.subtypeLength))
+            {
+                scratch.m_anyRange = static_cast<int>(i);
+            }
+        }
+    }
+}
+
+const HttpAcceptParser::RangeSlot *HttpAcceptParser::findRangeSlot(const NegotiationScratch &scratch, uint64_t hash, const char *type, size_t typeLength, const char *subtype, size_t subtypeLength,
+    const uint64_t *keys, size_t keyCount)
+{
+    const size_t mask = scratch.m_rangeSlots.size() - 1;
+    for (size_t slot = hash & mask; ; slot = (slot + 1) & mask)
+    {
+        HTTP_ACCEPT_OPERATIONS(1);
+        const RangeSlot &rangeSlot = scratch.m_rangeSlots[slot];
+        if (rangeSlot.first < 0)
+        {
+            return nullptr;
+        }
+        const ParsedContentType &slotContentType = scratch.m_accepted[rangeSlot.first];
+        if ((rangeSlot.hash == hash) &&
+            equals(slotContentType.type, slotContentType.typeLength, type, typeLength) &&
+            equals(slotContentType.subtype, slotContentType.subtypeLength, subtype, subtypeLength) &&
+            (!scratch.m_rangeParameters || equalKeys(scratch.m_parameterKeys.data() + scratch.m_acceptedParameters[rangeSlot.first].first,
+                scratch.m_acceptedParameters[rangeSlot.first].second - scratch.m_acceptedParameters[rangeSlot.first].first, keys, keyCount)))
+        {
+            return &rangeSlot;
         }
-        selectedContentType.type = std::string(contentTypeStr.begin(), contentTypeStr.begin() + indexSlash);
-        selectedContentType.subtype = std::string(contentTypeStr.begin() + indexSlash + 1, contentTypeStr.end());
+    }
+}
 
-        bool matchFound = false;
-        for (const auto &acceptedContentType : acceptedContentTypes)
+float HttpAcceptParser::getQuality(const ParsedContentType &availableContentType, const NegotiationScratch &scratch)
+{
+    if (scratch.m_rangeSlots.empty())
+    {
+        // The ranges are scanned backwards, so that the scan stops at the last
+        // exact match, and the first 'type/*' and the last '*/*' ranges are
+        // kept along the way.
+        const ParsedContentType *typeMatch = nullptr;
+        const ParsedContentType *anyMatch = nullptr;
+        for (size_t i = scratch.m_accepted.size(); i > 0; --i)
         {
-            if ((acceptedContentType.type == selectedContentType.type) && ((acceptedContentType.subtype == selectedContentType.subtype) || ((acceptedContentType.subtype == "*") && !matchFound)))
+            HTTP_ACCEPT_OPERATIONS(1);
+            const ParsedContentType &acceptedContentType = scratch.m_accepted[i - 1];
+            if (equals(acceptedContentType.type, acceptedContentType.typeLength, availableContentType.type, availableContentType.typeLength))
             {
-                // Match 'type/subtype' or 'type/*'
-                selectedContentType.qvalue = acceptedContentType.qvalue;
-                matchFound = true;
+                if (equals(acceptedContentType.subtype, acceptedContentType.subtypeLength, availableContentType.subtype, availableContentType.subtypeLength))
+                {
+                    return acceptedContentType.qvalue;
+                }
+                if (isWildcard(acceptedContentType.subtype, acceptedContentType.subtypeLength))
+                {
+                    typeMatch = &acceptedContentType;
+                }
             }
-            else if ((acceptedContentType.type == "*") && (!matchFound))
+            else if (isWildcard(acceptedContentType.type, acceptedContentType.typeLength) && !anyMatch)
             {
-                // Match '*/*'
-                selectedContentType.qvalue = acceptedContentType.qvalue;
+                anyMatch = &acceptedContentType;
             }
         }
-        selectedContentTypes.push_back(selectedContentType);
-        order++;
+
+        if (typeMatch)
+        {
+            return typeMatch->qvalue;
+        }
+        return anyMatch ? anyMatch->qvalue : availableContentType.qvalue;
     }
 
-    // Sort selected content types by score.
-    std::sort(selectedContentTypes.begin(), selectedContentTypes.end(), compareContentTypes);
+    // The last 'type/subtype' range that matches decides the quality.
+    const RangeSlot *rangeSlot = findRangeSlot(scratch, hashRange(availableContentType.type, availableContentType.typeLength, availableContentType.subtype, availableContentType.subtypeLength,
+        scratch.m_fullRangeHash), availableContentType.type, availableContentType.typeLength, availableContentType.subtype, availableContentType.subtypeLength);
+    if (rangeSlot)
+    {
+        return scratch.m_accepted[rangeSlot->last].qvalue;
+    }
 
-    // Get the first selected content type (wich is the content type with the best score).
-    // If no content types has been selected then return the first available content type.
-    if (!selectedContentTypes.empty())
+    // Otherwise the first 'type/*' range, which is also how '*/*' matches a
+    // content type with a wildcard type.
+    rangeSlot = findRangeSlot(scratch, hashRange(availableContentType.type, availableContentType.typeLength, "*", 1, scratch.m_fullRangeHash), availableContentType.type, availableContentType.typeLength, "*", 1);
+    if (rangeSlot)
     {
-        return selectedContentTypes.front().range;
+        return scratch.m_accepted[rangeSlot->first].qvalue;
     }
-    else if (!availableContentTypes.empty())
+
+    // Otherwise the last '*/*' range.
+    if ((scratch.m_anyRange >= 0) && !isWildcard(availableContentType.type, availableContentType.typeLength))
+    {
+        return scratch.m_accepted[scratch.m_anyRange].qvalue;
+    }
+    return availableContentType.qvalue;
+}
+
+void HttpAcceptParser::internAcceptedContentTypes(const OfferSet &availableContentTypes, NegotiationScratch &scratch)
+{
+    if (availableContentTypes.m_flags & OfferSet::kMatchSuffixes)
+    {
+        // A range names a suffix as its subtype ("json") or after a wildcard ("*+json").
+        scratch.m_acceptedSuffixes.clear();
+        for (const auto &acceptedContentType : scratch.m_accepted)
+        {
+            const bool wildcardSuffix = isWildcardSuffix(acceptedContentType.subtype, acceptedContentType.subtypeLength);
+            const size_t skip = wildcardSuffix ? 2 : 0;
+            const uint64_t suffixId = lookup(availableContentTypes.m_suffixes, availableContentTypes.m_suffixSlots, acceptedContentType.subtype + skip,
+                acceptedContentType.subtypeLength - skip);
+            scratch.m_acceptedSuffixes.push_back((suffixId == kNotInterned) ? kNoSuffix : (static_cast<uint32_t>(suffixId) | (wildcardSuffix ? kWildcardSuffix : 0)));
+        }
+    }
+
+    if (!(availableContentTypes.m_flags & OfferSet::kMatchParameters))
+    {
+        return;
+    }
+
+    scratch.m_parameterKeys.clear();
+    for (const auto &parameter : scratch.m_parameters)
+    {
+        size_t valueBegin = 0;
+        size_t valueEnd = parameter.valueLength;
+        unquote(parameter.value, valueBegin, valueEnd);
+        const uint64_t nameId = lookup(availableContentTypes.m_parameterNames, availableContentTypes.m_parameterNameSlots, parameter.name, parameter.nameLength);
+        const uint64_t valueId = lookup(availableContentTypes.m_parameterValues, availableContentTypes.m_parameterValueSlots, parameter.value + valueBegin,
+            valueEnd - valueBegin);
+        scratch.m_parameterKeys.push_back(((nameId == kNotInterned) || (valueId == kNotInterned)) ? kNotInterned : ((nameId << 32) | valueId));
+    }
+
+    // The parameters are in the order of the header, and the accepted content
+    // types in the order of preference. The keys of every range are sorted,
+    // to be compared as sets.
+    scratch.m_acceptedParameters.clear();
+    for (const auto &acceptedContentType : scratch.m_accepted)
+    {
+        const auto bounds = std::equal_range(scratch.m_parameters.begin(), scratch.m_parameters.end(), acceptedContentType.order, ParameterOrder());
+        const size_t first = bounds.first - scratch.m_parameters.begin();
+        const size_t last = bounds.second - scratch.m_parameters.begin();
+        std::sort(scratch.m_parameterKeys.begin() + first, scratch.m_parameterKeys.begin() + last);
+        scratch.m_acceptedParameters.push_back(std::make_pair(static_cast<uint32_t>(first), static_cast<uint32_t>(last)));
+    }
+}
+
+float HttpAcceptParser::getMatchingQuality(const ParsedContentType &availableContentType, const OfferSet &availableContentTypes, const NegotiationScratch &scratch)
+{
+    const bool matchParameters = (availableContentTypes.m_flags & OfferSet::kMatchParameters) != 0;
+    const uint64_t *offerKeys = nullptr;
+    size_t offerKeyCount = 0;
+    if (matchParameters)
+    {
+        offerKeys = availableContentTypes.m_parameterKeys.data() + availableContentTypes.m_parameterOffsets[availableContentType.order];
+        offerKeyCount = availableContentTypes.m_parameterOffsets[availableContentType.order + 1] - availableContentTypes.m_parameterOffsets[availableContentType.order];
+    }
+    const bool matchSuffixes = (availableContentTypes.m_flags & OfferSet::kMatchSuffixes) != 0;
+    const uint32_t offerSuffix = matchSuffixes ? availableContentTypes.m_suffixIds[availableContentType.order] : kNoSuffix;
+
+    // A range matches if it names a subset of the parameters of the content
+    // type, so the index is looked up for every subset with at most as many
+    // parameters as the ranges have. It finds the ranges that the scan below
+    // would keep: the exact match with the most parameters, the suffix match
+    // of the highest rank, the first 'type/*' and the last '*/*'.
+    const size_t subsetBits = scratch.m_maxRangeParameters ? offerKeyCount : 0;
+    if (!scratch.m_rangeSlots.empty() && (subsetBits <= kMaxIndexedParameters))
+    {
+        const bool wildcardType = isWildcard(availableContentType.type, availableContentType.typeLength);
+        uint64_t subset[kMaxIndexedParameters];
+        size_t subsetCount = 0;
+        const auto findSlot = [&](const char *type, size_t typeLength, const char *subtype, size_t subtypeLength)
+        {
+            return findRangeSlot(scratch, hashKeys(subset, subsetCount, hashRange(type, typeLength, subtype, subtypeLength, scratch.m_fullRangeHash)),
+                type, typeLength, subtype, subtypeLength, subset, subsetCount);
+        };
+
+        int exactMatch = -1;
+        int suffixMatch = -1;
+        int typeMatch = -1;
+        int anyMatch = -1;
+        size_t exactParameterCount = 0;
+        unsigned suffixRank = 0;
+        const auto matchSuffix = [&](const RangeSlot *rangeSlot, unsigned rank)
+        {
+            if (rangeSlot && ((rank > suffixRank) || ((rank == suffixRank) && (rangeSlot->last > suffixMatch))))
+            {
+                suffixMatch = rangeSlot->last;
+                suffixRank = rank;
+            }
+        };
+        for (size_t mask = 0; mask < (static_cast<size_t>(1) << subsetBits); ++mask)
+        {
+            subsetCount = 0;
+            for (size_t bit = 0; bit < subsetBits; ++bit)
+            {
+                if (mask & (static_cast<size_t>(1) << bit))
+                {
+                    subset[subsetCount++] = offerKeys[bit];
+                }
+            }
+            if (subsetCount > scratch.m_maxRangeParameters)
+            {
+                continue;
+            }
+
+            const RangeSlot *rangeSlot = findSlot(availableContentType.type, availableContentType.typeLength, availableContentType.subtype, availableContentType.subtypeLength);
+            if (rangeSlot)
+            {
+                const size_t parameterCount = matchParameters ? scratch.m_acceptedParameters[rangeSlot->best].second - scratch.m_acceptedParameters[rangeSlot->best].first : 0;
+                if ((exactMatch < 0) || (parameterCount > exactParameterCount) || ((parameterCount == exactParameterCount) && (rangeSlot->best > exactMatch)))
+                {
+                    exactMatch = rangeSlot->best;
+                    exactParameterCount = parameterCount;
+                }
+            }
+            rangeSlot = findSlot(availableContentType.type, availableContentType.typeLength, "*", 1);
+            if (rangeSlot && ((typeMatch < 0) || (rangeSlot->first < typeMatch)))
+            {
+                typeMatch = rangeSlot->first;
+            }
+            rangeSlot = wildcardType ? nullptr : findSlot("*", 1, "*", 1);
+            if (rangeSlot && (rangeSlot->last > anyMatch))
+            {
+                anyMatch = rangeSlot->last;
+            }
+            if (offerSuffix != kNoSuffix)
+            {
+                const std::string &suffix = availableContentTypes.m_suffixes[offerSuffix];
+                const std::string &wildcardSuffix = availableContentTypes.m_wildcardSuffixes[offerSuffix];
+                matchSuffix(findSlot(availableContentType.type, availableContentType.typeLength, suffix.data(), suffix.size()), 3);
+                matchSuffix(findSlot(availableContentType.type, availableContentType.typeLength, wildcardSuffix.data(), wildcardSuffix.size()), 2);
+                matchSuffix(wildcardType ? nullptr : findSlot("*", 1, wildcardSuffix.data(), wildcardSuffix.size()), 1);
+            }
+        }
+
+        if (exactMatch >= 0)
+        {
+            return scratch.m_accepted[exactMatch].qvalue;
+        }
+        if (suffixMatch >= 0)
+        {
+            return scratch.m_accepted[suffixMatch].qvalue;
+        }
+        if (typeMatch >= 0)
+        {
+            return scratch.m_accepted[typeMatch].qvalue;
+        }
+        return (anyMatch >= 0) ? scratch.m_accepted[anyMatch].qvalue : availableContentType.qvalue;
+    }
+
+    // A range only matches the content types declaring all its parameters.
+    // Among the matching 'type/subtype' ranges the one with the most
+    // parameters decides, and the last one on ties, as without parameters.
+    // Suffix matches come next, ranked 'type/suffix', 'type/*+suffix' and
+    // '*/*+suffix', the last range deciding on ties.
+    const ParsedContentType *exactMatch = nullptr;
+    const ParsedContentType *suffixMatch = nullptr;
+    const ParsedContentType *typeMatch = nullptr;
+    const ParsedContentType *anyMatch = nullptr;
+    uint32_t exactParameterCount = 0;
+    unsigned suffixRank = 0;
+    for (size_t i = scratch.m_accepted.size(); i > 0; --i)
+    {
+        HTTP_ACCEPT_OPERATIONS(1);
+        const ParsedContentType &acceptedContentType = scratch.m_accepted[i - 1];
+        uint32_t parameterCount = 0;
+        if (matchParameters)
+        {
+            const std::pair<uint32_t, uint32_t> &bounds = scratch.m_acceptedParameters[i - 1];
+            parameterCount = bounds.second - bounds.first;
+            if (!containsKeys(offerKeys, offerKeyCount, scratch.m_parameterKeys.data() + bounds.first, parameterCount))
+            {
+                continue;
+            }
+        }
+        const uint32_t rangeSuffix = (offerSuffix != kNoSuffix) ? scratch.m_acceptedSuffixes[i - 1] : kNoSuffix;
+
+        if (equals(acceptedContentType.type, acceptedContentType.typeLength, availableContentType.type, availableContentType.typeLength))
+        {
+            if (equals(acceptedContentType.subtype, acceptedContentType.subtypeLength, availableContentType.subtype, availableContentType.subtypeLength))
+            {
+                if (!exactMatch || (parameterCount > exactParameterCount))
+                {
+                    exactMatch = &acceptedContentType;
+                    exactParameterCount = parameterCount;
+                }
+            }
+            else if (isWildcard(acceptedContentType.subtype, acceptedContentType.subtypeLength))
+            {
+                typeMatch = &acceptedContentType;
+            }
+            else if ((rangeSuffix == offerSuffix) && (rangeSuffix != kNoSuffix) && (suffixRank < 3))
+            {
+                suffixMatch = &acceptedContentType;
+                suffixRank = 3;
+            }
+            else if ((rangeSuffix == (offerSuffix | kWildcardSuffix)) && (rangeSuffix != kNoSuffix) && (suffixRank < 2))
+            {
+                suffixMatch = &acceptedContentType;
+                suffixRank = 2;
+            }
+        }
+        else if (isWildcard(acceptedContentType.type, acceptedContentType.typeLength))
+        {
+            if (isWildcard(acceptedContentType.subtype, acceptedContentType.subtypeLength))
+            {
+                anyMatch = anyMatch ? anyMatch : &acceptedContentType;
+            }
+            else if ((rangeSuffix == (offerSuffix | kWildcardSuffix)) && (rangeSuffix != kNoSuffix) && (suffixRank < 1))
+            {
+                suffixMatch = &acceptedContentType;
+                suffixRank = 1;
+            }
+        }
+    }
+
+    if (exactMatch)
+    {
+        return exactMatch->qvalue;
+    }
+    if (suffixMatch)
+    {
+        return suffixMatch->qvalue;
+    }
+    if (typeMatch)
+    {
+        return typeMatch->qvalue;
+    }
+    return anyMatch ? anyMatch->qvalue : availableContentType.qvalue;
+}
+
+void HttpAcceptParser::traceNegotiation(const std::string &acceptValue, const std::vector<ParsedContentType> &availableContentTypes, const size_t *indices,
+    uint64_t offerSetId, const OfferSet *offerSet, NegotiationScratch &scratch, int selected)
+{
+    HttpAcceptTrace::Record record = HttpAcceptTrace::Record();
+    record.time = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count());
+    record.headerHash = HttpAcceptHash::hash(acceptValue);
+    record.offerSetId = offerSetId;
+    record.headerLength = static_cast<uint32_t>(acceptValue.size());
+    record.selected = selected;
+    std::memcpy(record.header, acceptValue.data(), std::min<size_t>(acceptValue.size(), HttpAcceptTrace::kMaxHeaderBytes));
+
+    // Every content type is scored, and ranked as the long lists are.
+    std::vector<ParsedContentType> &rankedContentTypes = scratch.m_selected;
+    rankedContentTypes.clear();
+    for (const auto &availableContentType : availableContentTypes)
+    {
+        ParsedContentType rankedContentType = availableContentType;
+        rankedContentType.qvalue = offerSet ? getMatchingQuality(availableContentType, *offerSet, scratch) : getQuality(availableContentType, scratch);
+        rankedContentTypes.push_back(rankedContentType);
+    }
+    rankContentTypes(rankedContentTypes);
+    for (const auto &rankedContentType : rankedContentTypes)
+    {
+        if (record.candidateCount == HttpAcceptTrace::kMaxCandidates)
+        {
+            break;
+        }
+        HttpAcceptTrace::Candidate &candidate = record.candidates[record.candidateCount++];
+        candidate.index = static_cast<int32_t>(indices ? indices[rankedContentType.order] : rankedContentType.order);
+        candidate.quality = rankedContentType.qvalue;
+    }
+    HttpAcceptTrace::record(record);
+}
+
+int HttpAcceptParser::getPreferableContentType(const std::vector<ParsedContentType> &availableContentTypes, NegotiationScratch &scratch, const OfferSet *offerSet)
+{
+    const std::vector<ParsedContentType> &acceptedContentTypes = scratch.m_accepted;
+    std::vector<ParsedContentType> &selectedContentTypes = scratch.m_selected;
+    HTTP_ACCEPT_STAGE(kMatch);
+    const size_t count = availableContentTypes.size();
+    HttpAcceptCounters::add(HttpAcceptCounters::kNegotiations);
+
+    if (count > kMaxInsertionSort)
+    {
+        selectedContentTypes.clear();
+        for (const auto &availableContentType : availableContentTypes)
+        {
+            ParsedContentType selectedContentType = availableContentType;
+            selectedContentType.qvalue = offerSet ? getMatchingQuality(availableContentType, *offerSet, scratch) : getQuality(availableContentType, scratch);
+            selectedContentTypes.push_back(selectedContentType);
+        }
+        HttpAcceptCounters::add(HttpAcceptCounters::kScoredOffers, count);
+
+        // Sort selected content types by score.
+        HTTP_ACCEPT_STAGE(kRankOffers);
+        rankContentTypes(selectedContentTypes);
+        if (!(selectedContentTypes.front().qvalue > 0))
+        {
+            HttpAcceptCounters::add(HttpAcceptCounters::kUnacceptableFallbacks);
+        }
+        return selectedContentTypes.front().order;
+    }
+
+    if (count == 0)
+    {
+        return -1;
+    }
+
+    // An insertion sort only brings an element to the front when it compares
+    // better than the current front, so the front of a short list is found in
+    // a single pass, without sorting.
+    //
+    // An offer scores the quality of one of the ranges, or keeps its initial
+    // quality of 0, so no offer can score more than the best of them. Once the
+    // selected offer reaches that bound, a later offer can only beat it when
+    // it has a wildcard, which wins the ties of compareContentTypes(). The
+    // other offers are skipped, and the scan stops after the last wildcard.
+    float maxQuality = 0;
+    for (const auto &acceptedContentType : acceptedContentTypes)
+    {
+        maxQuality = (acceptedContentType.qvalue > maxQuality) ? acceptedContentType.qvalue : maxQuality;
+    }
+    size_t wildcardsEnd = 0;
+    for (size_t i = 0; i < count; ++i)
+    {
+        const ParsedContentType &availableContentType = availableContentTypes[i];
+        if (isWildcard(availableContentType.type, availableContentType.typeLength) || isWildcard(availableContentType.subtype, availableContentType.subtypeLength))
+        {
+            wildcardsEnd = i + 1;
+        }
+    }
+
+    ParsedContentType best = availableContentTypes[0];
+    best.qvalue = offerSet ? getMatchingQuality(best, *offerSet, scratch) : getQuality(best, scratch);
+    size_t scored = 1;
+    size_t i = 1;
+    for (; i < count; ++i)
     {
-        return availableContentTypes.front();
+        const ParsedContentType &availableContentType = availableContentTypes[i];
+        if (!(maxQuality > best.qvalue))
+        {
+            if (i >= wildcardsEnd)
+            {
+                break;
+            }
+            if (!isWildcard(availableContentType.type, availableContentType.typeLength) && !isWildcard(availableContentType.subtype, availableContentType.subtypeLength))
+            {
+                continue;
+            }
+        }
+
+        ParsedContentType selectedContentType = availableContentType;
+        selectedContentType.qvalue = offerSet ? getMatchingQuality(availableContentType, *offerSet, scratch) : getQuality(availableContentType, scratch);
+        ++scored;
+        if (compareContentTypes(selectedContentType, best))
+        {
+            best = selectedContentType;
+        }
     }
 
-    return std::string();
+    HttpAcceptCounters::add(HttpAcceptCounters::kScoredOffers, scored);
+    if (scored < count)
+    {
+        HttpAcceptCounters::add(HttpAcceptCounters::kSkippedOffers, count - scored);
+    }
+    if (i < count)
+    {
+        HttpAcceptCounters::add(HttpAcceptCounters::kEarlyExits);
+    }
+    if (!(best.qvalue > 0))
+    {
+        // No offer is acceptable, the best ranked one is returned anyway.
+        HttpAcceptCounters::add(HttpAcceptCounters::kUnacceptableFallbacks);
+    }
+    return best.order;
 }
@@ -3,27 +3,396 @@
 #ifndef HTTP_ACCEPT_PARSER_H
 #define HTTP_ACCEPT_PARSER_H
 
+#include <cstdint>
 #include <vector>
 #include <string>
+#include <utility>
 
 /**
  * Helper class for parsing the HTTP 'Accept' header.
  */
 class HttpAcceptParser
 {
+private:
+
+    /**
+     * @brief Representation of a Mime Type containing additional information to facilitate
+     * the content type negotiation when a HTTP requests arrives. The type and the subtype
+     * point into a lowercased copy of the parsed text, owned by a NegotiationScratch or
+     * by an OfferSet.
+     */
+    struct ParsedContentType
+    {
+        const char *type;
+        const char *subtype;
+        uint32_t    typeLength;
+        uint32_t    subtypeLength;
+        float       qvalue;
+        int         order;
+    };
+
+    /**
+     * @brief Slot of the hash index of the accepted content types. The accepted
+     * content types with the same type and subtype share a slot, which keeps
+     * the position of the first and of the last of them, and of the one with
+     * the most parameters, the last one on ties. When parameters are matched,
+     * the accepted content types also share the set of their parameters.
+     */
+    struct RangeSlot
+    {
+        uint64_t hash;
+        int      first;
+        int      last;
+        int      best;
+    };
+
+    /**
+     * Longest list of content types ranked with an insertion sort.
+     */
+    static const size_t kMaxInsertionSort = 16;
+
+    /**
+     * Longest list of accepted content types scanned without an index.
+     */
+    static const size_t kMaxScannedRanges = 8;
+
+    /**
+     * Longest probe sequence of the range index before it is built again with
+     * the full hash of the ranges.
+     */
+    static const size_t kMaxRangeProbes = 32;
+
+    /**
+     * Largest number of parameters of an available content type whose subsets
+     * are looked up in the range index. Content types with more parameters
+     * are matched by scanning the accepted content types.
+     */
+    static const size_t kMaxIndexedParameters = 6;
+
 public:
 
+    /**
+     * @brief List of available content types normalized once, so that it can be
+     * negotiated against many 'Accept' headers without being parsed again.
+     * Instances are immutable and can be shared between threads.
+     */
+    class OfferSet
+    {
+    public:
+
+        /**
+         * @brief Matching options, which can be combined.
+         */
+        enum Flags
+        {
+            /**
+             * Available content types can declare parameters, such as
+             * "application/vnd.acme+json;version=2". An accepted media-range
+             * with parameters only matches the content types declaring all of
+             * them, and takes precedence over the ranges with fewer parameters
+             * (RFC 7231 Section 5.3.2). The accept-ext parameters following the
+             * quality are ignored.
+             */
+            kMatchParameters = 1 << 0,
+
+            /**
+             * Available content types with a structured syntax suffix, such as
+             * "application/vnd.acme.order+json", also match the ranges naming
+             * their suffix (RFC 6838 Section 4.2.8): with the same type, as a
+             * subtype ("json") or after a wildcard ("*+json"), and with a
+             * wildcard type ("*+json" only). Suffix matches rank below exact
+             * matches and above wildcard matches, from the most to the least
+             * specific form.
+             */
+            kMatchSuffixes = 1 << 1
+        };
+
+        /**
+         * Constructor.
+         *
+         * @param[in] availableContentTypes list of available content types ordered by preference.
+         * @param[in] generation version number of the list, used to invalidate cached results.
+         * @param[in] flags combination of matching options.
+         */
+        explicit OfferSet(const std::vector<std::string> &availableContentTypes, uint64_t generation = 0, unsigned flags = 0);
+
+        /**
+         * Destructor.
+         */
+        ~OfferSet();
+
+        /**
+         * Returns the number of available content types, including invalid ones.
+         */
+        size_t size() const
+        {
+            return m_contentTypes.size();
+        }
+
+        /**
+         * Returns the list of available content types as it was provided.
+         */
+        const std::vector<std::string> &contentTypes() const
+        {
+            return m_contentTypes;
+        }
+
+        /**
+         * Returns the string that parse() returns when the content type at the
+         * given position is selected for a non empty 'Accept' header.
+         *
+         * @param[in] index position in the list of available content types.
+         *
+         * @return the normalized content type, or the content type as provided if it is invalid.
+         */
+        const std::string &result(size_t index) const
+        {
+            return m_results[index];
+        }
+
+        /**
+         * Returns the version number given at construction.
+         */
+        uint64_t generation() const
+        {
+            return m_generation;
+        }
+
+        /**
+         * Returns a hash of the list of available content types. Equal lists
+         * with equal matching options have equal fingerprints, in this and in
+         * any other process.
+         */
+        uint64_t fingerprint() const
+        {
+            return m_fingerprint;
+        }
+
+        /**
+         * Returns the matching options given at construction.
+         */
+        unsigned flags() const
+        {
+            return m_flags;
+        }
+
+    private:
+
+        friend class HttpAcceptParser;
+
+        OfferSet(const OfferSet &);
+        OfferSet &operator=(const OfferSet &);
+
+        /**
+         * Normalizes the parameters that follow the media type of an available
+         * content type, and appends their interned keys.
+         *
+         * @param[in,out] s parameters, starting at the first ';', lowercased in place.
+         * @param[in] length length of the parameters.
+         * @param[in,out] normalized normalized content type, receiving the normalized parameters.
+         *
+         * @return False if a parameter is invalid. Returns True otherwise.
+         */
+        bool normalizeParameters(char *s, size_t length, std::string &normalized);
+
+        std::vector<std::string>       m_contentTypes;
+        std::vector<std::string>       m_results;
+        std::vector<ParsedContentType> m_parsed;
+        std::vector<size_t>            m_indices;
+        std::vector<std::string>       m_parameterNames;
+        std::vector<uint32_t>          m_parameterNameSlots;
+        std::vector<std::string>       m_parameterValues;
+        std::vector<uint32_t>          m_parameterValueSlots;
+        std::vector<uint64_t>          m_parameterKeys;
+        std::vector<uint32_t>          m_parameterOffsets;
+        std::vector<std::string>       m_suffixes;
+        std::vector<uint32_t>          m_suffixSlots;
+        std::vector<std::string>       m_wildcardSuffixes;
+        std::vector<uint32_t>          m_suffixIds;
+        uint64_t                       m_generation;
+        uint64_t                       m_fingerprint;
+        unsigned                       m_flags;
+    };
+
+    /**
+     * @brief Working memory of a negotiation. Its buffers keep their capacity
+     * between calls, so that negotiating in steady state does not allocate.
+     * Buffers that grew beyond a limit, because of an unusually long header,
+     * are released at the end of the call.
+     *
+     * The overloads without a scratch argument use one scratch per thread. A
+     * scratch must not be used by several threads at the same time.
+     */
+    class NegotiationScratch
+    {
+    public:
+
+        /**
+         * @brief Parameter of an accepted media-range, before its quality.
+         * The name and the value point into the lowercased header held by the
+         * scratch, and remain valid until the scratch is used again.
+         */
+        struct Parameter
+        {
+            const char *name;
+            const char *value;
+            uint32_t    nameLength;
+            uint32_t    valueLength;
+            int         order;          ///< Position of the media-range in the header.
+        };
+
+        /**
+         * Default limit of the memory retained between calls.
+         */
+        static const size_t kDefaultMaxRetainedBytes = 16 * 1024;
+
+        /**
+         * Constructor.
+         *
+         * @param[in] maxRetainedBytes memory that can be retained between calls.
+         */
+        explicit NegotiationScratch(size_t maxRetainedBytes = kDefaultMaxRetainedBytes);
+
+        /**
+         * Destructor.
+         */
+        ~NegotiationScratch();
+
+        /**
+         * Returns the memory currently retained by the buffers.
+         */
+        size_t retainedBytes() const;
+
+        /**
+         * Returns whether the last 'Accept' header negotiated with this scratch
+         * contained characters that RFC 7230 does not allow outside of quoted
+         * strings, such as control characters or non ASCII bytes. Such headers
+         * are still negotiated.
+         */
+        bool hasInvalidCharacters() const
+        {
+            return m_invalidCharacters;
+        }
+
+        /**
+         * Enables or disables the retention of the media-range parameters.
+         * Parameters other than the quality are skipped by default. The
+         * accept-ext parameters following the quality are always skipped.
+         *
+         * @param[in] retain True to retain the parameters of the next negotiations.
+         */
+        void setRetainParameters(bool retain)
+        {
+            m_retainParameters = retain;
+        }
+
+        /**
+         * Returns the parameters of the media-ranges accepted by the last
+         * negotiation, in the order of the header, if their retention is
+         * enabled.
+         */
+        const std::vector<Parameter> &parameters() const
+        {
+            return m_parameters;
+        }
+
+    private:
+
+        friend class HttpAcceptParser;
+
+        NegotiationScratch(const NegotiationScratch &);
+        NegotiationScratch &operator=(const NegotiationScratch &);
+
+        /**
+         * Makes the text buffer large enough for a negotiation.
+         *
+         * @param[in] length number of bytes that will be copied to the text buffer.
+         *
+         * @return the text buffer.
+         */
+        char *prepare(size_t length);
+
+        /**
+         * Releases the buffers if they retain more memory than allowed.
+         */
+        void trim();
+
+        std::string                    m_text;
+        std::string                    m_value;
+        std::vector<ParsedContentType> m_accepted;
+        std::vector<ParsedContentType> m_available;
+        std::vector<ParsedContentType> m_selected;
+        std::vector<RangeSlot>         m_rangeSlots;
+        std::vector<Parameter>         m_parameters;
+        std::vector<uint64_t>          m_parameterKeys;
+        std::vector<std::pair<uint32_t, uint32_t>> m_acceptedParameters;
+        std::vector<uint32_t>          m_acceptedSuffixes;
+        int                            m_anyRange;
+        size_t                         m_maxRangeParameters;
+        size_t                         m_maxRetainedBytes;
+        bool                           m_fullRangeHash;
+        bool                           m_rangeParameters;
+        bool                           m_invalidCharacters;
+        bool                           m_retainParameters;
+    };
+
     /**
      * Returns a content type from a list of available content types according
-     * to the preferences specified in a HTTP 'Accept' header. 
-     * 
+     * to the preferences specified in a HTTP 'Accept' header.
+     *
      * @param[in] acceptValue value of the 'Accept' header.
      * @param[in] availableContentTypes list of available content types.
-     * 
+     *
      * @return the selected content type.
      */
     static std::string parse(const std::string & acceptValue, const std::vector<std::string> & availableContentTypes);
 
+    /**
+     * Returns a content type from a list of available content types according
+     * to the preferences specified in a HTTP 'Accept' header.
+     *
+     * @param[in] acceptValue value of the 'Accept' header.
+     * @param[in] availableContentTypes list of available content types.
+     * @param[in,out] scratch working memory owned by the caller.
+     *
+     * @return the selected content type.
+     */
+    static std::string parse(const std::string & acceptValue, const std::vector<std::string> & availableContentTypes, NegotiationScratch & scratch);
+
+    /**
+     * Returns a content type from a precompiled list of available content types
+     * according to the preferences specified in a HTTP 'Accept' header.
+     *
+     * @param[in] acceptValue value of the 'Accept' header.
+     * @param[in] availableContentTypes precompiled list of available content types.
+     *
+     * @return the selected content type, exactly as parse() would return it for the same list.
+     */
+    static std::string parse(const std::string & acceptValue, const OfferSet & availableContentTypes);
+
+    /**
+     * Selects a content type from a precompiled list of available content types
+     * according to the preferences specified in a HTTP 'Accept' header.
+     *
+     * @param[in] acceptValue value of the 'Accept' header.
+     * @param[in] availableContentTypes precompiled list of available content types.
+     *
+     * @return the position of the selected content type in the list, or -1 if the list is empty.
+     */
+    static int select(const std::string & acceptValue, const OfferSet & availableContentTypes);
+
+    /**
+     * Selects a content type from a precompiled list of available content types
+     * according to the preferences specified in a HTTP 'Accept' header.
+     *
+     * @param[in] acceptValue value of the 'Accept' header.
+     * @param[in] availableContentTypes precompiled list of available content types.
+     * @param[in,out] scratch working memory owned by the caller.
+     *
+     * @return the position of the selected content type in the list, or -1 if the list is empty.
+     */
+    static int select(const std::string & acceptValue, const OfferSet & availableContentTypes, NegotiationScratch & scratch);
+
 private:
 
     /**
@@ -41,86 +410,171 @@ private:
     }
 
     /**
-     * @brief Representation of a Mime Type containing additional information to facilitate
-     * the content type negotiation when a HTTP requests arrives.
+     * Parses the value of a HTTP 'Accept' header into a list of accepted content
+     * types sorted by priority.
+     *
+     * @param[in] acceptValue value of the 'Accept' header.
+     * @param[in] text buffer of at least acceptValue.size() bytes receiving the lowercased header.
+     * @param[in,out] scratch working memory receiving the list of accepted content types.
+     * @param[in] flags matching options of the offer set negotiated against the header.
      */
-    struct ParsedContentType
-    {
-        std::string range;
-        std::string type;
-        std::string subtype;
-        float       qvalue;
-        int         order;
-    };
+    static void parseAcceptedContentTypes(const std::string &acceptValue, char *text, NegotiationScratch &scratch, unsigned flags = 0);
 
     /**
-     * Converts a numeric string to its respective float value. 
-     * 
-     * @param[in] s numeric string containing a float number.
-     * @param[out] f destination of the converted float value.
-     * 
-     * @return False if the conversion fails. Returns True otherwise.
+     * Converts the parameters and the suffixes of the accepted content types
+     * of a scratch into the identifiers interned by an offer set, according to
+     * its matching options. Parameters and suffixes that no available content
+     * type declares get identifiers that match none. The identifiers of the
+     * parameters of every accepted content type are sorted.
+     *
+     * @param[in] availableContentTypes offer set interning the parameters and the suffixes.
+     * @param[in,out] scratch scratch holding the accepted content types and their parameters.
      */
-    static bool stringToFloat(const std::string &s, float *f);
+    static void internAcceptedContentTypes(const OfferSet &availableContentTypes, NegotiationScratch &scratch);
 
     /**
-     * Strip specified characters from the end of a string.
-     * 
-     * @param[in,out] s string that will be trimmed.
-     * @param[in] t list of all characters that will be stripped.
-     * 
-     * @return the modified string.
+     * Trims, lowercases and splits an available content type.
+     *
+     * @param[in,out] s buffer holding a copy of the content type, lowercased in place.
+     * @param[in] length length of the content type.
+     * @param[out] contentType content type pointing into the buffer.
+     *
+     * @return False if the content type is invalid. Returns True otherwise.
      */
-    static std::string &rtrim(std::string &s, const char *t);
+    static bool normalizeContentType(char *s, size_t length, ParsedContentType &contentType);
 
     /**
-     * Strip specified characters from the beginning of a string.
-     * 
-     * @param[in,out] s string that will be trimmed.
-     * @param[in] t list of all characters that will be stripped.
-     * 
-     * @return the modified string.
+     * Converts a numeric string to its respective float value.
+     *
+     * @param[in] s numeric string containing a float number.
+     * @param[out] f destination of the converted float value.
+     *
+     * @return False if the conversion fails. Returns True otherwise.
      */
-    static std::string &ltrim(std::string &s, const char *t);
+    static bool stringToFloat(const std::string &s, float *f);
 
     /**
-     * Strip whitespace (and other characters) from the beginning and end of a string.
-     * 
-     * @param[in,out] s string that will be trimmed.
-     * 
-     * @return the modified string.
+     * Strip whitespace from the beginning and end of a range of characters.
+     *
+     * @param[in] s string containing the range.
+     * @param[in,out] begin position of the first character of the range.
+     * @param[in,out] end position following the last character of the range.
      */
-    static std::string &trim(std::string &s);
+    static void trim(const char *s, size_t &begin, size_t &end);
 
     /**
-     * Make a string lowercase.
-     * 
-     * @param[in,out] s string that will be converted.
-     * 
-     * @return the string with all alphabetic characters converted to lowercase.
+     * Copies a string, converting all alphabetic characters to lowercase.
+     *
+     * @param[out] dst destination, which can be the source itself.
+     * @param[in] src string that will be converted.
+     * @param[in] length number of characters to convert.
      */
-    static std::string &stringToLower(std::string &s);
+    static void stringToLower(char *dst, const char *src, size_t length);
 
     /**
      * Determines wheter a content type is preferrable over another content type.
-     * 
+     *
      * @param[in] a the content type to be compared from.
      * @param[in] b the content type to be compared to.
-     * 
+     *
      * @return True if the content type 'a' is preferrable over the content type 'b'. Returns False otherwise.
      */
     static bool compareContentTypes(const ParsedContentType &a, const ParsedContentType &b);
 
+    /**
+     * Sorts a list of content types by preference, in the same order as
+     * std::sort() with compareContentTypes() in libstdc++. Short lists, the
+     * common case, are sorted with an inlined insertion sort, which is what
+     * libstdc++ does for up to 16 elements, whatever the standard library.
+     *
+     * @param[in,out] contentTypes list of content types.
+     */
+    static void rankContentTypes(std::vector<ParsedContentType> &contentTypes);
+
+    /**
+     * Indexes the accepted content types of a scratch by type and subtype, so
+     * that the ranges matching an available content type are found with at
+     * most three lookups, whatever the length of the 'Accept' header. Lists of
+     * up to kMaxScannedRanges content types, which are cheaper to scan, are
+     * not indexed.
+     *
+     * @param[in,out] scratch scratch holding the accepted content types.
+     * @param[in] matchParameters True to index them by the set of their interned parameters as well.
+     */
+    static void indexAcceptedContentTypes(NegotiationScratch &scratch, bool matchParameters = false);
+
+    /**
+     * Finds the slot of the accepted content types with a type and a subtype.
+     *
+     * @param[in] scratch scratch holding the indexed accepted content types.
+     * @param[in] hash hash of the type and the subtype.
+     * @param[in] type the type.
+     * @param[in] typeLength length of the type.
+     * @param[in] subtype the subtype.
+     * @param[in] subtypeLength length of the subtype.
+     * @param[in] keys sorted identifiers of the parameters, if the index is keyed by parameters.
+     * @param[in] keyCount number of identifiers.
+     *
+     * @return the slot, or nullptr if no accepted content type has this type and subtype.
+     */
+    static const RangeSlot *findRangeSlot(const NegotiationScratch &scratch, uint64_t hash, const char *type, size_t typeLength, const char *subtype, size_t subtypeLength,
+        const uint64_t *keys = nullptr, size_t keyCount = 0);
+
+    /**
+     * Returns the quality of an available content type according to the
+     * indexed accepted content types of a scratch.
+     *
+     * @param[in] availableContentType normalized available content type.
+     * @param[in] scratch scratch holding the indexed accepted content types.
+     *
+     * @return the quality of the range that matches the content type best, or
+     * the quality of the content type itself if no range matches it.
+     */
+    static float getQuality(const ParsedContentType &availableContentType, const NegotiationScratch &scratch);
+
+    /**
+     * Returns the quality of an available content type of an offer set with
+     * matching options, according to the accepted content types of a scratch
+     * and their interned parameters and suffixes. Indexed accepted content
+     * types are looked up for every subset of the parameters of the content
+     * type, and for the forms of a range naming its suffix.
+     *
+     * @param[in] availableContentType normalized available content type.
+     * @param[in] availableContentTypes offer set of the content type.
+     * @param[in] scratch scratch holding the accepted content types and their interned identifiers.
+     *
+     * @return the quality of the most specific range that matches the content
+     * type, or the quality of the content type itself if no range matches it.
+     */
+    static float getMatchingQuality(const ParsedContentType &availableContentType, const OfferSet &availableContentTypes, const NegotiationScratch &scratch);
+
+    /**
+     * Records a sampled negotiation in HttpAcceptTrace, with every available
+     * content type scored and ranked.
+     *
+     * @param[in] acceptValue value of the 'Accept' header.
+     * @param[in] availableContentTypes list of normalized available content types ordered by preference.
+     * @param[in] indices position of every normalized content type in the list provided by the caller, nullptr if they are equal.
+     * @param[in] offerSetId fingerprint of the list provided by the caller.
+     * @param[in] offerSet offer set of the available content types if it has matching options, nullptr otherwise.
+     * @param[in,out] scratch scratch holding the indexed accepted content types.
+     * @param[in] selected position of the selected content type in the list provided by the caller, or -1.
+     */
+    static void traceNegotiation(const std::string &acceptValue, const std::vector<ParsedContentType> &availableContentTypes, const size_t *indices,
+        uint64_t offerSetId, const OfferSet *offerSet, NegotiationScratch &scratch, int selected);
+
     /**
      * Returns the preferable content type from a list of available content types
      * according to a list of accepted content types.
-     * 
-     * @param[in] acceptedContentTypes list of accepted content types with normalized weights.
-     * @param[in] availableContentTypes list of available content types ordeder by preference.
-     * 
-     * @return the preferable and accepted content type from the list of available content types.
+     *
+     * @param[in] availableContentTypes list of normalized available content types ordeder by preference.
+     * @param[in,out] scratch scratch holding the indexed accepted content types.
+     * @param[in] offerSet offer set of the available content types if it has matching options, nullptr otherwise.
+     *
+     * @return the position of the preferable and accepted content type in the list of
+     * available content types, or -1 if the list is empty.
      */
-    static std::string getPreferableContentType(const std::vector<ParsedContentType> &acceptedContentTypes, const std::vector<std::string> &availableContentTypes);
+    static int getPreferableContentType(const std::vector<ParsedContentType> &availableContentTypes, NegotiationScratch &scratch, const OfferSet *offerSet = nullptr);
 };
 
 #endif // HTTP_ACCEPT_PARSER_H
\ No newline at end of file
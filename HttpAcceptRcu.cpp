@@ -0,0 +1,164 @@
+/* -*- c++ -*- */
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+#include "HttpAcceptRcu.h"
+
+namespace
+{
+    // Number of threads that can hold a dedicated reader slot. Threads beyond
+    // that share a single counter, which only delays reclamation.
+    const unsigned kMaxReaderSlots = 128;
+
+    struct alignas(64) ReaderSlot
+    {
+        std::atomic<uint64_t> epoch;
+        std::atomic<bool>     owned;
+    };
+
+    struct RetiredObject
+    {
+        void     *object;
+        void    (*deleter)(void *);
+        uint64_t  epoch;
+    };
+
+    ReaderSlot                 g_readerSlots[kMaxReaderSlots];
+    std::atomic<uint64_t>      g_epoch(1);
+    std::atomic<uint64_t>      g_overflowReaders(0);
+    std::mutex                 g_retiredMutex;
+    std::vector<RetiredObject> g_retiredObjects;
+
+    struct ReaderState
+    {
+        ReaderSlot *slot;
+        unsigned    depth;
+
+        ReaderState() : slot(nullptr), depth(0)
+        {
+            for (auto &candidate : g_readerSlots)
+            {
+                bool expected = false;
+                if (!candidate.owned.load(std::memory_order_relaxed) && candidate.owned.compare_exchange_strong(expected, true))
+                {
+                    slot = &candidate;
+                    break;
+                }
+            }
+        }
+
+        ~ReaderState()
+        {
+            if (slot)
+            {
+                slot->epoch.store(0);
+                slot->owned.store(false);
+            }
+        }
+    };
+
+    thread_local ReaderState t_readerState;
+
+    // Frees what is left at exit, once every other thread has stopped reading.
+    struct RetiredObjectsReaper
+    {
+        ~RetiredObjectsReaper()
+        {
+            HttpAcceptRcu::reclaim();
+        }
+    } g_retiredObjectsReaper;
+}
+
+HttpAcceptRcu::ReadGuard::ReadGuard()
+{
+    ReaderState &state = t_readerState;
+    if (state.depth++ > 0)
+    {
+        return;
+    }
+
+    if (state.slot)
+    {
+        // Announce the epoch before loading any published pointer. The store is
+        // sequentially consistent so that it cannot be reordered after those loads.
+        state.slot->epoch.store(g_epoch.load());
+    }
+    else
+    {
+        g_overflowReaders.fetch_add(1);
+    }
+}
+
+HttpAcceptRcu::ReadGuard::~ReadGuard()
+{
+    ReaderState &state = t_readerState;
+    if (--state.depth > 0)
+    {
+        return;
+    }
+
+    if (state.slot)
+    {
+        state.slot->epoch.store(0, std::memory_order_release);
+    }
+    else
+    {
+        g_overflowReaders.fetch_sub(1, std::memory_order_release);
+    }
+}
+
+void HttpAcceptRcu::retire(void *object, void (*deleter)(void *))
+{
+    {
+        std::lock_guard<std::mutex> lock(g_retiredMutex);
+
+        // Readers that announce a later epoch started after the object was unpublished.
+        g_retiredObjects.push_back(RetiredObject{object, deleter, g_epoch.fetch_add(1)});
+    }
+    reclaim();
+}
+
+void HttpAcceptRcu::reclaim()
+{
+    std::vector<RetiredObject> reclaimable;
+    {
+        std::lock_guard<std::mutex> lock(g_retiredMutex);
+        if (g_retiredObjects.empty() || (g_overflowReaders.load() != 0))
+        {
+            return;
+        }
+
+        // Objects retired before the oldest announced epoch are unreachable.
+        uint64_t oldestEpoch = UINT64_MAX;
+        for (const auto &slot : g_readerSlots)
+        {
+            const uint64_t epoch = slot.epoch.load();
+            if ((epoch != 0) && (epoch < oldestEpoch))
+            {
+                oldestEpoch = epoch;
+            }
+        }
+
+        auto retained = g_retiredObjects.begin();
+        for (auto it = g_retiredObjects.begin(); it != g_retiredObjects.end(); ++it)
+        {
+            if (it->epoch < oldestEpoch)
+            {
+                reclaimable.push_back(*it);
+            }
+            else
+            {
+                *retained++ = *it;
+            }
+        }
+        g_retiredObjects.erase(retained, g_retiredObjects.end());
+    }
+
+    // Deleters run without the lock held, since they may retire other objects.
+    for (const auto &retired : reclaimable)
+    {
+        retired.deleter(retired.object);
+    }
+}
@@ -0,0 +1,93 @@
+/* -*- c++ -*- */
+
+#ifndef HTTP_ACCEPT_RCU_H
+#define HTTP_ACCEPT_RCU_H
+
+/**
+ * Epoch based read-copy-update used to publish immutable snapshots (hot
+ * header tables, offer set versions) to concurrent readers.
+ *
+ * Readers wrap every access to a published pointer in a ReadGuard, which only
+ * announces the current epoch in a per-thread slot and never blocks. Writers
+ * build a new snapshot, publish it with an atomic pointer exchange and hand
+ * the previous snapshot to retire(). The retired snapshot is deleted once no
+ * reader that could still observe it remains inside a read-side section.
+ *
+ * Published pointers must be loaded with sequentially consistent ordering
+ * (the default for std::atomic) while a ReadGuard is alive, and must not be
+ * used after the guard has been destroyed.
+ */
+class HttpAcceptRcu
+{
+public:
+
+    /**
+     * @brief Read-side critical section. Guards can be nested within a thread.
+     */
+    class ReadGuard
+    {
+    public:
+
+        /**
+         * Enters a read-side critical section.
+         */
+        ReadGuard();
+
+        /**
+         * Leaves the read-side critical section.
+         */
+        ~ReadGuard();
+
+    private:
+
+        ReadGuard(const ReadGuard &);
+        ReadGuard &operator=(const ReadGuard &);
+    };
+
+    /**
+     * Defers the deletion of an unpublished snapshot until no reader can
+     * reference it anymore.
+     *
+     * @param[in] object snapshot that has already been replaced or unpublished.
+     */
+    template <typename T>
+    static void retire(const T *object)
+    {
+        if (object)
+        {
+            retire(const_cast<T *>(object), &deleteObject<T>);
+        }
+    }
+
+    /**
+     * Defers the destruction of an object until no reader can reference it anymore.
+     *
+     * @param[in] object object that has already been replaced or unpublished.
+     * @param[in] deleter function called with the object once it is safe to destroy it.
+     */
+    static void retire(void *object, void (*deleter)(void *));
+
+    /**
+     * Destroys every retired object that is no longer reachable by readers.
+     * Called by retire(), but can also be called periodically from a
+     * maintenance thread.
+     */
+    static void reclaim();
+
+private:
+
+    /**
+     * Constructor.
+     */
+    HttpAcceptRcu()
+    {
+    }
+
+    template <typename T>
+    static void deleteObject(void *object)
+    {
+        delete static_cast<T *>(object);
+    }
+};
+
+#endif // HTTP_ACCEPT_RCU_H
@@ -0,0 +1,345 @@
+/* -*- c++ -*- */
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <thread>
+#include "HttpAcceptSharedCache.h"
+#include "HttpAcceptHash.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define HTTP_ACCEPT_SHARED_MEMORY 1
+#endif
+
+// Atomics are shared between processes, so they must not rely on a lock.
+static_assert((ATOMIC_INT_LOCK_FREE == 2) && (ATOMIC_LLONG_LOCK_FREE == 2), "Shared memory requires address-free atomics");
+
+namespace
+{
+    const uint64_t kMagic = 0x3143434154504348ULL;
+
+    // Must change whenever the layout or the negotiation results change, so
+    // that a segment left by a previous deployment is not reused.
+    const uint32_t kLayoutVersion = 1;
+    const uint64_t kWays = 4;
+    const size_t   kWords = HttpAcceptSharedCache::kMaxAcceptLength / 8;
+    const size_t   kHeaderSize = 256;
+
+    enum : uint32_t
+    {
+        kUninitialized = 0,
+        kInitializing = 1,
+        kReady = 2
+    };
+
+    uint64_t roundUpToPowerOfTwo(uint64_t value)
+    {
+        uint64_t result = 1;
+        while (result < value)
+        {
+            result <<= 1;
+        }
+        return result;
+    }
+
+    uint64_t loadWord(const std::string &s, size_t word)
+    {
+        uint64_t value = 0;
+        const size_t offset = word * 8;
+        if (offset < s.size())
+        {
+            std::memcpy(&value, s.data() + offset, std::min<size_t>(8, s.size() - offset));
+        }
+        return value;
+    }
+}
+
+/**
+ * @brief First bytes of the segment, written once by the process that creates it.
+ */
+struct HttpAcceptSharedCache::Header
+{
+    std::atomic<uint32_t> state;
+    uint32_t              version;
+    uint64_t              magic;
+    uint64_t              slotCount;
+};
+
+/**
+ * @brief One cached result. Every field is atomic so that concurrent readers
+ * and writers never race, and the sequence counter tells whether the fields
+ * that were read belong to the same write.
+ */
+struct HttpAcceptSharedCache::Slot
+{
+    std::atomic<uint32_t> sequence;
+    std::atomic<int32_t>  index;
+    std::atomic<uint64_t> fingerprint;
+    std::atomic<uint64_t> hash;
+    std::atomic<uint64_t> length;
+    std::atomic<uint64_t> words[kWords];
+};
+
+HttpAcceptSharedCache::HttpAcceptSharedCache()
+    : m_memory(nullptr), m_size(0), m_header(nullptr), m_slots(nullptr), m_mask(0),
+      m_lookups(0), m_hits(0), m_inserts(0), m_busySlots(0), m_uncacheable(0)
+{
+    static_assert(sizeof(Slot) == 256, "Slots are expected to span four cache lines");
+}
+
+HttpAcceptSharedCache::~HttpAcceptSharedCache()
+{
+    detach();
+}
+
+bool HttpAcceptSharedCache::create(size_t capacity)
+{
+#ifdef HTTP_ACCEPT_SHARED_MEMORY
+    detach();
+    const uint64_t slotCount = roundUpToPowerOfTwo(std::max<uint64_t>(capacity, kWays));
+    const size_t size = kHeaderSize + slotCount * sizeof(Slot);
+    void *memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED)
+    {
+        return false;
+    }
+    return attach(memory, size, slotCount);
+#else
+    (void)capacity;
+    return false;
+#endif
+}
+
+bool HttpAcceptSharedCache::open(const std::string &name, size_t capacity)
+{
+#ifdef HTTP_ACCEPT_SHARED_MEMORY
+    detach();
+    const uint64_t slotCount = roundUpToPowerOfTwo(std::max<uint64_t>(capacity, kWays));
+    const size_t size = kHeaderSize + slotCount * sizeof(Slot);
+    const int fd = shm_open(name.c_str(), O_RDWR | O_CREAT, 0600);
+    if (fd < 0)
+    {
+        return false;
+    }
+
+    // The first process sizes the segment, which the kernel fills with zeros:
+    // an all-zero slot is a valid empty slot.
+    struct stat status;
+    if ((fstat(fd, &status) != 0) ||
+        ((status.st_size == 0) && (ftruncate(fd, static_cast<off_t>(size)) != 0)) ||
+        ((status.st_size != 0) && (static_cast<size_t>(status.st_size) != size)))
+    {
+        close(fd);
+        return false;
+    }
+
+    void *memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (memory == MAP_FAILED)
+    {
+        return false;
+    }
+    return attach(memory, size, slotCount);
+#else
+    (void)name;
+    (void)capacity;
+    return false;
+#endif
+}
+
+int HttpAcceptSharedCache::select(const std::string &acceptValue, const HttpAcceptParser::OfferSet &availableContentTypes)
+{
+    if (acceptValue.empty() || !m_slots)
+    {
+        return HttpAcceptParser::select(acceptValue, availableContentTypes);
+    }
+    if (acceptValue.size() > kMaxAcceptLength)
+    {
+        m_uncacheable.fetch_add(1, std::memory_order_relaxed);
+        return HttpAcceptParser::select(acceptValue, availableContentTypes);
+    }
+
+    m_lookups.fetch_add(1, std::memory_order_relaxed);
+    int index;
+    if (lookup(availableContentTypes.fingerprint(), acceptValue, &index) && (index < static_cast<int>(availableContentTypes.size())))
+    {
+        m_hits.fetch_add(1, std::memory_order_relaxed);
+        return index;
+    }
+
+    index = HttpAcceptParser::select(acceptValue, availableContentTypes);
+    insert(availableContentTypes.fingerprint(), acceptValue, index);
+    return index;
+}
+
+std::string HttpAcceptSharedCache::parse(const std::string &acceptValue, const HttpAcceptParser::OfferSet &availableContentTypes)
+{
+    // If the 'Accept' header is empty then return the first available content type as provided.
+    if (acceptValue.empty())
+    {
+        return HttpAcceptParser::parse(acceptValue, availableContentTypes);
+    }
+
+    const int selected = select(acceptValue, availableContentTypes);
+    return (selected >= 0) ? availableContentTypes.result(selected) : std::string();
+}
+
+bool HttpAcceptSharedCache::lookup(uint64_t fingerprint, const std::string &acceptValue, int *index) const
+{
+    if (!m_slots || (acceptValue.size() > kMaxAcceptLength))
+    {
+        return false;
+    }
+
+    const uint64_t hash = HttpAcceptHash::hash(acceptValue, fingerprint);
+    const uint64_t bucket = hash & m_mask & ~(kWays - 1);
+    for (uint64_t way = 0; way < kWays; ++way)
+    {
+        const Slot &slot = m_slots[bucket + way];
+        const uint32_t sequence = slot.sequence.load(std::memory_order_acquire);
+        if ((sequence & 1) ||
+            (slot.hash.load(std::memory_order_relaxed) != hash) ||
+            (slot.fingerprint.load(std::memory_order_relaxed) != fingerprint) ||
+            (slot.length.load(std::memory_order_relaxed) != acceptValue.size()))
+        {
+            continue;
+        }
+
+        bool equal = true;
+        for (size_t word = 0; (word * 8 < acceptValue.size()) && equal; ++word)
+        {
+            equal = slot.words[word].load(std::memory_order_relaxed) == loadWord(acceptValue, word);
+        }
+        const int32_t value = slot.index.load(std::memory_order_relaxed);
+
+        // The fields belong to a single write only if the sequence did not move.
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (equal && (slot.sequence.load(std::memory_order_relaxed) == sequence))
+        {
+            *index = value;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool HttpAcceptSharedCache::insert(uint64_t fingerprint, const std::string &acceptValue, int index)
+{
+    if (!m_slots || (acceptValue.size() > kMaxAcceptLength))
+    {
+        return false;
+    }
+
+    // Prefer the slot already holding this key, then a never written slot, then
+    // a victim chosen from the hash so that workers agree on it.
+    const uint64_t hash = HttpAcceptHash::hash(acceptValue, fingerprint);
+    const uint64_t bucket = hash & m_mask & ~(kWays - 1);
+    Slot *target = nullptr;
+    for (uint64_t way = 0; (way < kWays) && !target; ++way)
+    {
+        Slot &slot = m_slots[bucket + way];
+        if ((slot.hash.load(std::memory_order_relaxed) == hash) && (slot.fingerprint.load(std::memory_order_relaxed) == fingerprint))
+        {
+            target = &slot;
+        }
+    }
+    for (uint64_t way = 0; (way < kWays) && !target; ++way)
+    {
+        Slot &slot = m_slots[bucket + way];
+        if (slot.sequence.load(std::memory_order_relaxed) == 0)
+        {
+            target = &slot;
+        }
+    }
+    if (!target)
+    {
+        target = &m_slots[bucket + ((hash >> 32) & (kWays - 1))];
+    }
+
+    uint32_t sequence = target->sequence.load(std::memory_order_relaxed);
+    if ((sequence & 1) || !target->sequence.compare_exchange_strong(sequence, sequence + 1, std::memory_order_relaxed))
+    {
+        m_busySlots.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+    std::atomic_thread_fence(std::memory_order_release);
+
+    target->index.store(index, std::memory_order_relaxed);
+    target->fingerprint.store(fingerprint, std::memory_order_relaxed);
+    target->hash.store(hash, std::memory_order_relaxed);
+    target->length.store(acceptValue.size(), std::memory_order_relaxed);
+    for (size_t word = 0; word * 8 < acceptValue.size(); ++word)
+    {
+        target->words[word].store(loadWord(acceptValue, word), std::memory_order_relaxed);
+    }
+
+    target->sequence.store(sequence + 2, std::memory_order_release);
+    m_inserts.fetch_add(1, std::memory_order_relaxed);
+    return true;
+}
+
+HttpAcceptSharedCache::Stats HttpAcceptSharedCache::getStats() const
+{
+    Stats stats;
+    stats.lookups = m_lookups.load(std::memory_order_relaxed);
+    stats.hits = m_hits.load(std::memory_order_relaxed);
+    stats.inserts = m_inserts.load(std::memory_order_relaxed);
+    stats.busySlots = m_busySlots.load(std::memory_order_relaxed);
+    stats.uncacheable = m_uncacheable.load(std::memory_order_relaxed);
+    return stats;
+}
+
+bool HttpAcceptSharedCache::attach(void *memory, size_t size, uint64_t slotCount)
+{
+    m_memory = memory;
+    m_size = size;
+    m_header = static_cast<Header *>(memory);
+
+    // The first process to attach initializes the header, the others wait for it.
+    uint32_t state = kUninitialized;
+    if (m_header->state.compare_exchange_strong(state, kInitializing, std::memory_order_acquire))
+    {
+        m_header->version = kLayoutVersion;
+        m_header->magic = kMagic;
+        m_header->slotCount = slotCount;
+        m_header->state.store(kReady, std::memory_order_release);
+    }
+    else
+    {
+        const auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(1);
+        while ((m_header->state.load(std::memory_order_acquire) != kReady) && (std::chrono::steady_clock::now() < deadline))
+        {
+            std::this_thread::yield();
+        }
+    }
+
+    if ((m_header->state.load(std::memory_order_acquire) != kReady) || (m_header->magic != kMagic) ||
+        (m_header->version != kLayoutVersion) || (m_header->slotCount != slotCount))
+    {
+        detach();
+        return false;
+    }
+
+    m_slots = reinterpret_cast<Slot *>(static_cast<char *>(memory) + kHeaderSize);
+    m_mask = slotCount - 1;
+    return true;
+}
+
+void HttpAcceptSharedCache::detach()
+{
+#ifdef HTTP_ACCEPT_SHARED_MEMORY
+    if (m_memory)
+    {
+        munmap(m_memory, m_size);
+    }
+#endif
+    m_memory = nullptr;
+    m_size = 0;
+    m_header = nullptr;
+    m_slots = nullptr;
+    m_mask = 0;
+}
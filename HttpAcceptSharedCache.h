@@ -0,0 +1,175 @@
+/* -*- c++ -*- */
+
+#ifndef HTTP_ACCEPT_SHARED_CACHE_H
+#define HTTP_ACCEPT_SHARED_CACHE_H
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include "HttpAcceptParser.h"
+
+/**
+ * Negotiation cache stored in a shared memory segment, so that the worker
+ * processes of a pre-fork server share their results: a miss in one worker
+ * warms the cache of every other worker.
+ *
+ * Entries are keyed by the fingerprint of the offer set and the 'Accept'
+ * header, and store the position of the selected content type. Readers never
+ * lock: every slot is protected by a sequence counter that writers make odd
+ * while they update it, and readers retry nothing, they report a miss when
+ * the counter changed under them. Writers never wait either, a busy slot is
+ * simply not updated.
+ *
+ * A worker that dies in the middle of insert() leaves the sequence counter of
+ * its slot odd. The slot then stays busy for good: lookups skip it and the
+ * inserts choosing it fail, so its bucket keeps three of its four slots
+ * until the segment is created again.
+ *
+ * Offer sets are identified by their content fingerprint rather than by their
+ * registry generation, since generations are numbered independently by each
+ * process while fingerprints are equal in every process.
+ */
+class HttpAcceptSharedCache
+{
+public:
+
+    /**
+     * @brief Counters of the calling process.
+     */
+    struct Stats
+    {
+        uint64_t lookups;            ///< Calls to select() that could use the cache.
+        uint64_t hits;               ///< Calls answered from the shared segment.
+        uint64_t inserts;            ///< Results written to the shared segment.
+        uint64_t busySlots;          ///< Results not written because another writer held the slot.
+        uint64_t uncacheable;        ///< Calls bypassing the cache because the header is too long.
+    };
+
+    /**
+     * Longest 'Accept' header that can be cached.
+     */
+    static const size_t kMaxAcceptLength = 224;
+
+    /**
+     * Constructor. The cache is unusable until create() or open() succeeds.
+     */
+    HttpAcceptSharedCache();
+
+    /**
+     * Destructor. Unmaps the segment.
+     */
+    ~HttpAcceptSharedCache();
+
+    /**
+     * Creates an anonymous shared segment. Must be called before forking the
+     * workers, which inherit the mapping.
+     *
+     * @param[in] capacity number of cached headers, rounded up to a power of two.
+     *
+     * @return False if the segment cannot be created. Returns True otherwise.
+     */
+    bool create(size_t capacity);
+
+    /**
+     * Opens a named POSIX shared memory segment, creating it if needed, so
+     * that unrelated processes can share it.
+     *
+     * @param[in] name name of the segment, as accepted by shm_open (e.g. "/accept-cache").
+     * @param[in] capacity number of cached headers, rounded up to a power of two.
+     * All the processes must use the same capacity.
+     *
+     * A process that dies while it initializes the segment leaves it half
+     * initialized: every later call waits one second for the initialization
+     * to complete, then fails, until the segment is removed with shm_unlink.
+     *
+     * @return False if the segment cannot be opened or has an incompatible layout. Returns True otherwise.
+     */
+    bool open(const std::string &name, size_t capacity);
+
+    /**
+     * Same as HttpAcceptParser::select(), answered from the shared segment
+     * when another worker already negotiated the same header.
+     *
+     * @param[in] acceptValue value of the 'Accept' header.
+     * @param[in] availableContentTypes precompiled list of available content types.
+     *
+     * @return the position of the selected content type in the list, or -1 if the list is empty.
+     */
+    int select(const std::string &acceptValue, const HttpAcceptParser::OfferSet &availableContentTypes);
+
+    /**
+     * Same as HttpAcceptParser::parse(), answered from the shared segment
+     * when another worker already negotiated the same header.
+     *
+     * @param[in] acceptValue value of the 'Accept' header.
+     * @param[in] availableContentTypes precompiled list of available content types.
+     *
+     * @return the selected content type.
+     */
+    std::string parse(const std::string &acceptValue, const HttpAcceptParser::OfferSet &availableContentTypes);
+
+    /**
+     * Looks up a result without negotiating on a miss.
+     *
+     * @param[in] fingerprint fingerprint of the offer set.
+     * @param[in] acceptValue value of the 'Accept' header.
+     * @param[out] index position of the selected content type.
+     *
+     * @return True if the result was found. Returns False otherwise.
+     */
+    bool lookup(uint64_t fingerprint, const std::string &acceptValue, int *index) const;
+
+    /**
+     * Stores a result.
+     *
+     * @param[in] fingerprint fingerprint of the offer set.
+     * @param[in] acceptValue value of the 'Accept' header.
+     * @param[in] index position of the selected content type.
+     *
+     * @return True if the result was stored. Returns False if the slot was busy or the header too long.
+     */
+    bool insert(uint64_t fingerprint, const std::string &acceptValue, int index);
+
+    /**
+     * Returns the counters of the calling process.
+     */
+    Stats getStats() const;
+
+private:
+
+    HttpAcceptSharedCache(const HttpAcceptSharedCache &);
+    HttpAcceptSharedCache &operator=(const HttpAcceptSharedCache &);
+
+    struct Header;
+    struct Slot;
+
+    /**
+     * Validates or initializes the header of a freshly mapped segment.
+     *
+     * @param[in] memory mapped segment.
+     * @param[in] size size of the mapping.
+     * @param[in] slotCount number of slots.
+     *
+     * @return False if the segment has an incompatible layout. Returns True otherwise.
+     */
+    bool attach(void *memory, size_t size, uint64_t slotCount);
+
+    /**
+     * Unmaps the segment, if any.
+     */
+    void detach();
+
+    void                  *m_memory;
+    size_t                 m_size;
+    Header                *m_header;
+    Slot                  *m_slots;
+    uint64_t               m_mask;
+
+    std::atomic<uint64_t>  m_lookups;
+    std::atomic<uint64_t>  m_hits;
+    std::atomic<uint64_t>  m_inserts;
+    std::atomic<uint64_t>  m_busySlots;
+    std::atomic<uint64_t>  m_uncacheable;
+};
+
+#endif // HTTP_ACCEPT_SHARED_CACHE_H
@@ -0,0 +1,155 @@
+/* -*- c++ -*- */
+
+#ifndef HTTP_ACCEPT_THREAD_REGISTRY_H
+#define HTTP_ACCEPT_THREAD_REGISTRY_H
+
+#include <memory>
+#include <mutex>
+#include <new>
+
+/**
+ * Registry of per-thread data, written by its thread without synchronization
+ * and read by the threads collecting it.
+ *
+ * The data of a thread is allocated and registered on its first call to
+ * local(), so that the threads that never write do not pay for it. When the
+ * thread ends, its data is merged into the totals of the exited threads and
+ * released. Every instantiation is a separate registry.
+ *
+ * The data is allocated with the alignment of its type, which operator new
+ * does not guarantee beyond that of std::max_align_t in C++11, so that data
+ * aligned on a cache line never shares it with the data of another thread.
+ *
+ * @tparam Data data of a thread, zero initialized.
+ * @tparam Totals data of several threads, zero initialized.
+ * @tparam Merge function adding the data of a thread to totals.
+ */
+template <typename Data, typename Totals, void (*Merge)(Totals &, const Data &)>
+class HttpAcceptThreadRegistry
+{
+public:
+
+    /**
+     * Returns the data of the calling thread.
+     *
+     * @return the data, registered on first use.
+     */
+    static Data &local()
+    {
+        static thread_local Owner t_owner;
+        return t_owner.node->data;
+    }
+
+    /**
+     * Returns the totals of the exited threads, merged with the data of the
+     * live ones.
+     *
+     * @return the totals of all the threads.
+     */
+    static Totals collect()
+    {
+        Registry &instance = registry();
+        std::lock_guard<std::mutex> lock(instance.mutex);
+        Totals totals(instance.exited);
+        for (const Node *node = instance.threads; node; node = node->next)
+        {
+            Merge(totals, node->data);
+        }
+        return totals;
+    }
+
+    /**
+     * Calls a function with the data of every live thread. The registry is
+     * locked meanwhile, which only keeps the data alive: the writers never
+     * take the lock.
+     *
+     * @param[in] function function called with a const reference to the data of a thread.
+     */
+    template <typename Function>
+    static void forEach(Function function)
+    {
+        Registry &instance = registry();
+        std::lock_guard<std::mutex> lock(instance.mutex);
+        for (const Node *node = instance.threads; node; node = node->next)
+        {
+            function(node->data);
+        }
+    }
+
+private:
+
+    /**
+     * Constructor.
+     */
+    HttpAcceptThreadRegistry();
+
+    struct Node
+    {
+        Data  data;
+        Node *previous;
+        Node *next;
+    };
+
+    // The registry is intentionally leaked, so that threads exiting after the
+    // static destructors have run can still unregister their data.
+    struct Registry
+    {
+        std::mutex mutex;
+        Node      *threads;
+        Totals     exited;
+    };
+
+    static Registry &registry()
+    {
+        static Registry *instance = new Registry();
+        return *instance;
+    }
+
+    struct Owner
+    {
+        void *memory;
+        Node *node;
+
+        Owner()
+            : memory(::operator new(sizeof(Node) + alignof(Node) - 1)), node(nullptr)
+        {
+            void *address = memory;
+            size_t space = sizeof(Node) + alignof(Node) - 1;
+            node = new (std::align(alignof(Node), sizeof(Node), address, space)) Node();
+
+            Registry &instance = registry();
+            std::lock_guard<std::mutex> lock(instance.mutex);
+            node->next = instance.threads;
+            if (instance.threads)
+            {
+                instance.threads->previous = node;
+            }
+            instance.threads = node;
+        }
+
+        ~Owner()
+        {
+            Registry &instance = registry();
+            {
+                std::lock_guard<std::mutex> lock(instance.mutex);
+                Merge(instance.exited, node->data);
+                if (node->previous)
+                {
+                    node->previous->next = node->next;
+                }
+                else
+                {
+                    instance.threads = node->next;
+                }
+                if (node->next)
+                {
+                    node->next->previous = node->previous;
+                }
+            }
+            node->~Node();
+            ::operator delete(memory);
+        }
+    };
+};
+
+#endif // HTTP_ACCEPT_THREAD_REGISTRY_H
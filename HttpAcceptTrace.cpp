@@ -0,0 +1,111 @@
+/* -*- c++ -*- */
+
+#include <algorithm>
+#include <cstring>
+#include "HttpAcceptThreadRegistry.h"
+#include "HttpAcceptTrace.h"
+
+namespace
+{
+    const unsigned kRecordWords = (sizeof(HttpAcceptTrace::Record) + sizeof(uint64_t) - 1) / sizeof(uint64_t);
+
+    // Every word of a record is atomic so that the readers and the writer
+    // never race, and the sequence counter, odd while the record is written,
+    // tells whether the words that were read belong to the same record.
+    struct Slot
+    {
+        std::atomic<uint64_t> sequence;
+        std::atomic<uint64_t> words[kRecordWords];
+    };
+
+    // Numbers the threads in the order of their first record.
+    std::atomic<uint32_t> g_threadCount(0);
+
+    struct ThreadRing
+    {
+        Slot     slots[HttpAcceptTrace::kCapacity];
+        uint64_t next;
+        uint32_t thread = g_threadCount.fetch_add(1, std::memory_order_relaxed);
+    };
+
+    // The rings of the exited threads are dropped with them.
+    struct NoTotals
+    {
+    };
+
+    void merge(NoTotals &, const ThreadRing &)
+    {
+    }
+
+    typedef HttpAcceptThreadRegistry<ThreadRing, NoTotals, merge> Registry;
+
+    thread_local unsigned t_countdown = 0;
+}
+
+std::atomic<unsigned> HttpAcceptTrace::s_samplePeriod(0);
+
+bool HttpAcceptTrace::countdown(unsigned period)
+{
+    if (t_countdown)
+    {
+        --t_countdown;
+        return false;
+    }
+    t_countdown = period - 1;
+    return true;
+}
+
+void HttpAcceptTrace::record(const Record &record)
+{
+    ThreadRing &ring = Registry::local();
+
+    Record copy = record;
+    copy.thread = ring.thread;
+    uint64_t words[kRecordWords] = {};
+    std::memcpy(words, &copy, sizeof(copy));
+
+    Slot &slot = ring.slots[ring.next++ % kCapacity];
+    const uint64_t sequence = slot.sequence.load(std::memory_order_relaxed);
+    slot.sequence.store(sequence + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    for (unsigned word = 0; word < kRecordWords; ++word)
+    {
+        slot.words[word].store(words[word], std::memory_order_relaxed);
+    }
+    slot.sequence.store(sequence + 2, std::memory_order_release);
+}
+
+std::vector<HttpAcceptTrace::Record> HttpAcceptTrace::dump()
+{
+    std::vector<Record> records;
+    Registry::forEach([&records](const ThreadRing &ring)
+    {
+        for (const Slot &slot : ring.slots)
+        {
+            const uint64_t sequence = slot.sequence.load(std::memory_order_acquire);
+            if ((sequence == 0) || (sequence & 1))
+            {
+                // Never written, or being written.
+                continue;
+            }
+
+            uint64_t words[kRecordWords];
+            for (unsigned word = 0; word < kRecordWords; ++word)
+            {
+                words[word] = slot.words[word].load(std::memory_order_relaxed);
+            }
+
+            // The words belong to a single record only if the sequence did not move.
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (slot.sequence.load(std::memory_order_relaxed) == sequence)
+            {
+                Record record;
+                std::memcpy(&record, words, sizeof(record));
+                records.push_back(record);
+            }
+        }
+    });
+
+    std::sort(records.begin(), records.end(), [](const Record &a, const Record &b) { return a.time < b.time; });
+    return records;
+}
@@ -0,0 +1,127 @@
+/* -*- c++ -*- */
+
+#ifndef HTTP_ACCEPT_TRACE_H
+#define HTTP_ACCEPT_TRACE_H
+
+#include <atomic>
+#include <cstdint>
+#include <vector>
+
+/**
+ * Trace of sampled negotiations, to find out why a client was served a given
+ * representation without logging every call.
+ *
+ * Tracing is disabled until setSamplePeriod() is called with a period N, then
+ * one negotiation out of N per thread is recorded with its inputs and its
+ * decision: the hash and the first bytes of the 'Accept' header, the
+ * fingerprint of the offers, the offers ranked by quality and the selected
+ * one.
+ *
+ * Every thread writes its records into its own ring of kCapacity records,
+ * overwriting the oldest. Every record is protected by a sequence counter,
+ * so dump() copies the rings while the threads keep writing, and skips the
+ * records that were being written. The records of the threads that have
+ * exited are dropped.
+ */
+class HttpAcceptTrace
+{
+public:
+
+    /**
+     * Records kept per thread.
+     */
+    static const unsigned kCapacity = 64;
+
+    /**
+     * Bytes of the 'Accept' header kept in a record.
+     */
+    static const unsigned kMaxHeaderBytes = 96;
+
+    /**
+     * Ranked offers kept in a record.
+     */
+    static const unsigned kMaxCandidates = 8;
+
+    /**
+     * @brief An offer and its quality against the header.
+     */
+    struct Candidate
+    {
+        int32_t index;      ///< Position of the offer in the list of available content types.
+        float   quality;    ///< Quality of the offer, 0 if it matches no range and negative if it is excluded by q=0.
+    };
+
+    /**
+     * @brief A traced negotiation.
+     */
+    struct Record
+    {
+        uint64_t  time;                          ///< Time of the negotiation, in nanoseconds of the steady clock.
+        uint64_t  headerHash;                    ///< HttpAcceptHash::hash() of the whole header.
+        uint64_t  offerSetId;                    ///< Fingerprint of the available content types.
+        uint32_t  headerLength;                  ///< Length of the whole header.
+        uint32_t  candidateCount;                ///< Number of valid candidates, up to kMaxCandidates.
+        int32_t   selected;                      ///< Position of the selected offer, or -1 if no offer is valid.
+        uint32_t  thread;                        ///< Number of the recording thread, in order of first record.
+        char      header[kMaxHeaderBytes];       ///< First bytes of the header, as received.
+        Candidate candidates[kMaxCandidates];    ///< Best ranked valid offers.
+    };
+
+    /**
+     * Sets the sampling period of every thread.
+     *
+     * @param[in] period one negotiation out of period is recorded, 0 disables tracing.
+     */
+    static void setSamplePeriod(unsigned period)
+    {
+        s_samplePeriod.store(period, std::memory_order_relaxed);
+    }
+
+    /**
+     * Returns the sampling period, 0 if tracing is disabled.
+     */
+    static unsigned samplePeriod()
+    {
+        return s_samplePeriod.load(std::memory_order_relaxed);
+    }
+
+    /**
+     * Decides whether the negotiation starting on the calling thread is recorded.
+     *
+     * @return True if the negotiation must be recorded.
+     */
+    static bool sample()
+    {
+        const unsigned period = samplePeriod();
+        return period && countdown(period);
+    }
+
+    /**
+     * Adds a record to the ring of the calling thread. The thread field is set.
+     *
+     * @param[in] record the record.
+     */
+    static void record(const Record &record);
+
+    /**
+     * Copies the records of every live thread, without blocking them.
+     *
+     * @return the records, oldest first.
+     */
+    static std::vector<Record> dump();
+
+private:
+
+    /**
+     * Constructor.
+     */
+    HttpAcceptTrace()
+    {
+    }
+
+    static bool countdown(unsigned period);
+
+    static std::atomic<unsigned> s_samplePeriod;
+};
+
+#endif // HTTP_ACCEPT_TRACE_H
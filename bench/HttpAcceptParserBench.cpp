@@ -0,0 +1,602 @@
+/* -*- c++ -*- */
+
+#include <chrono>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <new>
+#include <string>
+#include <vector>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+#include "../HttpAcceptCounters.h"
+#include "../HttpAcceptParser.h"
+#include "../HttpAcceptKernels.h"
+#include "../HttpAcceptLatency.h"
+
+// Measures HttpAcceptParser on a corpus of 'Accept' headers, one per line,
+// with every kernel level supported by the CPU. The split columns compare the
+// tokenization by repeated searches with the single segment scan, which runs
+// PCMPESTRI at the sse42 level and a comparison based classifier above it.
+// The negotiation, discard and fallback counters of a single pass over the
+// corpus are printed next.
+// When built with HTTP_ACCEPT_PARSER_INSTRUMENTATION, the time spent in every
+// stage by the sampled negotiations of the whole run follows. The latency
+// percentiles of the corpus negotiations, recorded by HttpAcceptLatency, end
+// the report.
+//
+// With --profile, the corpus is also sliced by header length, and every
+// slice reports, next to its ns/op, the heap allocations and bytes per call,
+// and the instructions, branch misses and L1 data cache misses per call read
+// with perf_event_open. The hardware counters are reported as unavailable
+// when the kernel or the container does not grant them. The allocations are
+// counted by replacing operator new, which is only compiled in with
+// HTTP_ACCEPT_BENCH_COUNT_ALLOCATIONS defined, so that the timings of the
+// default build use the allocator of the programs linking the library.
+//
+// The parse and select costs at the kernel level selected at startup
+// measure the build itself. With --save=file they are written to a file, and
+// with --baseline=file the speedup over the build that saved that file is
+// printed, which compares the optimization settings of the build presets.
+//
+// usage: HttpAcceptParserBench [corpus] [iterations] [--profile] [--save=file] [--baseline=file]
+
+namespace
+{
+    const char *const kDefaultCorpus = "bench/corpus.txt";
+    const unsigned kDefaultIterations = 20000;
+    const unsigned kRounds = 10;
+    const char *const kHeaderLengthLabels[HttpAcceptLatency::kHeaderLengthClasses] = { "0-31", "32-63", "64-127", "128-255", "256-511", "512+" };
+#ifdef HTTP_ACCEPT_PARSER_BUILD_NAME
+    const char *const kBuildName = HTTP_ACCEPT_PARSER_BUILD_NAME;
+#else
+    const char *const kBuildName = "default";
+#endif
+
+    // Prevents the compiler from discarding the benchmarked calls.
+    volatile size_t g_sink;
+
+#ifdef HTTP_ACCEPT_BENCH_COUNT_ALLOCATIONS
+    // Heap allocations since the start, counted by the replaced operator new.
+    // The benchmark is single threaded.
+    size_t g_allocations;
+    size_t g_allocatedBytes;
+#endif
+
+    bool loadCorpus(const char *path, std::vector<std::string> &corpus)
+    {
+        std::ifstream file(path);
+        std::string line;
+        while (std::getline(file, line))
+        {
+            corpus.push_back(line);
+        }
+        return !corpus.empty();
+    }
+
+    inline bool isWhitespace(const char c)
+    {
+        return (c == ' ') || (c == '\t') || (c == '\n') || (c == '\r') || (c == '\f') || (c == '\v');
+    }
+
+    void trim(const char *s, size_t &begin, size_t &end)
+    {
+        while ((begin < end) && isWhitespace(s[begin]))
+        {
+            ++begin;
+        }
+        while ((end > begin) && isWhitespace(s[end - 1]))
+        {
+            --end;
+        }
+    }
+
+    size_t find(const HttpAcceptKernels::Table &kernels, const char *s, size_t begin, size_t end, char c)
+    {
+        return begin + kernels.find(s + begin, end - begin, c);
+    }
+
+    // Splits a header the way the parser did before the segment scan: one
+    // search per delimiter, each followed by a trim.
+    size_t splitWithFind(const HttpAcceptKernels::Table &kernels, const std::string &acceptValue)
+    {
+        const char *s = acceptValue.data();
+        const size_t length = acceptValue.size();
+        size_t pieces = 0;
+        for (size_t position = 0; position < length; )
+        {
+            size_t begin = position;
+            size_t end = find(kernels, s, position, length, ',');
+            position = end + 1;
+            trim(s, begin, end);
+            for (size_t parameter = begin; parameter < end; )
+            {
+                size_t pieceBegin = parameter;
+                size_t pieceEnd = find(kernels, s, parameter, end, ';');
+                parameter = pieceEnd + 1;
+                trim(s, pieceBegin, pieceEnd);
+                const size_t separator = find(kernels, s, pieceBegin, pieceEnd, (pieceBegin == begin) ? '/' : '=');
+                size_t keyBegin = pieceBegin;
+                size_t keyEnd = separator;
+                trim(s, keyBegin, keyEnd);
+                pieces += keyEnd - keyBegin;
+            }
+        }
+        return pieces;
+    }
+
+    // Splits a header with the segment scan used by the parser. The header
+    // must be followed by HttpAcceptKernels::kPadding bytes.
+    size_t splitWithScan(const HttpAcceptKernels::Table &kernels, const char *s, size_t length)
+    {
+        size_t pieces = 0;
+        for (size_t position = 0; position < length; )
+        {
+            size_t begin;
+            size_t end;
+            position += kernels.scanSegment(s + position, length - position, begin, end) + 1;
+            pieces += end - begin;
+        }
+        return pieces;
+    }
+
+    template <typename F>
+    double measure(unsigned iterations, size_t operations, F f)
+    {
+        // The first pass warms up the caches and the scratch buffers. The
+        // best of several rounds filters out the noise of other processes.
+        f();
+        double best = 0;
+        for (unsigned round = 0; round < kRounds; ++round)
+        {
+            const auto start = std::chrono::steady_clock::now();
+            for (unsigned i = 0; i < iterations / kRounds + 1; ++i)
+            {
+                f();
+            }
+            const std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+            const double cost = elapsed.count() / (static_cast<double>(iterations / kRounds + 1) * operations);
+            best = ((round == 0) || (cost < best)) ? cost : best;
+        }
+        return best;
+    }
+
+    // Hardware counters of the calling thread, in user space, read with
+    // perf_event_open. Every event is opened on its own, so that the
+    // events supported by the CPU are reported even when others are not.
+    class HardwareCounters
+    {
+    public:
+
+        enum Event
+        {
+            kInstructions,
+            kBranchMisses,
+            kL1DataMisses,
+            kEventCount
+        };
+
+        HardwareCounters()
+            : m_error("not supported on this platform")
+        {
+#ifdef __linux__
+            const uint32_t types[kEventCount] = { PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HW_CACHE };
+            const uint64_t configs[kEventCount] = { PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_BRANCH_MISSES,
+                PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16) };
+            for (unsigned event = 0; event < kEventCount; ++event)
+            {
+                perf_event_attr attributes;
+                std::memset(&attributes, 0, sizeof(attributes));
+                attributes.size = sizeof(attributes);
+                attributes.type = types[event];
+                attributes.config = configs[event];
+                attributes.disabled = 1;
+                attributes.exclude_kernel = 1;
+                attributes.exclude_hv = 1;
+                attributes.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+                m_fds[event] = static_cast<int>(syscall(SYS_perf_event_open, &attributes, 0, -1, -1, 0));
+                if (m_fds[event] < 0)
+                {
+                    m_error = std::strerror(errno);
+                }
+            }
+#else
+            for (unsigned event = 0; event < kEventCount; ++event)
+            {
+                m_fds[event] = -1;
+            }
+#endif
+        }
+
+        ~HardwareCounters()
+        {
+#ifdef __linux__
+            for (const int fd : m_fds)
+            {
+                if (fd >= 0)
+                {
+                    close(fd);
+                }
+            }
+#endif
+        }
+
+        bool available(Event event) const
+        {
+            return m_fds[event] >= 0;
+        }
+
+        // Reason of the last event that could not be opened.
+        const char *error() const
+        {
+            return m_error;
+        }
+
+        void start()
+        {
+#ifdef __linux__
+            for (const int fd : m_fds)
+            {
+                if (fd >= 0)
+                {
+                    ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+                    ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+                }
+            }
+#endif
+        }
+
+        // Stops the counters and returns their values, scaled up when the
+        // kernel multiplexed them, or -1 for the unavailable events.
+        void stop(double values[kEventCount])
+        {
+            for (unsigned event = 0; event < kEventCount; ++event)
+            {
+                values[event] = -1;
+#ifdef __linux__
+                uint64_t data[3];
+                if ((m_fds[event] >= 0) && (ioctl(m_fds[event], PERF_EVENT_IOC_DISABLE, 0) == 0) &&
+                    (read(m_fds[event], data, sizeof(data)) == static_cast<ssize_t>(sizeof(data))) && data[2])
+                {
+                    values[event] = static_cast<double>(data[0]) * (static_cast<double>(data[1]) / static_cast<double>(data[2]));
+                }
+#endif
+            }
+        }
+
+    private:
+
+        HardwareCounters(const HardwareCounters &);
+        HardwareCounters &operator=(const HardwareCounters &);
+
+        int         m_fds[kEventCount];
+        const char *m_error;
+    };
+
+    void printPerCall(double value, size_t calls)
+    {
+        if (value < 0)
+        {
+            std::printf(" %12s", "n/a");
+        }
+        else
+        {
+            std::printf(" %12.1f", value / calls);
+        }
+    }
+
+    // Measures a negotiation on a slice of the corpus, then counts the
+    // allocations and the hardware events of the same number of passes.
+    template <typename F>
+    void profile(const char *slice, const char *api, size_t headers, unsigned iterations, HardwareCounters &counters, F f)
+    {
+        const double cost = measure(iterations, headers, f);
+        const unsigned passes = iterations / kRounds + 1;
+        double events[HardwareCounters::kEventCount];
+#ifdef HTTP_ACCEPT_BENCH_COUNT_ALLOCATIONS
+        const size_t allocations = g_allocations;
+        const size_t allocatedBytes = g_allocatedBytes;
+#endif
+        counters.start();
+        for (unsigned i = 0; i < passes; ++i)
+        {
+            f();
+        }
+        counters.stop(events);
+        const size_t calls = static_cast<size_t>(passes) * headers;
+        std::printf("%-8s %-7s %8zu %12.1f", slice, api, headers, cost);
+#ifdef HTTP_ACCEPT_BENCH_COUNT_ALLOCATIONS
+        std::printf(" %12.3f %12.1f", static_cast<double>(g_allocations - allocations) / calls, static_cast<double>(g_allocatedBytes - allocatedBytes) / calls);
+#else
+        std::printf(" %12s %12s", "n/a", "n/a");
+#endif
+        for (const double value : events)
+        {
+            printPerCall(value, calls);
+        }
+        std::printf("\n");
+    }
+
+    // Prints the costs of the build, and its speedup over the build whose
+    // costs were saved in the baseline file. Saves the costs if asked.
+    void reportBuild(double parseCost, double selectCost, const char *savePath, const char *baselinePath)
+    {
+        std::printf("build %s: parse %.1f ns/op, select %.1f ns/op\n", kBuildName, parseCost, selectCost);
+        if (baselinePath)
+        {
+            std::ifstream file(baselinePath);
+            std::string baselineName;
+            double baselineParseCost = 0;
+            double baselineSelectCost = 0;
+            if ((file >> baselineName >> baselineParseCost >> baselineSelectCost) && (parseCost > 0) && (selectCost > 0))
+            {
+                std::printf("speedup over %s: parse %.2fx, select %.2fx\n", baselineName.c_str(), baselineParseCost / parseCost, baselineSelectCost / selectCost);
+            }
+            else
+            {
+                std::printf("no baseline in '%s'\n", baselinePath);
+            }
+        }
+        if (savePath)
+        {
+            std::ofstream file(savePath, std::ios::trunc);
+            if (!(file << kBuildName << ' ' << parseCost << ' ' << selectCost << '\n'))
+            {
+                std::fprintf(stderr, "cannot write '%s'\n", savePath);
+            }
+        }
+    }
+}
+
+#ifdef HTTP_ACCEPT_BENCH_COUNT_ALLOCATIONS
+// Counts every heap allocation of the process. The array and nothrow forms
+// forward to these by default.
+void *operator new(size_t size)
+{
+    ++g_allocations;
+    g_allocatedBytes += size;
+    void *memory = std::malloc(size ? size : 1);
+    if (!memory)
+    {
+        throw std::bad_alloc();
+    }
+    return memory;
+}
+
+void operator delete(void *memory) noexcept
+{
+    std::free(memory);
+}
+
+#ifdef __cpp_sized_deallocation
+void operator delete(void *memory, size_t) noexcept
+{
+    std::free(memory);
+}
+#endif
+#endif
+
+int main(int argc, char **argv)
+{
+    bool profiling = false;
+    const char *savePath = nullptr;
+    const char *baselinePath = nullptr;
+    std::vector<const char *> arguments;
+    for (int i = 1; i < argc; ++i)
+    {
+        if (std::strcmp(argv[i], "--profile") == 0)
+        {
+            profiling = true;
+        }
+        else if (std::strncmp(argv[i], "--save=", 7) == 0)
+        {
+            savePath = argv[i] + 7;
+        }
+        else if (std::strncmp(argv[i], "--baseline=", 11) == 0)
+        {
+            baselinePath = argv[i] + 11;
+        }
+        else
+        {
+            arguments.push_back(argv[i]);
+        }
+    }
+    const char *path = (arguments.size() > 0) ? arguments[0] : kDefaultCorpus;
+    const unsigned iterations = (arguments.size() > 1) ? static_cast<unsigned>(std::strtoul(arguments[1], nullptr, 10)) : kDefaultIterations;
+
+    std::vector<std::string> corpus;
+    if (!loadCorpus(path, corpus))
+    {
+        std::fprintf(stderr, "cannot read the corpus '%s'\n", path);
+        return 1;
+    }
+
+    const std::vector<std::string> offers = { "text/html", "application/xhtml+xml", "application/json", "image/webp", "image/png", "text/plain" };
+    size_t bytes = 0;
+    std::vector<std::string> padded;
+    for (const auto &acceptValue : corpus)
+    {
+        bytes += acceptValue.size();
+        padded.push_back(acceptValue + std::string(HttpAcceptKernels::kPadding, '\0'));
+    }
+    std::vector<char> lowered(bytes);
+
+    std::printf("corpus: %s (%zu headers, %zu bytes), %u iterations\n", path, corpus.size(), bytes, iterations);
+    std::printf("%-8s %12s %12s %12s %12s\n", "level", "parse ns/op", "lower ns/B", "find ns/B", "scan ns/B");
+
+#ifdef HTTP_ACCEPT_PARSER_INSTRUMENTATION
+    const HttpAcceptCounters::Stats initial = HttpAcceptCounters::getStats();
+#endif
+    const HttpAcceptKernels::Level initialLevel = HttpAcceptKernels::level();
+    for (int level = HttpAcceptKernels::kScalar; level <= HttpAcceptKernels::supportedLevel(); ++level)
+    {
+        HttpAcceptKernels::setLevel(static_cast<HttpAcceptKernels::Level>(level));
+
+        const double parseCost = measure(iterations, corpus.size(), [&]()
+        {
+            for (const auto &acceptValue : corpus)
+            {
+                g_sink = g_sink + HttpAcceptParser::parse(acceptValue, offers).size();
+            }
+        });
+
+        const double lowerCost = measure(iterations, bytes, [&]()
+        {
+            const HttpAcceptKernels::Table &kernels = HttpAcceptKernels::table();
+            char *dst = lowered.data();
+            for (const auto &acceptValue : corpus)
+            {
+                kernels.lower(dst, acceptValue.data(), acceptValue.size());
+                dst += acceptValue.size();
+            }
+            g_sink = g_sink + static_cast<unsigned char>(lowered[0]);
+        });
+
+        const double findCost = measure(iterations, bytes, [&]()
+        {
+            const HttpAcceptKernels::Table &kernels = HttpAcceptKernels::table();
+            for (const auto &acceptValue : corpus)
+            {
+                g_sink = g_sink + splitWithFind(kernels, acceptValue);
+            }
+        });
+
+        const double scanCost = measure(iterations, bytes, [&]()
+        {
+            const HttpAcceptKernels::Table &kernels = HttpAcceptKernels::table();
+            for (size_t i = 0; i < corpus.size(); ++i)
+            {
+                g_sink = g_sink + splitWithScan(kernels, padded[i].data(), corpus[i].size());
+            }
+        });
+
+        std::printf("%-8s %12.1f %12.3f %12.3f %12.3f\n", HttpAcceptKernels::name(static_cast<HttpAcceptKernels::Level>(level)),
+            parseCost, lowerCost, findCost, scanCost);
+    }
+    HttpAcceptKernels::setLevel(initialLevel);
+
+    const HttpAcceptParser::OfferSet buildOfferSet(offers);
+    const double buildParseCost = measure(iterations, corpus.size(), [&]()
+    {
+        for (const auto &acceptValue : corpus)
+        {
+            g_sink = g_sink + HttpAcceptParser::parse(acceptValue, offers).size();
+        }
+    });
+    const double buildSelectCost = measure(iterations, corpus.size(), [&]()
+    {
+        for (const auto &acceptValue : corpus)
+        {
+            g_sink = g_sink + HttpAcceptParser::select(acceptValue, buildOfferSet);
+        }
+    });
+    reportBuild(buildParseCost, buildSelectCost, savePath, baselinePath);
+
+    if (profiling)
+    {
+        // The slices of the corpus, by class of header length, and the whole corpus last.
+        std::vector<std::vector<std::string>> slices(HttpAcceptLatency::kHeaderLengthClasses + 1);
+        for (const auto &acceptValue : corpus)
+        {
+            slices[HttpAcceptLatency::histogramIndex(acceptValue.size(), 0) / HttpAcceptLatency::kOfferCountClasses].push_back(acceptValue);
+        }
+        slices.back() = corpus;
+
+        HardwareCounters counters;
+        if (!counters.available(HardwareCounters::kInstructions))
+        {
+            std::printf("hardware counters unavailable: %s\n", counters.error());
+        }
+        const HttpAcceptParser::OfferSet offerSet(offers);
+        std::printf("%-8s %-7s %8s %12s %12s %12s %12s %12s %12s\n", "slice", "api", "headers", "ns/op", "allocs/op", "bytes/op", "instr/op", "br-miss/op", "L1d-miss/op");
+        for (size_t i = 0; i < slices.size(); ++i)
+        {
+            const std::vector<std::string> &slice = slices[i];
+            if (slice.empty())
+            {
+                continue;
+            }
+            const char *label = (i < HttpAcceptLatency::kHeaderLengthClasses) ? kHeaderLengthLabels[i] : "all";
+            profile(label, "parse", slice.size(), iterations, counters, [&]()
+            {
+                for (const auto &acceptValue : slice)
+                {
+                    g_sink = g_sink + HttpAcceptParser::parse(acceptValue, offers).size();
+                }
+            });
+            profile(label, "select", slice.size(), iterations, counters, [&]()
+            {
+                for (const auto &acceptValue : slice)
+                {
+                    g_sink = g_sink + HttpAcceptParser::select(acceptValue, offerSet);
+                }
+            });
+        }
+    }
+
+    const HttpAcceptCounters::Stats before = HttpAcceptCounters::getStats();
+    for (const auto &acceptValue : corpus)
+    {
+        g_sink = g_sink + HttpAcceptParser::parse(acceptValue, offers).size();
+    }
+    const HttpAcceptCounters::Stats after = HttpAcceptCounters::getStats();
+    const uint64_t negotiations = after.negotiations - before.negotiations;
+    const uint64_t earlyExits = after.earlyExits - before.earlyExits;
+    std::printf("negotiations: %llu, early exits: %llu (%.1f%%), scored offers: %llu, skipped offers: %llu\n",
+        static_cast<unsigned long long>(negotiations), static_cast<unsigned long long>(earlyExits),
+        negotiations ? 100.0 * earlyExits / negotiations : 0.0,
+        static_cast<unsigned long long>(after.scoredOffers - before.scoredOffers),
+        static_cast<unsigned long long>(after.skippedOffers - before.skippedOffers));
+    std::printf("discarded ranges: %llu malformed, %llu wildcard misuse, %llu missing '=', %llu invalid q; %llu clamped q, %llu q=0\n",
+        static_cast<unsigned long long>(after.malformedRanges - before.malformedRanges),
+        static_cast<unsigned long long>(after.wildcardMisuse - before.wildcardMisuse),
+        static_cast<unsigned long long>(after.missingEquals - before.missingEquals),
+        static_cast<unsigned long long>(after.invalidQualityValues - before.invalidQualityValues),
+        static_cast<unsigned long long>(after.clampedQualityValues - before.clampedQualityValues),
+        static_cast<unsigned long long>(after.zeroQualityRanges - before.zeroQualityRanges));
+    std::printf("fallbacks: %llu empty header, %llu no acceptable offer, %llu no valid offer\n",
+        static_cast<unsigned long long>(after.emptyHeaderFallbacks - before.emptyHeaderFallbacks),
+        static_cast<unsigned long long>(after.unacceptableFallbacks - before.unacceptableFallbacks),
+        static_cast<unsigned long long>(after.invalidOfferFallbacks - before.invalidOfferFallbacks));
+
+#ifdef HTTP_ACCEPT_PARSER_INSTRUMENTATION
+    static const char *const kStageNames[HttpAcceptCounters::kStageCount] = { "tokenize", "rank ranges", "normalize offers", "match", "rank offers" };
+    std::printf("%-16s %12s %14s\n", "stage", "samples", "ticks/sample");
+    for (unsigned stage = 0; stage < HttpAcceptCounters::kStageCount; ++stage)
+    {
+        const uint64_t samples = after.stages[stage].samples - initial.stages[stage].samples;
+        const uint64_t ticks = after.stages[stage].ticks - initial.stages[stage].ticks;
+        std::printf("%-16s %12llu %14.1f\n", kStageNames[stage], static_cast<unsigned long long>(samples), samples ? static_cast<double>(ticks) / samples : 0.0);
+    }
+#endif
+
+    HttpAcceptLatency::setEnabled(true);
+    for (unsigned i = 0; i < iterations; ++i)
+    {
+        for (const auto &acceptValue : corpus)
+        {
+            g_sink = g_sink + HttpAcceptParser::parse(acceptValue, offers).size();
+        }
+    }
+    HttpAcceptLatency::setEnabled(false);
+    const std::vector<HttpAcceptLatency::Histogram> histograms = HttpAcceptLatency::getHistograms();
+    std::printf("%-12s %12s %12s %12s %12s\n", "header bytes", "negotiations", "p50 ns", "p99 ns", "p999 ns");
+    for (size_t i = 0; i < histograms.size(); ++i)
+    {
+        const HttpAcceptLatency::Histogram &histogram = histograms[i];
+        if (histogram.count)
+        {
+            std::printf("%-12s %12llu %12llu %12llu %12llu\n", kHeaderLengthLabels[i / HttpAcceptLatency::kOfferCountClasses],
+                static_cast<unsigned long long>(histogram.count), static_cast<unsigned long long>(histogram.valueAtQuantile(0.5)),
+                static_cast<unsigned long long>(histogram.valueAtQuantile(0.99)), static_cast<unsigned long long>(histogram.valueAtQuantile(0.999)));
+        }
+    }
+
+    return 0;
+}
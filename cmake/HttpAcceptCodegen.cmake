@@ -0,0 +1,55 @@
+# http_accept_parser_add_negotiator(<target>
+#     NAME <class name>
+#     CORPUS <files of 'Accept' headers, one per line>...
+#     OFFERS <available content types, by preference>...
+#     [HOT <count>] [NEAR_HOT <count>]
+#     [MATCH_PARAMETERS] [MATCH_SUFFIXES])
+#
+# Adds a static library holding the negotiator generated by HttpAcceptCodegen
+# from a sample of the traffic of a service. The negotiator is generated again
+# when the corpus or the generator change, so that its answers always match
+# the library it is linked with.
+function(http_accept_parser_add_negotiator target)
+    cmake_parse_arguments(ARG "MATCH_PARAMETERS;MATCH_SUFFIXES" "NAME;HOT;NEAR_HOT" "CORPUS;OFFERS" ${ARGN})
+    if (NOT ARG_NAME OR NOT ARG_CORPUS OR NOT ARG_OFFERS)
+        message(FATAL_ERROR "http_accept_parser_add_negotiator: NAME, CORPUS and OFFERS are required")
+    endif()
+    if (TARGET HttpAcceptCodegen)
+        set(codegen HttpAcceptCodegen)
+        set(library HttpAcceptParser)
+    else()
+        set(codegen HttpAcceptParser::HttpAcceptCodegen)
+        set(library HttpAcceptParser::HttpAcceptParser)
+    endif()
+
+    list(JOIN ARG_OFFERS "," offers)
+    set(arguments "--offers=${offers}" "--name=${ARG_NAME}")
+    if (ARG_HOT)
+        list(APPEND arguments "--hot=${ARG_HOT}")
+    endif()
+    if (ARG_NEAR_HOT)
+        list(APPEND arguments "--near-hot=${ARG_NEAR_HOT}")
+    endif()
+    if (ARG_MATCH_PARAMETERS)
+        list(APPEND arguments --match-parameters)
+    endif()
+    if (ARG_MATCH_SUFFIXES)
+        list(APPEND arguments --match-suffixes)
+    endif()
+    set(corpus)
+    foreach (file IN LISTS ARG_CORPUS)
+        get_filename_component(file "${file}" ABSOLUTE)
+        list(APPEND corpus "${file}")
+    endforeach()
+
+    set(directory "${CMAKE_CURRENT_BINARY_DIR}/${target}")
+    add_custom_command(OUTPUT "${directory}/${ARG_NAME}.h" "${directory}/${ARG_NAME}.cpp"
+        COMMAND "${CMAKE_COMMAND}" -E make_directory "${directory}"
+        COMMAND ${codegen} ${arguments} "--output=${directory}" ${corpus}
+        DEPENDS ${codegen} ${corpus}
+        COMMENT "Generating the negotiator ${ARG_NAME}"
+        VERBATIM)
+    add_library(${target} STATIC "${directory}/${ARG_NAME}.cpp" "${directory}/${ARG_NAME}.h")
+    target_include_directories(${target} PUBLIC "${directory}")
+    target_link_libraries(${target} PUBLIC ${library})
+endfunction()
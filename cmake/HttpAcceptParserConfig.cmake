@@ -0,0 +1,7 @@
+include(CMakeFindDependencyMacro)
+find_dependency(Threads)
+
+include("${CMAKE_CURRENT_LIST_DIR}/HttpAcceptParserTargets.cmake")
+if (TARGET HttpAcceptParser::HttpAcceptCodegen)
+    include("${CMAKE_CURRENT_LIST_DIR}/HttpAcceptCodegen.cmake")
+endif()
@@ -0,0 +1,294 @@
+/* -*- c++ -*- */
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <string>
+#include <vector>
+#include "../HttpAcceptInstrumentation.h"
+#include "../HttpAcceptParser.h"
+#include "../HttpAcceptReference.h"
+
+#ifndef HTTP_ACCEPT_PARSER_COUNT_OPERATIONS
+#error "the fuzzer must be built with HTTP_ACCEPT_PARSER_COUNT_OPERATIONS defined"
+#endif
+
+// Fuzz target of HttpAcceptParser. The first line of an input is the
+// 'Accept' header, and the following lines are the offers; inputs of a
+// single line are negotiated against a fixed list of offers. Every input is
+// negotiated with a list of offers, with an offer set and with an offer set
+// matching parameters and suffixes, and short inputs are checked against
+// HttpAcceptReference.
+//
+// Beyond crashes and mismatches, the target bounds the work per input byte,
+// to keep algorithmic complexity regressions out. The operations counted by
+// the library and the time of the costliest negotiation are divided by the
+// length of the input, at least kMinBudgetBytes, and the maximums are
+// reported with the throughput. An input that exceeds the budget is appended
+// to a file of slow inputs, and the target aborts. The file is kept apart
+// from bench/corpus.txt, which the tests, the generated negotiator and the
+// PGO training read: merge the inputs into it by hand once the parser is
+// fixed, so that they keep being measured. Inputs that need their offers
+// go to fuzz/corpus instead, one file each, which the tests replay.
+//
+// Environment:
+//   HTTP_ACCEPT_FUZZ_OPS_PER_BYTE  operations per byte allowed (default 64, 0 disables)
+//   HTTP_ACCEPT_FUZZ_NS_PER_BYTE   nanoseconds per byte allowed (default 0, disabled,
+//                                  since the time depends on the machine)
+//   HTTP_ACCEPT_FUZZ_SLOW_INPUTS   file receiving the slow headers (default fuzz/slow-inputs.txt)
+//
+// Build with libFuzzer:
+//   clang++ -std=c++11 -g -O1 -fsanitize=fuzzer,address -DHTTP_ACCEPT_PARSER_COUNT_OPERATIONS fuzz/HttpAcceptParserFuzzer.cpp *.cpp
+// or without it, with HTTP_ACCEPT_FUZZ_STANDALONE defined for the main() below:
+//   usage: HttpAcceptParserFuzzer [-runs=N] [-seed=N] [input files...]
+
+namespace
+{
+    const size_t kMinBudgetBytes = 64;
+    const size_t kMaxReferenceBytes = 4096;
+
+    struct Budget
+    {
+        double      operationsPerByte;
+        double      nanosecondsPerByte;
+        std::string slowInputs;
+    };
+
+    const Budget &budget()
+    {
+        static const Budget instance = []()
+        {
+            const char *operations = std::getenv("HTTP_ACCEPT_FUZZ_OPS_PER_BYTE");
+            const char *nanoseconds = std::getenv("HTTP_ACCEPT_FUZZ_NS_PER_BYTE");
+            const char *slowInputs = std::getenv("HTTP_ACCEPT_FUZZ_SLOW_INPUTS");
+            return Budget{operations ? std::atof(operations) : 64.0, nanoseconds ? std::atof(nanoseconds) : 0.0,
+                slowInputs ? slowInputs : "fuzz/slow-inputs.txt"};
+        }();
+        return instance;
+    }
+
+    // Maximums and totals over the inputs of the run.
+    double g_maxOperationsPerByte;
+    double g_maxNanosecondsPerByte;
+    double g_totalBytes;
+    double g_totalNanoseconds;
+
+    void split(const uint8_t *data, size_t size, std::string &acceptValue, std::vector<std::string> &offers)
+    {
+        const std::string input(reinterpret_cast<const char *>(data), size);
+        size_t end = input.find('\n');
+        acceptValue = input.substr(0, end);
+        while (end != std::string::npos)
+        {
+            const size_t begin = end + 1;
+            end = input.find('\n', begin);
+            offers.push_back(input.substr(begin, (end == std::string::npos) ? std::string::npos : end - begin));
+        }
+        if (offers.empty())
+        {
+            offers = { "text/html", "application/xhtml+xml", "application/json;charset=utf-8", "image/webp", "application/problem+json", "*/*" };
+        }
+    }
+
+    void saveSlowInput(const std::string &acceptValue)
+    {
+        std::ofstream file(budget().slowInputs.c_str(), std::ios::binary | std::ios::app);
+        file << acceptValue << '\n';
+    }
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    std::string acceptValue;
+    std::vector<std::string> offers;
+    split(data, size, acceptValue, offers);
+    const HttpAcceptParser::OfferSet offerSet(offers);
+    const HttpAcceptParser::OfferSet matchingOfferSet(offers, 0, HttpAcceptParser::OfferSet::kMatchParameters | HttpAcceptParser::OfferSet::kMatchSuffixes);
+
+    // The offer sets are built outside of the measure, as a server builds them
+    // once, and the budget applies to the costliest of the negotiations.
+    uint64_t measuredOperations = 0;
+    double measuredNanoseconds = 0;
+    std::string selected;
+    std::string selectedFromSet;
+    int selectedWithMatching = -1;
+    for (int engine = 0; engine < 3; ++engine)
+    {
+        uint64_t &operations = HttpAcceptOperations::count();
+        operations = 0;
+        const auto start = std::chrono::steady_clock::now();
+        switch (engine)
+        {
+        case 0:
+            selected = HttpAcceptParser::parse(acceptValue, offers);
+            break;
+        case 1:
+            selectedFromSet = HttpAcceptParser::parse(acceptValue, offerSet);
+            break;
+        default:
+            selectedWithMatching = HttpAcceptParser::select(acceptValue, matchingOfferSet);
+            break;
+        }
+        const std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+        measuredOperations = (operations > measuredOperations) ? operations : measuredOperations;
+        measuredNanoseconds = (elapsed.count() > measuredNanoseconds) ? elapsed.count() : measuredNanoseconds;
+        g_totalNanoseconds += elapsed.count();
+    }
+    g_totalBytes += 3.0 * static_cast<double>(acceptValue.size());
+
+    if ((selected != selectedFromSet) || (selectedWithMatching >= static_cast<int>(offers.size())) || (!offers.empty() && (selectedWithMatching < 0)))
+    {
+        std::fprintf(stderr, "inconsistent engines: \"%s\" and \"%s\", %d\n", selected.c_str(), selectedFromSet.c_str(), selectedWithMatching);
+        std::abort();
+    }
+    if ((size <= kMaxReferenceBytes) && (HttpAcceptReference::parse(acceptValue, offers) != selected))
+    {
+        std::fprintf(stderr, "mismatch with the reference: selected \"%s\"\n", selected.c_str());
+        std::abort();
+    }
+
+    const double bytes = static_cast<double>((size > kMinBudgetBytes) ? size : kMinBudgetBytes);
+    const double operationsPerByte = static_cast<double>(measuredOperations) / bytes;
+    const double nanosecondsPerByte = measuredNanoseconds / bytes;
+    if (operationsPerByte > g_maxOperationsPerByte)
+    {
+        g_maxOperationsPerByte = operationsPerByte;
+        std::fprintf(stderr, "max ops/byte: %.2f (%llu operations, %zu bytes)\n", operationsPerByte, static_cast<unsigned long long>(measuredOperations), size);
+    }
+    if (nanosecondsPerByte > g_maxNanosecondsPerByte)
+    {
+        g_maxNanosecondsPerByte = nanosecondsPerByte;
+        std::fprintf(stderr, "max ns/byte: %.2f (%.0f ns, %zu bytes)\n", nanosecondsPerByte, measuredNanoseconds, size);
+    }
+
+    const Budget &limits = budget();
+    if (((limits.operationsPerByte > 0) && (operationsPerByte > limits.operationsPerByte)) ||
+        ((limits.nanosecondsPerByte > 0) && (nanosecondsPerByte > limits.nanosecondsPerByte)))
+    {
+        std::fprintf(stderr, "budget exceeded: %.2f ops/byte, %.2f ns/byte; header saved to %s\n", operationsPerByte, nanosecondsPerByte, limits.slowInputs.c_str());
+        saveSlowInput(acceptValue);
+        std::abort();
+    }
+    return 0;
+}
+
+#ifdef HTTP_ACCEPT_FUZZ_STANDALONE
+
+#include <cstring>
+#include <random>
+#include <dirent.h>
+
+// Replays the input files, then mutates them for the requested number of
+// runs, for the machines without libFuzzer. Without input files, the
+// headers of the benchmark corpus are the seeds.
+namespace
+{
+    void loadInputs(const std::string &path, std::vector<std::string> &inputs)
+    {
+        if (DIR *directory = opendir(path.c_str()))
+        {
+            while (const dirent *entry = readdir(directory))
+            {
+                if (entry->d_name[0] != '.')
+                {
+                    loadInputs(path + "/" + entry->d_name, inputs);
+                }
+            }
+            closedir(directory);
+            return;
+        }
+        std::ifstream file(path.c_str(), std::ios::binary);
+        inputs.push_back(std::string(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>()));
+    }
+
+    // Mutations biased towards the grammar, and towards repetition, which
+    // exposes the superlinear paths.
+    std::string mutate(const std::vector<std::string> &inputs, std::mt19937 &random)
+    {
+        static const char kAlphabet[] = " \t\n,;=/\"*+qQ.0159ax";
+        std::string input = inputs[random() % inputs.size()];
+        for (unsigned mutations = 1 + random() % 4; mutations > 0; --mutations)
+        {
+            // The chunks past the end of the input are truncated by erase() and substr().
+            const size_t position = random() % (input.size() + 1);
+            const size_t length = 1 + random() % 32;
+            switch (random() % 5)
+            {
+            case 0:
+                input.insert(position, 1, kAlphabet[random() % (sizeof(kAlphabet) - 1)]);
+                break;
+            case 1:
+                input.erase(position, length);
+                break;
+            case 2:
+                for (unsigned copies = 1 + random() % 64; (copies > 0) && (input.size() < 65536); --copies)
+                {
+                    input.insert(position, input.substr(position, length));
+                }
+                break;
+            case 3:
+                input.insert(position, inputs[random() % inputs.size()]);
+                break;
+            default:
+                if (position < input.size())
+                {
+                    input[position] = kAlphabet[random() % (sizeof(kAlphabet) - 1)];
+                }
+                break;
+            }
+        }
+        return input;
+    }
+}
+
+int main(int argc, char **argv)
+{
+    unsigned long runs = 0;
+    unsigned long seed = 1;
+    std::vector<std::string> inputs;
+    for (int i = 1; i < argc; ++i)
+    {
+        if (std::strncmp(argv[i], "-runs=", 6) == 0)
+        {
+            runs = std::strtoul(argv[i] + 6, nullptr, 10);
+        }
+        else if (std::strncmp(argv[i], "-seed=", 6) == 0)
+        {
+            seed = std::strtoul(argv[i] + 6, nullptr, 10);
+        }
+        else
+        {
+            loadInputs(argv[i], inputs);
+        }
+    }
+    if (inputs.empty())
+    {
+        std::ifstream file("bench/corpus.txt");
+        for (std::string line; std::getline(file, line); )
+        {
+            inputs.push_back(line);
+        }
+    }
+    if (inputs.empty())
+    {
+        inputs.push_back(std::string());
+    }
+
+    for (const auto &input : inputs)
+    {
+        LLVMFuzzerTestOneInput(reinterpret_cast<const uint8_t *>(input.data()), input.size());
+    }
+    std::mt19937 random(static_cast<std::mt19937::result_type>(seed));
+    for (unsigned long run = 0; run < runs; ++run)
+    {
+        const std::string input = mutate(inputs, random);
+        LLVMFuzzerTestOneInput(reinterpret_cast<const uint8_t *>(input.data()), input.size());
+    }
+    std::printf("%zu inputs and %lu runs: %.1f MB/s of headers, max %.2f ops/byte, max %.2f ns/byte\n", inputs.size(), runs,
+        (g_totalNanoseconds > 0) ? g_totalBytes * 1e3 / g_totalNanoseconds : 0.0, g_maxOperationsPerByte, g_maxNanosecondsPerByte);
+    return 0;
+}
+
+#endif // HTTP_ACCEPT_FUZZ_STANDALONE
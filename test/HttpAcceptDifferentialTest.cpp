@@ -0,0 +1,339 @@
+/* -*- c++ -*- */
+
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <random>
+#include <string>
+#include <vector>
+#include "../HttpAcceptCounters.h"
+#include "../HttpAcceptParser.h"
+#include "../HttpAcceptReference.h"
+
+// Compares HttpAcceptParser with HttpAcceptReference, the original
+// implementation, on generated inputs and on the headers of a corpus, with
+// a list of offers and with an offer set. The generator favors the corners
+// of the grammar: whitespace, empty ranges and parameters, wildcards, case,
+// and quality values that are malformed, out of range or need rounding.
+//
+// Every mismatch is minimized, by removing offers and then pieces of the
+// header for as long as the engines still disagree, and printed. The last
+// pass runs the optimized engine in shadow mode, verifying every call
+// against the reference. The exit status is 1 if any mismatch was found.
+//
+// usage: HttpAcceptDifferentialTest [corpus] [iterations] [seed]
+
+namespace
+{
+    const char *const kDefaultCorpus = "bench/corpus.txt";
+    const unsigned kDefaultIterations = 200000;
+    const unsigned kMaxReportedMismatches = 10;
+
+    const char *const kTypes[] = { "text", "TEXT", "image", "application", "*", "", "te=xt", "a/b" };
+    const char *const kSubtypes[] = { "html", "HTML", "*", "png", "json", "", "x/y", "vnd.a+json", "webp" };
+    const char *const kQualityValues[] = { "1", "0", "0.5", "0.50", ".5", "5.", "0.001", "0.0001", "1.0", "0.9", "0.333", "nan", "inf", "abc",
+        "", "0.5x", "-0", "1e-5", "0x1p-1", "2", " 0.7 ", "0.1234567", "0.12345678", "1e999", "-0.5", "NaN", "0.8" };
+    const char *const kParameters[] = { "level=1", "charset=UTF-8", "=5", "version=2", "foo", "" };
+    const char *const kSpaces[] = { "", "", "", " ", "\t", "  ", "\r\n" };
+    const char *const kOffers[] = { "text/html", "TEXT/HTML", " text/plain ", "image/png", "image/webp", "application/json", "*/*", "text/*",
+        "invalid", "/", "", "*/x", "application/vnd.a+json", "image/avif", "application/xhtml+xml" };
+
+    struct Case
+    {
+        std::string              acceptValue;
+        std::vector<std::string> offers;
+    };
+
+    class Generator
+    {
+    public:
+
+        explicit Generator(unsigned seed)
+            : m_random(seed)
+        {
+        }
+
+        std::string header()
+        {
+            std::string header;
+            if (below(8) == 0)
+            {
+                // Noise made of the characters of the grammar.
+                static const char kAlphabet[] = " \t,;=/qQ*ax.0159";
+                for (size_t i = below(40); i > 0; --i)
+                {
+                    header += kAlphabet[below(sizeof(kAlphabet) - 1)];
+                }
+                return header;
+            }
+
+            const size_t ranges = (below(10) == 0) ? below(40) : below(8);
+            for (size_t i = 0; i < ranges; ++i)
+            {
+                header += (i ? "," : "") + range();
+            }
+            if (below(10) == 0)
+            {
+                header += ",";
+            }
+            return header;
+        }
+
+        std::vector<std::string> offers()
+        {
+            std::vector<std::string> offers;
+            for (size_t i = (below(10) == 0) ? below(30) : below(6); i > 0; --i)
+            {
+                offers.push_back(pick(kOffers));
+            }
+            return offers;
+        }
+
+    private:
+
+        size_t below(size_t n)
+        {
+            return std::uniform_int_distribution<size_t>(0, n - 1)(m_random);
+        }
+
+        template <size_t N>
+        const char *pick(const char *const (&values)[N])
+        {
+            return values[below(N)];
+        }
+
+        std::string range()
+        {
+            std::string range = pick(kSpaces);
+            switch (below(20))
+            {
+            case 0:
+                return range;
+            case 1:
+                return range + "text";
+            default:
+                break;
+            }
+
+            range = range + pick(kTypes) + "/" + pick(kSubtypes) + pick(kSpaces);
+            for (size_t i = below(4); i > 0; --i)
+            {
+                range = range + ";" + pick(kSpaces);
+                switch (below(3))
+                {
+                case 0:
+                    range = range + ((below(3) == 0) ? "Q" : "q") + pick(kSpaces) + "=" + pick(kQualityValues);
+                    break;
+                case 1:
+                    range += "q=" + digits();
+                    break;
+                default:
+                    range += pick(kParameters);
+                    break;
+                }
+                range += pick(kSpaces);
+            }
+            if (below(10) == 0)
+            {
+                range += ";";
+            }
+            return range;
+        }
+
+        // Random digits with an optional decimal point, to exercise the
+        // rounding of the quality values.
+        std::string digits()
+        {
+            std::string digits;
+            const size_t length = below(10);
+            const size_t point = below(length + 2);
+            for (size_t i = 0; i < length; ++i)
+            {
+                if (i + 1 == point)
+                {
+                    digits += '.';
+                }
+                digits += static_cast<char>('0' + below(10));
+            }
+            return digits;
+        }
+
+        std::mt19937 m_random;
+    };
+
+    // Returns the first engine that disagrees with the reference, or nullptr.
+    const char *disagreement(const Case &c, std::string &expected, std::string &actual)
+    {
+        expected = HttpAcceptReference::parse(c.acceptValue, c.offers);
+        actual = HttpAcceptParser::parse(c.acceptValue, c.offers);
+        if (actual != expected)
+        {
+            return "list of offers";
+        }
+        actual = HttpAcceptParser::parse(c.acceptValue, HttpAcceptParser::OfferSet(c.offers));
+        if (actual != expected)
+        {
+            return "offer set";
+        }
+        return nullptr;
+    }
+
+    // Removes offers, then pieces of the header, halving the pieces down to
+    // single characters, as long as the engines still disagree.
+    Case minimize(Case c)
+    {
+        std::string expected;
+        std::string actual;
+        for (size_t i = 0; i < c.offers.size(); )
+        {
+            Case candidate = c;
+            candidate.offers.erase(candidate.offers.begin() + i);
+            if (disagreement(candidate, expected, actual))
+            {
+                c = candidate;
+            }
+            else
+            {
+                ++i;
+            }
+        }
+
+        for (size_t length = c.acceptValue.size() / 2; length > 0; length /= 2)
+        {
+            for (size_t position = 0; position < c.acceptValue.size(); )
+            {
+                Case candidate = c;
+                candidate.acceptValue.erase(position, length);
+                if (disagreement(candidate, expected, actual))
+                {
+                    c = candidate;
+                }
+                else
+                {
+                    position += length;
+                }
+            }
+        }
+        return c;
+    }
+
+    std::string quote(const std::string &s)
+    {
+        std::string quoted = "\"";
+        for (const char c : s)
+        {
+            char escaped[8];
+            if ((c == '"') || (c == '\\'))
+            {
+                quoted += '\\';
+                quoted += c;
+            }
+            else if ((static_cast<unsigned char>(c) < 0x20) || (static_cast<unsigned char>(c) >= 0x7f))
+            {
+                std::snprintf(escaped, sizeof(escaped), "\\x%02x", static_cast<unsigned char>(c));
+                quoted += escaped;
+            }
+            else
+            {
+                quoted += c;
+            }
+        }
+        return quoted + "\"";
+    }
+
+    // Compares the engines on a case, and prints it minimized if they disagree.
+    bool check(const Case &c, unsigned &mismatches)
+    {
+        std::string expected;
+        std::string actual;
+        if (!disagreement(c, expected, actual))
+        {
+            return true;
+        }
+
+        if (++mismatches <= kMaxReportedMismatches)
+        {
+            const Case minimized = minimize(c);
+            const char *engine = disagreement(minimized, expected, actual);
+            std::printf("mismatch (%s): header %s, offers", engine, quote(minimized.acceptValue).c_str());
+            for (const auto &offer : minimized.offers)
+            {
+                std::printf(" %s", quote(offer).c_str());
+            }
+            std::printf(": reference %s, optimized %s\n", quote(expected).c_str(), quote(actual).c_str());
+        }
+        return false;
+    }
+}
+
+int main(int argc, char **argv)
+{
+    const char *path = (argc > 1) ? argv[1] : kDefaultCorpus;
+    const unsigned iterations = (argc > 2) ? static_cast<unsigned>(std::strtoul(argv[2], nullptr, 10)) : kDefaultIterations;
+    const unsigned seed = (argc > 3) ? static_cast<unsigned>(std::strtoul(argv[3], nullptr, 10)) : 1;
+
+    std::vector<std::string> corpus;
+    {
+        std::ifstream file(path);
+        std::string line;
+        while (std::getline(file, line))
+        {
+            corpus.push_back(line);
+        }
+    }
+    if (corpus.empty())
+    {
+        std::fprintf(stderr, "cannot read the corpus '%s'\n", path);
+        return 1;
+    }
+
+    Generator generator(seed);
+    unsigned mismatches = 0;
+    for (unsigned i = 0; i < iterations; ++i)
+    {
+        check(Case{generator.header(), generator.offers()}, mismatches);
+    }
+    for (const auto &acceptValue : corpus)
+    {
+        for (unsigned i = 0; i < 100; ++i)
+        {
+            check(Case{acceptValue, generator.offers()}, mismatches);
+        }
+    }
+
+    // Distinct ranges sharing their lengths and outer characters, which
+    // collide on the cheap hash of the range index and make it fall back to
+    // the full hash.
+    std::string collidingHeader;
+    for (unsigned i = 0; i < 200; ++i)
+    {
+        char range[32];
+        std::snprintf(range, sizeof(range), "%stext/h%03ul;q=0.%u", i ? "," : "", i, i % 10);
+        collidingHeader += range;
+    }
+    for (unsigned i = 0; i < 100; ++i)
+    {
+        std::vector<std::string> offers = generator.offers();
+        offers.push_back("text/h" + std::to_string(100 + i) + "l");
+        check(Case{collidingHeader, offers}, mismatches);
+    }
+    std::printf("%u generated, %zu corpus and 100 colliding cases, %u mismatches\n", iterations, corpus.size() * 100, mismatches);
+
+    // The shadow mode reports through the counters rather than by failing a call.
+    HttpAcceptReference::setShadowPeriod(1);
+    const HttpAcceptCounters::Stats before = HttpAcceptCounters::getStats();
+    for (unsigned i = 0; i < iterations / 10; ++i)
+    {
+        const std::string acceptValue = generator.header();
+        const std::vector<std::string> offers = generator.offers();
+        HttpAcceptParser::parse(acceptValue, offers);
+        HttpAcceptParser::select(acceptValue, HttpAcceptParser::OfferSet(offers));
+    }
+    HttpAcceptReference::setShadowPeriod(0);
+    const HttpAcceptCounters::Stats after = HttpAcceptCounters::getStats();
+    const uint64_t shadowMismatches = after.shadowMismatches - before.shadowMismatches;
+    std::printf("shadow mode: %llu comparisons, %llu mismatches\n", static_cast<unsigned long long>(after.shadowComparisons - before.shadowComparisons),
+        static_cast<unsigned long long>(shadowMismatches));
+
+    return (mismatches || shadowMismatches) ? 1 : 0;
+}
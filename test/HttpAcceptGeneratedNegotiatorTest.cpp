@@ -0,0 +1,79 @@
+/* -*- c++ -*- */
+
+#include <cctype>
+#include <cstdio>
+#include <fstream>
+#include <string>
+#include <vector>
+#include "../HttpAcceptParser.h"
+#include "HttpAcceptCorpusNegotiator.h"
+
+// Compares the negotiator generated from the corpus by HttpAcceptCodegen with
+// HttpAcceptParser, on the headers of the corpus, which the generated code
+// answers from its tables, and on altered copies of them, which it must leave
+// to the parser. The offers are those given to the generator by the build.
+// The exit status is 1 if any mismatch was found.
+//
+// usage: HttpAcceptGeneratedNegotiatorTest [corpus]
+
+namespace
+{
+    const char *const kDefaultCorpus = "bench/corpus.txt";
+    const char *const kOffers[] = { "text/html", "application/xhtml+xml", "application/json", "image/webp", "image/png", "text/plain" };
+
+    std::vector<std::string> variants(const std::string &header)
+    {
+        std::vector<std::string> variants(1, header);
+        variants.push_back(header + ",application/json;q=0.95");
+        variants.push_back(" " + header);
+        if (!header.empty())
+        {
+            variants.push_back(header.substr(0, header.size() - 1));
+            variants.push_back(header.substr(1));
+        }
+        std::string upper(header);
+        for (size_t i = 0; i < upper.size(); ++i)
+        {
+            upper[i] = static_cast<char>(std::toupper(static_cast<unsigned char>(upper[i])));
+        }
+        variants.push_back(upper);
+        return variants;
+    }
+}
+
+int main(int argc, char **argv)
+{
+    const char *path = (argc > 1) ? argv[1] : kDefaultCorpus;
+    std::ifstream in(path);
+    if (!in)
+    {
+        std::fprintf(stderr, "cannot read the corpus '%s'\n", path);
+        return 1;
+    }
+
+    const HttpAcceptParser::OfferSet offerSet(std::vector<std::string>(kOffers, kOffers + sizeof(kOffers) / sizeof(kOffers[0])));
+    unsigned checks = 0;
+    unsigned mismatches = 0;
+    std::string line;
+    while (std::getline(in, line))
+    {
+        const std::vector<std::string> headers = variants(line);
+        for (size_t i = 0; i < headers.size(); ++i)
+        {
+            const int expected = HttpAcceptParser::select(headers[i], offerSet);
+            const int actual = HttpAcceptCorpusNegotiator::select(headers[i]);
+            const std::string expectedType = HttpAcceptParser::parse(headers[i], offerSet);
+            const std::string actualType = HttpAcceptCorpusNegotiator::parse(headers[i]);
+            ++checks;
+            if ((expected != actual) || (expectedType != actualType))
+            {
+                std::printf("mismatch: header '%s': parser %d '%s', generated %d '%s'\n", headers[i].c_str(), expected, expectedType.c_str(), actual,
+                    actualType.c_str());
+                ++mismatches;
+            }
+        }
+    }
+
+    std::printf("%u checks, %u mismatches\n", checks, mismatches);
+    return (mismatches == 0) ? 0 : 1;
+}
@@ -0,0 +1,135 @@
+/* -*- c++ -*- */
+
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <vector>
+#include "../HttpAcceptHash.h"
+#include "../HttpAcceptHotHeaderCache.h"
+#include "../HttpAcceptParser.h"
+
+// Checks that HttpAcceptHotHeaderCache promotes a header once promotionInterval
+// samples were counted, answers it from the promoted table, and that a saved
+// snapshot is loaded back unless its checksum, its version or the offer sets
+// it references do not match. The snapshots are written to the working
+// directory. The exit status is 1 if any check failed.
+//
+// usage: HttpAcceptHotHeaderCacheTest
+
+namespace
+{
+    const char *const kHeader = "text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8";
+    const char *const kOffers[] = { "application/json", "application/xml", "text/html" };
+    const char *const kSnapshot = "HttpAcceptHotHeaderCacheTest.snapshot";
+    const char *const kAlteredSnapshot = "HttpAcceptHotHeaderCacheTest.altered.snapshot";
+
+    // Offset of the version in the header of a snapshot file, after the magic.
+    const size_t kVersionOffset = 8;
+
+    unsigned g_checks = 0;
+    unsigned g_failures = 0;
+
+    void check(bool condition, const char *description)
+    {
+        ++g_checks;
+        if (!condition)
+        {
+            std::printf("failure: %s\n", description);
+            ++g_failures;
+        }
+    }
+
+    HttpAcceptHotHeaderCache::Options testOptions()
+    {
+        HttpAcceptHotHeaderCache::Options options;
+        options.sampleRate = 1;
+        options.promotionInterval = 32;
+        options.minCount = 4;
+        options.topK = 8;
+        return options;
+    }
+
+    std::string readFile(const char *path)
+    {
+        std::ifstream file(path, std::ios::binary);
+        return std::string(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+    }
+
+    // Writes a copy of the snapshot with one byte flipped.
+    void writeAltered(const std::string &snapshot, size_t offset)
+    {
+        std::string altered(snapshot);
+        altered[offset] = static_cast<char>(altered[offset] ^ 0x01);
+        std::ofstream file(kAlteredSnapshot, std::ios::binary | std::ios::trunc);
+        file.write(altered.data(), static_cast<std::streamsize>(altered.size()));
+    }
+
+    // Loads a snapshot into a new cache, and checks that the header is then
+    // answered from the table if the snapshot is expected to be accepted.
+    bool loadAndServe(const char *path, const std::vector<uint64_t> &fingerprints, const std::vector<std::string> &offers)
+    {
+        HttpAcceptHotHeaderCache cache(testOptions());
+        if (!cache.loadSnapshot(path, fingerprints))
+        {
+            return false;
+        }
+        const std::string result = cache.parse(kHeader, offers);
+        return (cache.getStats().hits == 1) && (result == HttpAcceptParser::parse(kHeader, offers));
+    }
+}
+
+int main()
+{
+    const std::vector<std::string> offers(kOffers, kOffers + sizeof(kOffers) / sizeof(kOffers[0]));
+    const std::string expected = HttpAcceptParser::parse(kHeader, offers);
+    HttpAcceptHotHeaderCache cache(testOptions());
+
+    // Promotion is only due after promotionInterval samples.
+    check(!cache.saveSnapshot(kSnapshot), "nothing to save before the first promotion");
+    for (unsigned i = 0; i + 1 < testOptions().promotionInterval; ++i)
+    {
+        check(cache.parse(kHeader, offers) == expected, "result before the promotion");
+    }
+    check(!cache.promoteIfDue(), "promotion is not due before the interval");
+    check(cache.getStats().hits == 0, "no hit before the promotion");
+    cache.parse(kHeader, offers);
+    check(cache.promoteIfDue(), "promotion is due after the interval");
+    check(!cache.promoteIfDue(), "the interval restarts after a promotion");
+
+    HttpAcceptHotHeaderCache::Stats stats = cache.getStats();
+    check((stats.promotions == 1) && (stats.promotedHeaders == 1) && (stats.newlyPromoted == 1), "one header promoted");
+    check(cache.parse(kHeader, offers) == expected, "result of the promoted header");
+    check(cache.getStats().hits == 1, "promoted header answered from the table");
+    check(cache.parse("text/plain", offers) == HttpAcceptParser::parse("text/plain", offers), "result of a cold header");
+    check(cache.getStats().hits == 1, "cold header not answered from the table");
+
+    // A snapshot is accepted with its offer set, and rejected otherwise.
+    const std::vector<uint64_t> fingerprints(1, HttpAcceptHash::fingerprint(offers));
+    check(cache.saveSnapshot(kSnapshot), "snapshot saved");
+    check(loadAndServe(kSnapshot, fingerprints, offers), "snapshot loaded and served");
+    check(!loadAndServe(kSnapshot, std::vector<uint64_t>(1, fingerprints[0] + 1), offers), "snapshot of another offer set rejected");
+    check(!loadAndServe(kSnapshot, std::vector<uint64_t>(), offers), "snapshot without offer sets rejected");
+    check(!loadAndServe("HttpAcceptHotHeaderCacheTest.missing", fingerprints, offers), "missing snapshot rejected");
+
+    // Alterations are detected by the checksum, which covers everything but
+    // the file header, and by the version in the file header.
+    const std::string snapshot = readFile(kSnapshot);
+    check(snapshot.size() > kVersionOffset, "snapshot read back");
+    if (snapshot.size() > kVersionOffset)
+    {
+        writeAltered(snapshot, snapshot.size() - 1);
+        check(!loadAndServe(kAlteredSnapshot, fingerprints, offers), "corrupted snapshot rejected");
+        writeAltered(snapshot, kVersionOffset);
+        check(!loadAndServe(kAlteredSnapshot, fingerprints, offers), "snapshot of another version rejected");
+        std::ofstream truncated(kAlteredSnapshot, std::ios::binary | std::ios::trunc);
+        truncated.write(snapshot.data(), static_cast<std::streamsize>(snapshot.size() - 8));
+        truncated.close();
+        check(!loadAndServe(kAlteredSnapshot, fingerprints, offers), "truncated snapshot rejected");
+    }
+    std::remove(kSnapshot);
+    std::remove(kAlteredSnapshot);
+
+    std::printf("%u checks, %u failures\n", g_checks, g_failures);
+    return (g_failures == 0) ? 0 : 1;
+}
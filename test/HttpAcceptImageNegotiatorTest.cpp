@@ -0,0 +1,108 @@
+/* -*- c++ -*- */
+
+#include <algorithm>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include "../HttpAcceptImageNegotiator.h"
+#include "../HttpAcceptParser.h"
+
+// Checks that HttpAcceptImageNegotiator recognizes the image headers of the
+// known browsers, and that the format it decided for them when it was built
+// is the one HttpAcceptParser::parse() selects, for every non-empty list of
+// available formats in every order. The exit status is 1 if any case failed.
+//
+// usage: HttpAcceptImageNegotiatorTest
+
+namespace
+{
+    // The known headers, in the order of HttpAcceptImageNegotiator.cpp.
+    const char *const kKnownHeaders[] =
+    {
+        "image/avif,image/webp,image/apng,image/svg+xml,image/*,*/*;q=0.8",
+        "image/webp,image/apng,image/*,*/*;q=0.8",
+        "image/avif,image/webp,image/png,image/svg+xml,image/*;q=0.8,*/*;q=0.5",
+        "image/avif,image/webp,*/*",
+        "image/webp,*/*",
+        "image/webp,image/avif,image/jxl,image/heic,image/heic-sequence,video/*;q=0.8,image/png,image/svg+xml,image/*;q=0.8,*/*;q=0.5",
+        "image/webp,image/png,image/svg+xml,image/*;q=0.8,video/*;q=0.8,*/*;q=0.5",
+        "image/png,image/svg+xml,image/*;q=0.8,video/*;q=0.8,*/*;q=0.5",
+        "*/*"
+    };
+
+    const HttpAcceptImageNegotiator::Format kFormats[] =
+    {
+        HttpAcceptImageNegotiator::kAvif,
+        HttpAcceptImageNegotiator::kWebp,
+        HttpAcceptImageNegotiator::kJxl,
+        HttpAcceptImageNegotiator::kPng,
+        HttpAcceptImageNegotiator::kJpeg
+    };
+
+    const size_t kKnownHeaderCount = sizeof(kKnownHeaders) / sizeof(kKnownHeaders[0]);
+    const size_t kFormatCount = sizeof(kFormats) / sizeof(kFormats[0]);
+
+    std::string describe(const std::vector<HttpAcceptImageNegotiator::Format> &formats)
+    {
+        std::string description;
+        for (const auto format : formats)
+        {
+            description += (description.empty() ? "" : ",") + std::string(HttpAcceptImageNegotiator::contentType(format));
+        }
+        return description;
+    }
+}
+
+int main()
+{
+    unsigned cases = 0;
+    unsigned failures = 0;
+    for (size_t i = 0; i < kKnownHeaderCount; ++i)
+    {
+        unsigned formats = 0;
+        if (HttpAcceptImageNegotiator::recognize(kKnownHeaders[i], formats) != static_cast<int>(i))
+        {
+            std::printf("failure: header '%s' not recognized at position %zu\n", kKnownHeaders[i], i);
+            ++failures;
+        }
+    }
+
+    // Every subset of the formats, in every order.
+    for (unsigned subset = 1; subset < (1u << kFormatCount); ++subset)
+    {
+        std::vector<HttpAcceptImageNegotiator::Format> formats;
+        for (size_t i = 0; i < kFormatCount; ++i)
+        {
+            if (subset & (1u << i))
+            {
+                formats.push_back(kFormats[i]);
+            }
+        }
+
+        do
+        {
+            const HttpAcceptImageNegotiator negotiator(formats);
+            std::vector<std::string> contentTypes;
+            for (const auto format : formats)
+            {
+                contentTypes.push_back(HttpAcceptImageNegotiator::contentType(format));
+            }
+            for (size_t i = 0; i < kKnownHeaderCount; ++i)
+            {
+                ++cases;
+                const std::string selected = HttpAcceptImageNegotiator::contentType(negotiator.negotiate(kKnownHeaders[i]));
+                const std::string expected = HttpAcceptParser::parse(kKnownHeaders[i], contentTypes);
+                if (selected != expected)
+                {
+                    std::printf("failure: header '%s', formats %s: selected '%s', expected '%s'\n", kKnownHeaders[i], describe(formats).c_str(),
+                        selected.c_str(), expected.c_str());
+                    ++failures;
+                }
+            }
+        }
+        while (std::next_permutation(formats.begin(), formats.end()));
+    }
+
+    std::printf("%u cases, %u failures\n", cases, failures);
+    return (failures == 0) ? 0 : 1;
+}
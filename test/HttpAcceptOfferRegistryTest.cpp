@@ -0,0 +1,135 @@
+/* -*- c++ -*- */
+
+#include <atomic>
+#include <cstdio>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+#include "../HttpAcceptOfferRegistry.h"
+#include "../HttpAcceptRcu.h"
+
+// Checks the publications, removals, lookups and generations of
+// HttpAcceptOfferRegistry, then republishes a route while another thread
+// negotiates against it: every answer must come from the offer set of the
+// generation it reports, and generations must never go backwards. The exit
+// status is 1 if any check failed.
+//
+// usage: HttpAcceptOfferRegistryTest [republications]
+
+namespace
+{
+    const char *const kHeader = "application/json, text/html;q=0.5";
+    const unsigned kDefaultRepublications = 20000;
+
+    unsigned g_checks = 0;
+    unsigned g_failures = 0;
+
+    void check(bool condition, const char *description)
+    {
+        ++g_checks;
+        if (!condition)
+        {
+            std::printf("failure: %s\n", description);
+            ++g_failures;
+        }
+    }
+
+    // The offers of a route alternate with the parity of the generation.
+    std::vector<std::string> offers(uint64_t generation)
+    {
+        if (generation % 2)
+        {
+            return std::vector<std::string>{ "text/html", "application/json" };
+        }
+        return std::vector<std::string>{ "text/html", "text/plain" };
+    }
+
+    std::string expected(uint64_t generation)
+    {
+        return (generation % 2) ? "application/json" : "text/html";
+    }
+}
+
+int main(int argc, char **argv)
+{
+    const unsigned republications = (argc > 1) ? static_cast<unsigned>(std::stoul(argv[1])) : kDefaultRepublications;
+    HttpAcceptOfferRegistry registry;
+    uint64_t generation = 0;
+
+    // Every publication and removal advances the generation.
+    check(registry.generation() == 0, "initial generation");
+    check(!registry.find("missing") && registry.parse("missing", kHeader, &generation).empty() && (generation == 0), "unknown route");
+    check(registry.publish("orders", offers(1)) == 1, "first publication");
+    check(registry.publish("users", offers(2)) == 2, "second publication");
+    check(registry.generation() == 2, "generation after two publications");
+    {
+        HttpAcceptRcu::ReadGuard guard;
+        const HttpAcceptOfferRegistry::OfferSet *orders = registry.find("orders");
+        check(orders && (orders->generation() == 1) && (orders->contentTypes() == offers(1)), "offer set of the first route");
+        const HttpAcceptOfferRegistry::OfferSet *users = registry.find("users");
+        check(users && (users->generation() == 2) && (users->contentTypes() == offers(2)), "offer set of the second route");
+    }
+    check((registry.parse("orders", kHeader, &generation) == expected(1)) && (generation == 1), "negotiation against the first route");
+    check(registry.remove("orders") && (registry.generation() == 3), "removal advances the generation");
+    check(!registry.remove("orders") && (registry.generation() == 3), "removal of an unknown route");
+    check(registry.parse("orders", kHeader, &generation).empty() && (generation == 0), "negotiation against a removed route");
+    check((registry.parse("users", kHeader, &generation) == expected(2)) && (generation == 2), "other routes are kept");
+
+    // Publishing every route at once replaces the whole content.
+    std::map<std::string, std::vector<std::string>> routes;
+    routes["orders"] = offers(4);
+    check(registry.publish(routes) == 4, "publication of every route");
+    check(!registry.find("users"), "routes not republished are removed");
+    check((registry.parse("orders", kHeader, &generation) == expected(4)) && (generation == 4), "republished route");
+
+    // Concurrent reader.
+    std::atomic<bool> done(false);
+    std::atomic<unsigned> readerFailures(0);
+    std::atomic<unsigned> reads(0);
+    std::thread reader([&registry, &done, &readerFailures, &reads]()
+    {
+        uint64_t previous = 0;
+        while (!done.load())
+        {
+            uint64_t current = 0;
+            const std::string result = registry.parse("orders", kHeader, &current);
+            bool consistent = (result == expected(current)) && (current >= previous);
+            {
+                HttpAcceptRcu::ReadGuard guard;
+                const HttpAcceptOfferRegistry::OfferSet *offerSet = registry.find("orders");
+                consistent = consistent && offerSet && (offerSet->generation() >= current) && (offerSet->contentTypes() == offers(offerSet->generation()));
+            }
+            if (!consistent)
+            {
+                readerFailures.fetch_add(1);
+            }
+            previous = current;
+            reads.fetch_add(1);
+        }
+    });
+    while (reads.load() == 0)
+    {
+        std::this_thread::yield();
+    }
+    for (unsigned i = 0; i < republications; ++i)
+    {
+        const uint64_t next = registry.generation() + 1;
+        if (registry.publish("orders", offers(next)) != next)
+        {
+            readerFailures.fetch_add(1);
+        }
+        if (i % 256 == 0)
+        {
+            std::this_thread::yield();
+        }
+    }
+    done.store(true);
+    reader.join();
+    check(readerFailures.load() == 0, "concurrent negotiations match the generation they report");
+    check(reads.load() > 0, "concurrent negotiations ran");
+    check(registry.generation() == 4 + republications, "generation after the republications");
+
+    std::printf("%u checks, %u failures, %u concurrent negotiations\n", g_checks, g_failures, reads.load());
+    return (g_failures == 0) ? 0 : 1;
+}
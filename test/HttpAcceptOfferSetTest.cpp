@@ -0,0 +1,117 @@
+/* -*- c++ -*- */
+
+#include <cstdio>
+#include <string>
+#include <vector>
+#include "../HttpAcceptParser.h"
+
+// Checks the selections of offer sets built with the matching flags, which
+// the reference engine does not implement, against expected positions.
+// The exit status is 1 if any case failed.
+//
+// usage: HttpAcceptOfferSetTest
+
+namespace
+{
+    struct Case
+    {
+        const char              *acceptValue;
+        std::vector<std::string> offers;
+        unsigned                 flags;
+        int                      expected;
+    };
+
+    const std::vector<Case> &cases()
+    {
+        static const std::vector<Case> kCases = {
+            // Media-type parameters select among versions.
+            { "application/vnd.acme+json;version=2", { "application/vnd.acme+json;version=1", "application/vnd.acme+json;version=2" },
+                HttpAcceptParser::OfferSet::kMatchParameters, 1 },
+            { "application/vnd.acme+json;version=3, application/vnd.acme+json;q=0.1", { "application/vnd.acme+json;version=1", "application/vnd.acme+json;version=2" },
+                HttpAcceptParser::OfferSet::kMatchParameters, 0 },
+            // Parameters following the quality are accept-ext, not media-type parameters.
+            { "application/vnd.acme+json;version=2;q=0.9;ext=1, application/vnd.acme+json;version=1;q=0.5",
+                { "application/vnd.acme+json;version=1", "application/vnd.acme+json;version=2" }, HttpAcceptParser::OfferSet::kMatchParameters, 1 },
+            { "application/vnd.acme+json;q=0.9;version=1, text/html;q=0.5", { "text/html", "application/vnd.acme+json;version=2" },
+                HttpAcceptParser::OfferSet::kMatchParameters, 1 },
+            // Headers of more than eight ranges are matched through the range index.
+            { "text/a, text/b, text/c, text/d, text/e, text/f, text/g, application/vnd.acme+json;version=2, application/vnd.acme+json;q=0.1",
+                { "application/vnd.acme+json;version=1", "application/vnd.acme+json;version=2" }, HttpAcceptParser::OfferSet::kMatchParameters, 1 },
+            { "text/a, text/b, text/c, text/d, text/e, text/f, text/g, application/vnd.acme+json;version=3, application/vnd.acme+json;q=0.1",
+                { "application/vnd.acme+json;version=1", "application/vnd.acme+json;version=2" }, HttpAcceptParser::OfferSet::kMatchParameters, 0 },
+            { "text/a, text/b, text/c, text/d, text/e, text/f, text/g, text/h;q=0.9, application/*;version=2;q=0.5, application/*;q=0.1",
+                { "text/html", "application/vnd.acme+json;version=1", "application/vnd.acme+json;version=2" }, HttpAcceptParser::OfferSet::kMatchParameters, 2 },
+            // Structured syntax suffixes.
+            { "application/json", { "text/html", "application/vnd.acme.order+json" }, HttpAcceptParser::OfferSet::kMatchSuffixes, 1 },
+            { "application/json", { "text/html", "application/vnd.acme.order+json" }, 0, 0 },
+            // A range of a higher rank decides, wherever it is: 'type/subtype',
+            // 'type/suffix', 'type/*+suffix', '*/*+suffix', 'type/*' and '*/*'.
+            { "application/vnd.acme+json;q=0.9, text/plain;q=0.5, application/json;q=0.1",
+                { "text/plain", "application/vnd.acme+json" }, HttpAcceptParser::OfferSet::kMatchSuffixes, 1 },
+            { "application/vnd.acme+json;q=0.1, text/plain;q=0.5, application/json;q=0.9",
+                { "text/plain", "application/vnd.acme+json" }, HttpAcceptParser::OfferSet::kMatchSuffixes, 0 },
+            { "application/json;q=0.9, text/plain;q=0.5, application/*+json;q=0.1",
+                { "text/plain", "application/vnd.acme+json" }, HttpAcceptParser::OfferSet::kMatchSuffixes, 1 },
+            { "application/json;q=0.1, text/plain;q=0.5, application/*+json;q=0.9",
+                { "text/plain", "application/vnd.acme+json" }, HttpAcceptParser::OfferSet::kMatchSuffixes, 0 },
+            { "application/*+json;q=0.9, text/plain;q=0.5, */*+json;q=0.1",
+                { "text/plain", "application/vnd.acme+json" }, HttpAcceptParser::OfferSet::kMatchSuffixes, 1 },
+            { "application/*+json;q=0.1, text/plain;q=0.5, */*+json;q=0.9",
+                { "text/plain", "application/vnd.acme+json" }, HttpAcceptParser::OfferSet::kMatchSuffixes, 0 },
+            { "*/*+json;q=0.9, text/plain;q=0.5, application/*;q=0.1",
+                { "text/plain", "application/vnd.acme+json" }, HttpAcceptParser::OfferSet::kMatchSuffixes, 1 },
+            { "*/*+json;q=0.1, text/plain;q=0.5, application/*;q=0.9",
+                { "text/plain", "application/vnd.acme+json" }, HttpAcceptParser::OfferSet::kMatchSuffixes, 0 },
+            { "application/*;q=0.9, text/plain;q=0.5, */*;q=0.1",
+                { "text/plain", "application/vnd.acme+json" }, HttpAcceptParser::OfferSet::kMatchSuffixes, 1 },
+            { "application/*;q=0.1, text/plain;q=0.5, */*;q=0.9",
+                { "text/plain", "application/vnd.acme+json" }, HttpAcceptParser::OfferSet::kMatchSuffixes, 0 },
+            // Among the ranges of a rank, the last one in the order of preference,
+            // of the lowest quality, decides.
+            { "application/json;q=0.1, text/plain;q=0.5, application/json;q=0.9",
+                { "text/plain", "application/vnd.acme+json" }, HttpAcceptParser::OfferSet::kMatchSuffixes, 0 },
+            { "application/json, text/plain;q=0.5, application/json;q=0.6",
+                { "text/plain", "application/vnd.acme+json" }, HttpAcceptParser::OfferSet::kMatchSuffixes, 1 },
+            { "application/*+json;q=0.1, text/plain;q=0.5, application/*+json;q=0.9",
+                { "text/plain", "application/vnd.acme+json" }, HttpAcceptParser::OfferSet::kMatchSuffixes, 0 },
+            { "application/*+json, text/plain;q=0.5, application/*+json;q=0.6",
+                { "text/plain", "application/vnd.acme+json" }, HttpAcceptParser::OfferSet::kMatchSuffixes, 1 },
+            { "*/*+json;q=0.1, text/plain;q=0.5, */*+json;q=0.9",
+                { "text/plain", "application/vnd.acme+json" }, HttpAcceptParser::OfferSet::kMatchSuffixes, 0 },
+            { "*/*+json, text/plain;q=0.5, */*+json;q=0.6",
+                { "text/plain", "application/vnd.acme+json" }, HttpAcceptParser::OfferSet::kMatchSuffixes, 1 },
+            // A suffix match of quality 0 excludes the content type.
+            { "application/json;q=0, text/plain;q=0.5, */*",
+                { "text/plain", "application/vnd.acme+json" }, HttpAcceptParser::OfferSet::kMatchSuffixes, 0 },
+            { "*/*+json;q=0, text/plain;q=0.5, application/*",
+                { "text/plain", "application/vnd.acme+json" }, HttpAcceptParser::OfferSet::kMatchSuffixes, 0 },
+            { "application/json;q=0, text/plain;q=0.5, */*", { "text/plain", "application/vnd.acme+json" }, 0, 1 },
+        };
+        return kCases;
+    }
+}
+
+int main()
+{
+    // Every case is negotiated again after ranges matching none of the
+    // offers, so that the header is matched through the range index.
+    const std::string padding = "x-pad/a, x-pad/b, x-pad/c, x-pad/d, x-pad/e, x-pad/f, x-pad/g, x-pad/h, ";
+    unsigned failures = 0;
+    for (const Case &test : cases())
+    {
+        const HttpAcceptParser::OfferSet offerSet(test.offers, 0, test.flags);
+        const std::string acceptValues[] = { test.acceptValue, padding + test.acceptValue };
+        for (const std::string &acceptValue : acceptValues)
+        {
+            const int selected = HttpAcceptParser::select(acceptValue, offerSet);
+            if (selected != test.expected)
+            {
+                std::printf("failure: header '%s', flags %u: selected %d, expected %d\n", acceptValue.c_str(), test.flags, selected, test.expected);
+                ++failures;
+            }
+        }
+    }
+
+    std::printf("%zu cases, %u failures\n", cases().size(), failures);
+    return (failures == 0) ? 0 : 1;
+}
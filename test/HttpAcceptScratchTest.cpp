@@ -0,0 +1,73 @@
+/* -*- c++ -*- */
+
+#include <cstdio>
+#include <string>
+#include <vector>
+#include "../HttpAcceptParser.h"
+
+// Checks that a NegotiationScratch keeps its buffers between negotiations of
+// ordinary headers, releases them after a header that made them grow beyond
+// its limit, and keeps them when the limit allows it. The exit status is 1
+// if any check failed.
+//
+// usage: HttpAcceptScratchTest
+
+namespace
+{
+    const char *const kHeader = "text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8";
+    const char *const kOffers[] = { "application/json", "application/xml", "text/html" };
+
+    unsigned g_checks = 0;
+    unsigned g_failures = 0;
+
+    void check(bool condition, const char *description)
+    {
+        ++g_checks;
+        if (!condition)
+        {
+            std::printf("failure: %s\n", description);
+            ++g_failures;
+        }
+    }
+
+    // Header of many ranges, larger than the default retention limit.
+    std::string largeHeader()
+    {
+        std::string header;
+        for (unsigned i = 0; header.size() <= 2 * HttpAcceptParser::NegotiationScratch::kDefaultMaxRetainedBytes; ++i)
+        {
+            header += "application/vnd.acme.r" + std::to_string(i) + "+json;q=0.5, ";
+        }
+        return header + kHeader;
+    }
+}
+
+int main()
+{
+    const std::vector<std::string> offers(kOffers, kOffers + sizeof(kOffers) / sizeof(kOffers[0]));
+    const HttpAcceptParser::OfferSet offerSet(offers);
+    const std::string large = largeHeader();
+    const std::string expected = HttpAcceptParser::parse(kHeader, offers);
+
+    // Ordinary headers reuse the buffers.
+    HttpAcceptParser::NegotiationScratch scratch;
+    check(HttpAcceptParser::parse(kHeader, offers, scratch) == expected, "result of an ordinary header");
+    const size_t retained = scratch.retainedBytes();
+    check((retained > 0) && (retained <= HttpAcceptParser::NegotiationScratch::kDefaultMaxRetainedBytes), "buffers retained after an ordinary header");
+    check((HttpAcceptParser::parse(kHeader, offers, scratch) == expected) && (scratch.retainedBytes() == retained), "buffers reused by an ordinary header");
+
+    // A large header grows the buffers, which are released at the end of the call.
+    check(HttpAcceptParser::parse(large, offers, scratch) == HttpAcceptParser::parse(large, offers), "result of a large header");
+    check(scratch.retainedBytes() <= HttpAcceptParser::NegotiationScratch::kDefaultMaxRetainedBytes, "buffers released after a large header");
+    check(HttpAcceptParser::select(large, offerSet, scratch) == HttpAcceptParser::select(large, offerSet), "selection of a large header");
+    check(scratch.retainedBytes() <= HttpAcceptParser::NegotiationScratch::kDefaultMaxRetainedBytes, "buffers released after a large header against an offer set");
+    check(HttpAcceptParser::parse(kHeader, offers, scratch) == expected, "result of an ordinary header after a large one");
+
+    // A larger limit keeps them.
+    HttpAcceptParser::NegotiationScratch largeScratch(16 * large.size());
+    HttpAcceptParser::parse(large, offers, largeScratch);
+    check(largeScratch.retainedBytes() > HttpAcceptParser::NegotiationScratch::kDefaultMaxRetainedBytes, "buffers kept within a larger limit");
+
+    std::printf("%u checks, %u failures\n", g_checks, g_failures);
+    return (g_failures == 0) ? 0 : 1;
+}
@@ -0,0 +1,91 @@
+/* -*- c++ -*- */
+
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "../HttpAcceptParser.h"
+#include "../HttpAcceptSharedCache.h"
+
+// Checks that a result inserted in HttpAcceptSharedCache by a forked worker
+// is a hit in its parent, that results are keyed by the fingerprint of the
+// offer set, that headers longer than kMaxAcceptLength bypass the cache, and
+// that a named segment is shared by the caches opening it with the same
+// capacity only. The exit status is 1 if any check failed.
+//
+// usage: HttpAcceptSharedCacheTest
+
+namespace
+{
+    const char *const kHeader = "text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8";
+    const char *const kOffers[] = { "application/json", "application/xml", "text/html" };
+    const size_t kCapacity = 64;
+
+    unsigned g_checks = 0;
+    unsigned g_failures = 0;
+
+    void check(bool condition, const char *description)
+    {
+        ++g_checks;
+        if (!condition)
+        {
+            std::printf("failure: %s\n", description);
+            ++g_failures;
+        }
+    }
+}
+
+int main()
+{
+    const std::vector<std::string> offers(kOffers, kOffers + sizeof(kOffers) / sizeof(kOffers[0]));
+    const HttpAcceptParser::OfferSet offerSet(offers);
+    const int expected = HttpAcceptParser::select(kHeader, offerSet);
+
+    // The worker negotiates and inserts, the parent finds the result.
+    HttpAcceptSharedCache cache;
+    check(cache.create(kCapacity), "anonymous segment created");
+    const pid_t worker = fork();
+    if (worker == 0)
+    {
+        const bool inserted = (cache.select(kHeader, offerSet) == expected) && (cache.getStats().inserts == 1) && (cache.getStats().hits == 0);
+        _exit(inserted ? 0 : 1);
+    }
+    int status = 0;
+    check((worker > 0) && (waitpid(worker, &status, 0) == worker) && WIFEXITED(status) && (WEXITSTATUS(status) == 0), "worker inserted its result");
+    int index = -1;
+    check(cache.lookup(offerSet.fingerprint(), kHeader, &index) && (index == expected), "result of the worker found by the parent");
+    check((cache.select(kHeader, offerSet) == expected) && (cache.getStats().hits == 1) && (cache.getStats().inserts == 0), "result of the worker is a hit");
+
+    // Another offer set misses, even with the same header.
+    const HttpAcceptParser::OfferSet suffixOfferSet(offers, 0, HttpAcceptParser::OfferSet::kMatchSuffixes);
+    check(!cache.lookup(offerSet.fingerprint() + 1, kHeader, &index), "other fingerprint misses");
+    check((cache.select(kHeader, suffixOfferSet) == HttpAcceptParser::select(kHeader, suffixOfferSet)) && (cache.getStats().hits == 1),
+        "other offer set misses");
+
+    // Long headers are counted and negotiated without the cache.
+    const std::string longHeader = std::string(kHeader) + std::string(HttpAcceptSharedCache::kMaxAcceptLength, ' ');
+    const HttpAcceptSharedCache::Stats before = cache.getStats();
+    check(cache.select(longHeader, offerSet) == HttpAcceptParser::select(longHeader, offerSet), "result of a long header");
+    const HttpAcceptSharedCache::Stats after = cache.getStats();
+    check((after.uncacheable == before.uncacheable + 1) && (after.lookups == before.lookups) && (after.inserts == before.inserts), "long header is uncacheable");
+    check(!cache.insert(offerSet.fingerprint(), longHeader, expected) && !cache.lookup(offerSet.fingerprint(), longHeader, &index), "long header is never stored");
+
+    // Named segments are shared by the caches opening them with the same capacity.
+    const std::string name = "/HttpAcceptSharedCacheTest." + std::to_string(static_cast<long>(getpid()));
+    HttpAcceptSharedCache first;
+    HttpAcceptSharedCache second;
+    HttpAcceptSharedCache mismatched;
+    check(first.open(name, kCapacity), "named segment created");
+    check(second.open(name, kCapacity), "named segment opened");
+    check(!mismatched.open(name, 2 * kCapacity), "named segment with another capacity rejected");
+    check(first.insert(offerSet.fingerprint(), kHeader, expected), "result inserted in the named segment");
+    check(second.lookup(offerSet.fingerprint(), kHeader, &index) && (index == expected), "result found through another mapping");
+    check((mismatched.select(kHeader, offerSet) == expected) && (mismatched.getStats().lookups == 0), "rejected cache negotiates without the segment");
+    shm_unlink(name.c_str());
+
+    std::printf("%u checks, %u failures\n", g_checks, g_failures);
+    return (g_failures == 0) ? 0 : 1;
+}
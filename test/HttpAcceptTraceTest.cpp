@@ -0,0 +1,132 @@
+/* -*- c++ -*- */
+
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+#include "../HttpAcceptHash.h"
+#include "../HttpAcceptParser.h"
+#include "../HttpAcceptTrace.h"
+
+// Checks that HttpAcceptTrace records one negotiation out of the sampling
+// period, keeps the last kCapacity records of a thread, drops the records of
+// the threads that have exited, and that the candidates and the selected
+// offer of a record are positions in the list of the caller, invalid offers
+// included. The exit status is 1 if any check failed.
+//
+// usage: HttpAcceptTraceTest
+
+namespace
+{
+    const char *const kHeader = "application/json, text/html;q=0.5, image/png;q=0";
+    const char *const kOffers[] = { "invalid", "text/html", "bogus", "application/json", "image/png" };
+
+    unsigned g_checks = 0;
+    unsigned g_failures = 0;
+
+    void check(bool condition, const char *description)
+    {
+        ++g_checks;
+        if (!condition)
+        {
+            std::printf("failure: %s\n", description);
+            ++g_failures;
+        }
+    }
+
+    // Header numbered by position, so that the record of every negotiation can be told apart.
+    std::string numberedHeader(unsigned i)
+    {
+        return "text/html, application/xhtml+xml;n=" + std::to_string(i);
+    }
+
+    bool recorded(const HttpAcceptTrace::Record &record, const std::string &header)
+    {
+        return (record.headerLength == header.size()) && (record.headerHash == HttpAcceptHash::hash(header)) &&
+            (std::memcmp(record.header, header.data(), header.size()) == 0);
+    }
+
+    // The offers of kOffers ranked by quality: application/json, text/html, then image/png excluded by q=0.
+    bool rankedOffers(const HttpAcceptTrace::Record &record)
+    {
+        return (record.selected == 3) && (record.candidateCount == 3) && (record.candidates[0].index == 3) && (record.candidates[0].quality == 1.0f) &&
+            (record.candidates[1].index == 1) && (record.candidates[1].quality == 0.5f) && (record.candidates[2].index == 4) &&
+            (record.candidates[2].quality <= 0);
+    }
+}
+
+int main()
+{
+    const std::vector<std::string> offers(kOffers, kOffers + sizeof(kOffers) / sizeof(kOffers[0]));
+    const HttpAcceptParser::OfferSet offerSet(offers);
+
+    // Tracing is disabled by default.
+    HttpAcceptParser::parse(kHeader, offers);
+    check(HttpAcceptTrace::dump().empty(), "nothing recorded while disabled");
+
+    // One negotiation out of the period is recorded, starting with the first.
+    const unsigned period = 4;
+    HttpAcceptTrace::setSamplePeriod(period);
+    for (unsigned i = 0; i < 8 * period; ++i)
+    {
+        HttpAcceptParser::parse(numberedHeader(i), offers);
+    }
+    std::vector<HttpAcceptTrace::Record> records = HttpAcceptTrace::dump();
+    bool sampled = (records.size() == 8);
+    for (size_t i = 0; sampled && (i < records.size()); ++i)
+    {
+        sampled = recorded(records[i], numberedHeader(static_cast<unsigned>(i * period)));
+    }
+    check(sampled, "one negotiation out of the period recorded, oldest first");
+
+    // The ring keeps the last kCapacity records.
+    HttpAcceptTrace::setSamplePeriod(1);
+    const unsigned overwritten = 10;
+    for (unsigned i = 0; i < HttpAcceptTrace::kCapacity + overwritten; ++i)
+    {
+        HttpAcceptParser::parse(numberedHeader(i), offers);
+    }
+    records = HttpAcceptTrace::dump();
+    bool kept = (records.size() == HttpAcceptTrace::kCapacity);
+    for (size_t i = 0; kept && (i < records.size()); ++i)
+    {
+        kept = recorded(records[i], numberedHeader(static_cast<unsigned>(i + overwritten)));
+    }
+    check(kept, "oldest records overwritten");
+
+    // The positions skip no invalid offer, with a list or with an offer set.
+    HttpAcceptParser::parse(kHeader, offers);
+    records = HttpAcceptTrace::dump();
+    check(!records.empty() && recorded(records.back(), kHeader) && rankedOffers(records.back()) &&
+        (records.back().offerSetId == HttpAcceptHash::fingerprint(offers)), "record of a list with invalid offers");
+    HttpAcceptParser::select(kHeader, offerSet);
+    records = HttpAcceptTrace::dump();
+    check(!records.empty() && recorded(records.back(), kHeader) && rankedOffers(records.back()) && (records.back().offerSetId == offerSet.fingerprint()),
+        "record of an offer set with invalid offers");
+
+    // The candidates are capped, and the header is truncated but hashed whole.
+    std::vector<std::string> manyOffers;
+    for (unsigned i = 0; i < 2 * HttpAcceptTrace::kMaxCandidates; ++i)
+    {
+        manyOffers.push_back("text/x" + std::to_string(i));
+    }
+    const std::string longHeader = numberedHeader(0) + std::string(HttpAcceptTrace::kMaxHeaderBytes, ' ') + ", text/*";
+    HttpAcceptParser::parse(longHeader, manyOffers);
+    records = HttpAcceptTrace::dump();
+    check(!records.empty() && (records.back().candidateCount == HttpAcceptTrace::kMaxCandidates) && (records.back().headerLength == longHeader.size()) &&
+        (records.back().headerHash == HttpAcceptHash::hash(longHeader)) && (std::memcmp(records.back().header, longHeader.data(), HttpAcceptTrace::kMaxHeaderBytes) == 0),
+        "long record truncated");
+
+    // The records of an exited thread are dropped.
+    const size_t before = HttpAcceptTrace::dump().size();
+    std::thread([]()
+    {
+        HttpAcceptParser::parse(kHeader, std::vector<std::string>(1, "text/html"));
+    }).join();
+    check(HttpAcceptTrace::dump().size() == before, "records of an exited thread dropped");
+
+    HttpAcceptTrace::setSamplePeriod(0);
+    std::printf("%u checks, %u failures\n", g_checks, g_failures);
+    return (g_failures == 0) ? 0 : 1;
+}
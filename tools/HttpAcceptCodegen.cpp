@@ -0,0 +1,593 @@
+/* -*- c++ -*- */
+
+#include <algorithm>
+#include <cctype>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include "../HttpAcceptHash.h"
+#include "../HttpAcceptParser.h"
+
+// Generates a negotiator specialized for an offer set and for the traffic
+// of a corpus of 'Accept' headers, one per line with repetitions.
+//
+// The generated class answers the hottest headers from a perfect hash table
+// built with hash and displace: the HttpAcceptHash of the header selects a
+// bucket, whose displacement, chosen at generation time so that no two hot
+// headers share a slot, is mixed into the hash to give the slot. A single
+// comparison then confirms the header. The next hottest headers are found by
+// a decision tree that switches on the length, then on the bytes that best
+// tell the remaining candidates apart, and ends on a comparison. Every other
+// header goes through HttpAcceptParser::select(). The selected offers are
+// computed by HttpAcceptParser at generation time, so the generated code
+// must be regenerated with the library, as the build target does.
+//
+// usage: HttpAcceptCodegen --offers=type/subtype,... [--match-parameters] [--match-suffixes]
+//                          [--hot=N] [--near-hot=N] [--name=ClassName] [--output=directory] corpus...
+
+namespace
+{
+    const unsigned kDefaultHot = 64;
+    const unsigned kDefaultNearHot = 256;
+    const char *const kDefaultName = "HttpAcceptGeneratedNegotiator";
+    const uint32_t kMaxDisplacement = 1u << 20;
+
+    struct Options
+    {
+        std::vector<std::string>  offers;
+        unsigned                  flags;
+        unsigned                  hot;
+        unsigned                  nearHot;
+        std::string               name;
+        std::string               output;
+        std::vector<const char *> paths;
+    };
+
+    struct Header
+    {
+        std::string value;
+        uint64_t    count;
+        size_t      firstSeen;
+        int         selected;
+    };
+
+    // Perfect hash table of the hot headers: header i of a slot, or -1.
+    struct PerfectHash
+    {
+        std::vector<uint32_t> displacements;
+        std::vector<int>      slots;
+    };
+
+    std::vector<std::string> split(const std::string &s, char delimiter)
+    {
+        std::vector<std::string> pieces;
+        size_t begin = 0;
+        for (size_t end = s.find(delimiter); ; end = s.find(delimiter, begin))
+        {
+            pieces.push_back(s.substr(begin, (end == std::string::npos) ? std::string::npos : end - begin));
+            if (end == std::string::npos)
+            {
+                return pieces;
+            }
+            begin = end + 1;
+        }
+    }
+
+    bool parseOptions(int argc, char **argv, Options &options)
+    {
+        options.flags = 0;
+        options.hot = kDefaultHot;
+        options.nearHot = kDefaultNearHot;
+        options.name = kDefaultName;
+        options.output = ".";
+        for (int i = 1; i < argc; ++i)
+        {
+            const char *argument = argv[i];
+            if (std::strncmp(argument, "--offers=", 9) == 0)
+            {
+                options.offers = split(argument + 9, ',');
+            }
+            else if (std::strcmp(argument, "--match-parameters") == 0)
+            {
+                options.flags |= HttpAcceptParser::OfferSet::kMatchParameters;
+            }
+            else if (std::strcmp(argument, "--match-suffixes") == 0)
+            {
+                options.flags |= HttpAcceptParser::OfferSet::kMatchSuffixes;
+            }
+            else if (std::strncmp(argument, "--hot=", 6) == 0)
+            {
+                options.hot = static_cast<unsigned>(std::strtoul(argument + 6, nullptr, 10));
+            }
+            else if (std::strncmp(argument, "--near-hot=", 11) == 0)
+            {
+                options.nearHot = static_cast<unsigned>(std::strtoul(argument + 11, nullptr, 10));
+            }
+            else if (std::strncmp(argument, "--name=", 7) == 0)
+            {
+                options.name = argument + 7;
+            }
+            else if (std::strncmp(argument, "--output=", 9) == 0)
+            {
+                options.output = argument + 9;
+            }
+            else if (argument[0] == '-')
+            {
+                return false;
+            }
+            else
+            {
+                options.paths.push_back(argument);
+            }
+        }
+        return !options.offers.empty() && !options.paths.empty() && !options.name.empty();
+    }
+
+    // Counts the headers of the corpus, and ranks them by decreasing count,
+    // then by first appearance.
+    bool loadCorpus(const std::vector<const char *> &paths, std::vector<Header> &headers, uint64_t &requests)
+    {
+        std::unordered_map<std::string, size_t> positions;
+        requests = 0;
+        for (const char *path : paths)
+        {
+            std::ifstream file(path, std::ios::binary);
+            if (!file)
+            {
+                std::fprintf(stderr, "cannot read the corpus '%s'\n", path);
+                return false;
+            }
+            for (std::string line; std::getline(file, line); )
+            {
+                if (!line.empty() && (line.back() == '\r'))
+                {
+                    line.pop_back();
+                }
+                ++requests;
+                if (line.empty())
+                {
+                    // Empty headers are answered before any lookup.
+                    continue;
+                }
+                const auto inserted = positions.insert(std::make_pair(line, headers.size()));
+                if (inserted.second)
+                {
+                    headers.push_back(Header{line, 0, headers.size(), -1});
+                }
+                ++headers[inserted.first->second].count;
+            }
+        }
+        std::sort(headers.begin(), headers.end(), [](const Header &a, const Header &b)
+        {
+            return (a.count != b.count) ? (a.count > b.count) : (a.firstSeen < b.firstSeen);
+        });
+        return true;
+    }
+
+    size_t powerOfTwo(size_t n)
+    {
+        size_t power = 1;
+        while (power < n)
+        {
+            power *= 2;
+        }
+        return power;
+    }
+
+    size_t bucketOf(uint64_t hash, size_t buckets)
+    {
+        return static_cast<size_t>(hash >> 32) & (buckets - 1);
+    }
+
+    size_t slotOf(uint64_t hash, uint32_t displacement, size_t slots)
+    {
+        return static_cast<size_t>(HttpAcceptHash::mix(hash ^ displacement)) & (slots - 1);
+    }
+
+    // Places the largest buckets first, each with the smallest displacement
+    // that sends all its headers to free slots. The table grows if a bucket
+    // cannot be placed.
+    bool buildPerfectHash(const std::vector<Header> &hot, PerfectHash &table)
+    {
+        std::vector<uint64_t> hashes;
+        std::unordered_set<uint64_t> distinctHashes;
+        for (const auto &header : hot)
+        {
+            hashes.push_back(HttpAcceptHash::hash(header.value));
+            if (!distinctHashes.insert(hashes.back()).second)
+            {
+                std::fprintf(stderr, "two hot headers have the same hash\n");
+                return false;
+            }
+        }
+
+        const size_t buckets = powerOfTwo((hot.size() + 3) / 4);
+        for (size_t slots = powerOfTwo(hot.size() + hot.size() / 4); slots <= 64 * powerOfTwo(hot.size()); slots *= 2)
+        {
+            std::vector<std::vector<int>> members(buckets);
+            for (size_t i = 0; i < hot.size(); ++i)
+            {
+                members[bucketOf(hashes[i], buckets)].push_back(static_cast<int>(i));
+            }
+            std::vector<size_t> order(buckets);
+            for (size_t i = 0; i < buckets; ++i)
+            {
+                order[i] = i;
+            }
+            std::stable_sort(order.begin(), order.end(), [&members](size_t a, size_t b) { return members[a].size() > members[b].size(); });
+
+            table.displacements.assign(buckets, 0);
+            table.slots.assign(slots, -1);
+            bool placed = true;
+            for (const size_t bucket : order)
+            {
+                if (members[bucket].empty())
+                {
+                    break;
+                }
+                placed = false;
+                for (uint32_t displacement = 0; !placed && (displacement < kMaxDisplacement); ++displacement)
+                {
+                    std::vector<size_t> candidateSlots;
+                    placed = true;
+                    for (const int member : members[bucket])
+                    {
+                        const size_t slot = slotOf(hashes[member], displacement, slots);
+                        if ((table.slots[slot] >= 0) || (std::find(candidateSlots.begin(), candidateSlots.end(), slot) != candidateSlots.end()))
+                        {
+                            placed = false;
+                            break;
+                        }
+                        candidateSlots.push_back(slot);
+                    }
+                    if (placed)
+                    {
+                        table.displacements[bucket] = displacement;
+                        for (size_t i = 0; i < candidateSlots.size(); ++i)
+                        {
+                            table.slots[candidateSlots[i]] = members[bucket][i];
+                        }
+                    }
+                }
+                if (!placed)
+                {
+                    break;
+                }
+            }
+            if (placed)
+            {
+                return true;
+            }
+        }
+        std::fprintf(stderr, "cannot build the perfect hash table\n");
+        return false;
+    }
+
+    std::string quote(const std::string &s)
+    {
+        std::string quoted = "\"";
+        for (size_t i = 0; i < s.size(); ++i)
+        {
+            const unsigned char c = static_cast<unsigned char>(s[i]);
+            if ((c == '"') || (c == '\\'))
+            {
+                quoted += '\\';
+                quoted += static_cast<char>(c);
+            }
+            else if ((c < 0x20) || (c >= 0x7f) || ((c == '?') && (i + 1 < s.size()) && (s[i + 1] == '?')))
+            {
+                // Octal escapes take at most three digits, and break trigraphs.
+                char escaped[8];
+                std::snprintf(escaped, sizeof(escaped), "\\%03o", c);
+                quoted += escaped;
+            }
+            else
+            {
+                quoted += static_cast<char>(c);
+            }
+        }
+        return quoted + "\"";
+    }
+
+    std::string characterLiteral(char c)
+    {
+        const unsigned char u = static_cast<unsigned char>(c);
+        char literal[8];
+        if ((u < 0x20) || (u >= 0x7f) || (c == '\'') || (c == '\\'))
+        {
+            std::snprintf(literal, sizeof(literal), "'\\%03o'", u);
+        }
+        else
+        {
+            std::snprintf(literal, sizeof(literal), "'%c'", c);
+        }
+        return literal;
+    }
+
+    // Emits the decision tree of near-hot headers of the same length, at
+    // the given indentation.
+    void emitTree(std::ostream &out, const std::vector<const Header *> &candidates, size_t length, const std::string &indent)
+    {
+        if (candidates.size() == 1)
+        {
+            out << indent << "if (std::memcmp(s, " << quote(candidates[0]->value) << ", " << length << ") == 0)\n"
+                << indent << "{\n"
+                << indent << "    return " << candidates[0]->selected << ";\n"
+                << indent << "}\n";
+            return;
+        }
+
+        // The first byte that splits the candidates into the most groups.
+        size_t bestPosition = 0;
+        size_t bestGroups = 0;
+        for (size_t position = 0; position < length; ++position)
+        {
+            bool seen[256] = {};
+            size_t groups = 0;
+            for (const Header *candidate : candidates)
+            {
+                const unsigned char c = static_cast<unsigned char>(candidate->value[position]);
+                groups += seen[c] ? 0 : 1;
+                seen[c] = true;
+            }
+            if (groups > bestGroups)
+            {
+                bestGroups = groups;
+                bestPosition = position;
+            }
+        }
+
+        std::vector<std::vector<const Header *>> groups;
+        std::vector<char> values;
+        for (const Header *candidate : candidates)
+        {
+            const char c = candidate->value[bestPosition];
+            const size_t group = static_cast<size_t>(std::find(values.begin(), values.end(), c) - values.begin());
+            if (group == values.size())
+            {
+                values.push_back(c);
+                groups.push_back(std::vector<const Header *>());
+            }
+            groups[group].push_back(candidate);
+        }
+
+        out << indent << "switch (s[" << bestPosition << "])\n" << indent << "{\n";
+        for (size_t group = 0; group < groups.size(); ++group)
+        {
+            out << indent << "case " << characterLiteral(values[group]) << ":\n";
+            emitTree(out, groups[group], length, indent + "    ");
+            out << indent << "    break;\n";
+        }
+        out << indent << "default:\n" << indent << "    break;\n" << indent << "}\n";
+    }
+
+    std::string includeGuard(const std::string &name)
+    {
+        std::string guard;
+        for (size_t i = 0; i < name.size(); ++i)
+        {
+            const char c = name[i];
+            if ((i > 0) && std::isupper(static_cast<unsigned char>(c)) && !std::isupper(static_cast<unsigned char>(name[i - 1])))
+            {
+                guard += '_';
+            }
+            guard += static_cast<char>(std::isalnum(static_cast<unsigned char>(c)) ? std::toupper(static_cast<unsigned char>(c)) : '_');
+        }
+        return guard + "_H";
+    }
+
+    void emitHeader(std::ostream &out, const Options &options)
+    {
+        const std::string guard = includeGuard(options.name);
+        out << "/* -*- c++ -*- */\n\n"
+            << "// Generated by HttpAcceptCodegen. Do not edit.\n\n"
+            << "#ifndef " << guard << "\n#define " << guard << "\n\n"
+            << "#include <string>\n#include \"HttpAcceptParser.h\"\n\n"
+            << "/**\n"
+            << " * Negotiator specialized for the offer set and the traffic it was generated\n"
+            << " * from. It selects the same offers as HttpAcceptParser with offerSet().\n"
+            << " */\n"
+            << "class " << options.name << "\n{\npublic:\n\n"
+            << "    /**\n     * Returns the offer set of the negotiator.\n     */\n"
+            << "    static const HttpAcceptParser::OfferSet &offerSet();\n\n"
+            << "    /**\n     * Selects the preferred available content type.\n     *\n"
+            << "     * @param[in] acceptValue value of the 'Accept' header.\n     *\n"
+            << "     * @return the position of the selected content type in the offer set, or -1 if the offer set is empty.\n     */\n"
+            << "    static int select(const std::string &acceptValue);\n\n"
+            << "    /**\n     * Selects the preferred available content type, as HttpAcceptParser::parse().\n     *\n"
+            << "     * @param[in] acceptValue value of the 'Accept' header.\n     *\n"
+            << "     * @return the selected content type.\n     */\n"
+            << "    static std::string parse(const std::string &acceptValue);\n\n"
+            << "private:\n\n"
+            << "    /**\n     * Constructor.\n     */\n"
+            << "    " << options.name << "()\n    {\n    }\n"
+            << "};\n\n#endif // " << guard << "\n";
+    }
+
+    void emitSource(std::ostream &out, const Options &options, const std::vector<Header> &hot, const PerfectHash &table, const std::vector<Header> &nearHot)
+    {
+        out << "/* -*- c++ -*- */\n\n"
+            << "// Generated by HttpAcceptCodegen. Do not edit.\n\n"
+            << "#include <cstring>\n#include \"HttpAcceptHash.h\"\n#include \"" << options.name << ".h\"\n\n"
+            << "namespace\n{\n";
+
+        out << "    const char *const kOffers[] =\n    {\n";
+        for (size_t i = 0; i < options.offers.size(); ++i)
+        {
+            out << "        " << quote(options.offers[i]) << ((i + 1 < options.offers.size()) ? ",\n" : "\n");
+        }
+        out << "    };\n\n";
+
+        size_t minLength = SIZE_MAX;
+        size_t maxLength = 0;
+        for (const auto &header : hot)
+        {
+            minLength = std::min(minLength, header.value.size());
+            maxLength = std::max(maxLength, header.value.size());
+        }
+        out << "    // Hot headers, placed by their hash and the displacement of their bucket.\n"
+            << "    struct HotHeader\n    {\n        const char *value;\n        size_t      length;\n        int         selected;\n    };\n\n"
+            << "    const size_t kMinHotLength = " << (hot.empty() ? 1 : minLength) << ";\n"
+            << "    const size_t kMaxHotLength = " << maxLength << ";\n"
+            << "    const size_t kBucketMask = " << (table.displacements.empty() ? 0 : table.displacements.size() - 1) << ";\n"
+            << "    const size_t kSlotMask = " << (table.slots.empty() ? 0 : table.slots.size() - 1) << ";\n\n"
+            << "    const uint32_t kDisplacements[] =\n    {\n";
+        for (size_t i = 0; i < std::max<size_t>(table.displacements.size(), 1); ++i)
+        {
+            out << ((i % 16) ? " " : "        ") << (table.displacements.empty() ? 0 : table.displacements[i])
+                << ((i + 1 < table.displacements.size()) ? "," : "") << (((i % 16) == 15) || (i + 1 >= table.displacements.size()) ? "\n" : "");
+        }
+        out << "    };\n\n    const HotHeader kHotHeaders[] =\n    {\n";
+        for (size_t i = 0; i < std::max<size_t>(table.slots.size(), 1); ++i)
+        {
+            const int member = table.slots.empty() ? -1 : table.slots[i];
+            const char *separator = (i + 1 < table.slots.size()) ? ",\n" : "\n";
+            if (member < 0)
+            {
+                out << "        { \"\", 0, -1 }" << separator;
+            }
+            else
+            {
+                out << "        { " << quote(hot[member].value) << ", " << hot[member].value.size() << ", " << hot[member].selected << " }" << separator;
+            }
+        }
+        out << "    };\n\n";
+
+        // The near-hot headers, by length.
+        std::vector<std::pair<size_t, std::vector<const Header *>>> lengths;
+        for (const auto &header : nearHot)
+        {
+            auto length = std::find_if(lengths.begin(), lengths.end(), [&header](const std::pair<size_t, std::vector<const Header *>> &l)
+            {
+                return l.first == header.value.size();
+            });
+            if (length == lengths.end())
+            {
+                lengths.push_back(std::make_pair(header.value.size(), std::vector<const Header *>()));
+                length = lengths.end() - 1;
+            }
+            length->second.push_back(&header);
+        }
+        std::sort(lengths.begin(), lengths.end(), [](const std::pair<size_t, std::vector<const Header *>> &a, const std::pair<size_t, std::vector<const Header *>> &b)
+        {
+            return a.first < b.first;
+        });
+        out << "    // Decision tree of the near-hot headers.\n"
+            << "    int selectNearHot(const char *s, size_t length)\n    {\n";
+        if (!lengths.empty())
+        {
+            out << "        switch (length)\n        {\n";
+            for (const auto &length : lengths)
+            {
+                out << "        case " << length.first << ":\n";
+                emitTree(out, length.second, length.first, "            ");
+                out << "            break;\n";
+            }
+            out << "        default:\n            break;\n        }\n";
+        }
+        else
+        {
+            out << "        (void)s;\n        (void)length;\n";
+        }
+        out << "        return -1;\n    }\n}\n\n";
+
+        const std::string flags = (options.flags == 0) ? "0" :
+            (options.flags == HttpAcceptParser::OfferSet::kMatchParameters) ? "HttpAcceptParser::OfferSet::kMatchParameters" :
+            (options.flags == HttpAcceptParser::OfferSet::kMatchSuffixes) ? "HttpAcceptParser::OfferSet::kMatchSuffixes" :
+            "HttpAcceptParser::OfferSet::kMatchParameters | HttpAcceptParser::OfferSet::kMatchSuffixes";
+        out << "const HttpAcceptParser::OfferSet &" << options.name << "::offerSet()\n{\n"
+            << "    static const HttpAcceptParser::OfferSet offers(std::vector<std::string>(kOffers, kOffers + sizeof(kOffers) / sizeof(kOffers[0])), 0, " << flags << ");\n"
+            << "    return offers;\n}\n\n";
+
+        out << "int " << options.name << "::select(const std::string &acceptValue)\n{\n"
+            << "    const char *s = acceptValue.data();\n"
+            << "    const size_t length = acceptValue.size();\n"
+            << "    if ((length >= kMinHotLength) && (length <= kMaxHotLength))\n    {\n"
+            << "        const uint64_t hash = HttpAcceptHash::hash(s, length);\n"
+            << "        const HotHeader &hot = kHotHeaders[HttpAcceptHash::mix(hash ^ kDisplacements[(hash >> 32) & kBucketMask]) & kSlotMask];\n"
+            << "        if ((hot.length == length) && (std::memcmp(hot.value, s, length) == 0))\n        {\n"
+            << "            return hot.selected;\n        }\n    }\n\n"
+            << "    const int selected = selectNearHot(s, length);\n"
+            << "    return (selected >= 0) ? selected : HttpAcceptParser::select(acceptValue, offerSet());\n}\n\n";
+
+        out << "std::string " << options.name << "::parse(const std::string &acceptValue)\n{\n"
+            << "    if (acceptValue.empty())\n    {\n"
+            << "        return HttpAcceptParser::parse(acceptValue, offerSet());\n    }\n"
+            << "    const int selected = select(acceptValue);\n"
+            << "    return (selected >= 0) ? offerSet().result(static_cast<size_t>(selected)) : std::string();\n}\n";
+    }
+
+    bool writeFile(const std::string &path, const std::string &text)
+    {
+        std::ofstream file(path.c_str(), std::ios::binary | std::ios::trunc);
+        return file.write(text.data(), static_cast<std::streamsize>(text.size())) && file.flush();
+    }
+}
+
+int main(int argc, char **argv)
+{
+    Options options;
+    if (!parseOptions(argc, argv, options))
+    {
+        std::fprintf(stderr, "usage: %s --offers=type/subtype,... [--match-parameters] [--match-suffixes] [--hot=N] [--near-hot=N] [--name=ClassName] "
+            "[--output=directory] corpus...\n", argv[0]);
+        return 1;
+    }
+
+    std::vector<Header> headers;
+    uint64_t requests;
+    if (!loadCorpus(options.paths, headers, requests))
+    {
+        return 1;
+    }
+
+    const HttpAcceptParser::OfferSet offerSet(options.offers, 0, options.flags);
+    for (auto &header : headers)
+    {
+        header.selected = HttpAcceptParser::select(header.value, offerSet);
+    }
+    const size_t hotCount = std::min<size_t>(options.hot, headers.size());
+    const size_t nearHotCount = std::min<size_t>(options.nearHot, headers.size() - hotCount);
+    const std::vector<Header> hot(headers.begin(), headers.begin() + hotCount);
+    const std::vector<Header> nearHot(headers.begin() + hotCount, headers.begin() + hotCount + nearHotCount);
+
+    PerfectHash table;
+    if (!hot.empty() && !buildPerfectHash(hot, table))
+    {
+        return 1;
+    }
+
+    std::ostringstream header;
+    std::ostringstream source;
+    emitHeader(header, options);
+    emitSource(source, options, hot, table, nearHot);
+    const std::string headerPath = options.output + "/" + options.name + ".h";
+    const std::string sourcePath = options.output + "/" + options.name + ".cpp";
+    if (!writeFile(headerPath, header.str()) || !writeFile(sourcePath, source.str()))
+    {
+        std::fprintf(stderr, "cannot write '%s' and '%s'\n", headerPath.c_str(), sourcePath.c_str());
+        return 1;
+    }
+
+    uint64_t hotRequests = 0;
+    uint64_t nearHotRequests = 0;
+    for (const auto &h : hot)
+    {
+        hotRequests += h.count;
+    }
+    for (const auto &h : nearHot)
+    {
+        nearHotRequests += h.count;
+    }
+    std::printf("%s: %zu hot headers in %zu slots (%.1f%% of the requests), %zu near-hot headers (%.1f%%), %zu other distinct headers\n",
+        sourcePath.c_str(), hot.size(), table.slots.size(), requests ? 100.0 * hotRequests / requests : 0.0, nearHot.size(),
+        requests ? 100.0 * nearHotRequests / requests : 0.0, headers.size() - hot.size() - nearHot.size());
+    return 0;
+}
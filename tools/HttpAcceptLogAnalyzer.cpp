@@ -0,0 +1,562 @@
+/* -*- c++ -*- */
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "../HttpAcceptCounters.h"
+#include "../HttpAcceptHash.h"
+#include "../HttpAcceptParser.h"
+
+// Replays the 'Accept' headers of access logs against an offer set, to size
+// the negotiation caches and choose the order of the offers.
+//
+// The logs are mapped in memory and split into chunks that end at line
+// boundaries. Every core negotiates the chunks of its own queue, and steals
+// from the back of the other queues once its own is empty. The report gives
+// the number of distinct headers and the most frequent ones, the hit rate of
+// an LRU cache and of a static table of the hottest headers for every power
+// of two size, the distribution of the selected offers, the fallbacks, and
+// the cost of the negotiations. When the library is built with
+// HTTP_ACCEPT_PARSER_INSTRUMENTATION, the cost of every stage follows.
+//
+// The header is the whole line, or with --field=N the N-th double-quoted
+// field of the line, as in the combined log format extended with
+// "$http_accept". A field reading "-" is an absent header.
+//
+// usage: HttpAcceptLogAnalyzer [--offers=type/subtype,...] [--field=N] [--threads=N]
+//                              [--match-parameters] [--match-suffixes] log...
+
+namespace
+{
+    const char *const kDefaultOffers = "text/html,application/xhtml+xml,application/json,application/xml,text/plain";
+    const size_t kChunkBytes = 4 << 20;
+    const unsigned kTopHeaders = 10;
+    const unsigned kMaxCacheSizeBits = 20;
+
+    struct Options
+    {
+        std::vector<std::string> offers;
+        unsigned                 field;
+        unsigned                 threads;
+        unsigned                 flags;
+        std::vector<const char *> paths;
+    };
+
+    struct MappedFile
+    {
+        const char *data;
+        size_t      size;
+    };
+
+    struct Chunk
+    {
+        const char *begin;
+        const char *end;
+    };
+
+    // Results of a chunk, kept apart so that the cache simulation replays
+    // the headers in the order of the logs.
+    struct ChunkResult
+    {
+        std::vector<uint64_t> headerHashes;
+        double                nanoseconds;
+    };
+
+    struct HeaderStats
+    {
+        uint64_t    count;
+        std::string value;
+    };
+
+    // Queue of chunk indices of a worker. The owner takes from the front and
+    // the thieves from the back, so that they rarely contend.
+    struct WorkQueue
+    {
+        std::mutex         mutex;
+        std::deque<size_t> chunks;
+    };
+
+    struct WorkerResult
+    {
+        std::unordered_map<uint64_t, HeaderStats> headers;
+        std::vector<uint64_t>                     winners;
+        uint64_t                                  stolenChunks;
+    };
+
+    std::vector<std::string> split(const std::string &s, char delimiter)
+    {
+        std::vector<std::string> pieces;
+        size_t begin = 0;
+        for (size_t end = s.find(delimiter); ; end = s.find(delimiter, begin))
+        {
+            pieces.push_back(s.substr(begin, (end == std::string::npos) ? std::string::npos : end - begin));
+            if (end == std::string::npos)
+            {
+                return pieces;
+            }
+            begin = end + 1;
+        }
+    }
+
+    bool parseOptions(int argc, char **argv, Options &options)
+    {
+        std::string offers = kDefaultOffers;
+        options.field = 0;
+        options.threads = std::thread::hardware_concurrency() ? std::thread::hardware_concurrency() : 1;
+        options.flags = 0;
+        for (int i = 1; i < argc; ++i)
+        {
+            const char *argument = argv[i];
+            if (std::strncmp(argument, "--offers=", 9) == 0)
+            {
+                offers = argument + 9;
+            }
+            else if (std::strncmp(argument, "--field=", 8) == 0)
+            {
+                options.field = static_cast<unsigned>(std::strtoul(argument + 8, nullptr, 10));
+            }
+            else if (std::strncmp(argument, "--threads=", 10) == 0)
+            {
+                options.threads = static_cast<unsigned>(std::strtoul(argument + 10, nullptr, 10));
+            }
+            else if (std::strcmp(argument, "--match-parameters") == 0)
+            {
+                options.flags |= HttpAcceptParser::OfferSet::kMatchParameters;
+            }
+            else if (std::strcmp(argument, "--match-suffixes") == 0)
+            {
+                options.flags |= HttpAcceptParser::OfferSet::kMatchSuffixes;
+            }
+            else if (argument[0] == '-')
+            {
+                return false;
+            }
+            else
+            {
+                options.paths.push_back(argument);
+            }
+        }
+        options.offers = split(offers, ',');
+        return !options.paths.empty() && (options.threads > 0);
+    }
+
+    bool mapFile(const char *path, MappedFile &file)
+    {
+        const int descriptor = open(path, O_RDONLY);
+        if (descriptor < 0)
+        {
+            return false;
+        }
+        struct stat status;
+        bool mapped = (fstat(descriptor, &status) == 0);
+        file.size = mapped ? static_cast<size_t>(status.st_size) : 0;
+        file.data = nullptr;
+        if (mapped && file.size)
+        {
+            void *data = mmap(nullptr, file.size, PROT_READ, MAP_PRIVATE, descriptor, 0);
+            mapped = (data != MAP_FAILED);
+            file.data = mapped ? static_cast<const char *>(data) : nullptr;
+        }
+        close(descriptor);
+        return mapped;
+    }
+
+    // Splits a file into chunks of about kChunkBytes that end after a line feed.
+    void splitFile(const MappedFile &file, std::vector<Chunk> &chunks)
+    {
+        const char *end = file.data + file.size;
+        for (const char *begin = file.data; begin < end; )
+        {
+            const char *chunkEnd = (static_cast<size_t>(end - begin) > kChunkBytes) ? begin + kChunkBytes : end;
+            if (chunkEnd < end)
+            {
+                const char *lineFeed = static_cast<const char *>(std::memchr(chunkEnd, '\n', static_cast<size_t>(end - chunkEnd)));
+                chunkEnd = lineFeed ? lineFeed + 1 : end;
+            }
+            chunks.push_back(Chunk{begin, chunkEnd});
+            begin = chunkEnd;
+        }
+    }
+
+    // Extracts the header of a line, without its line terminator. Returns
+    // false if the line does not have the field.
+    bool extractHeader(const char *line, const char *end, unsigned field, std::string &acceptValue)
+    {
+        while ((end > line) && ((end[-1] == '\n') || (end[-1] == '\r')))
+        {
+            --end;
+        }
+        if (field == 0)
+        {
+            acceptValue.assign(line, end);
+            return true;
+        }
+
+        // Fields are delimited by unescaped double quotes.
+        unsigned quotes = 0;
+        const char *fieldBegin = nullptr;
+        for (const char *c = line; c < end; ++c)
+        {
+            if (*c == '\\')
+            {
+                ++c;
+            }
+            else if (*c == '"')
+            {
+                ++quotes;
+                if (quotes == 2 * field - 1)
+                {
+                    fieldBegin = c + 1;
+                }
+                else if (quotes == 2 * field)
+                {
+                    if ((c - fieldBegin == 1) && (*fieldBegin == '-'))
+                    {
+                        acceptValue.clear();
+                    }
+                    else
+                    {
+                        acceptValue.assign(fieldBegin, c);
+                    }
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+
+    bool takeChunk(std::vector<WorkQueue> &queues, unsigned worker, size_t &chunk, bool &stolen)
+    {
+        {
+            WorkQueue &own = queues[worker];
+            std::lock_guard<std::mutex> lock(own.mutex);
+            if (!own.chunks.empty())
+            {
+                chunk = own.chunks.front();
+                own.chunks.pop_front();
+                stolen = false;
+                return true;
+            }
+        }
+        for (size_t i = 1; i < queues.size(); ++i)
+        {
+            WorkQueue &victim = queues[(worker + i) % queues.size()];
+            std::lock_guard<std::mutex> lock(victim.mutex);
+            if (!victim.chunks.empty())
+            {
+                chunk = victim.chunks.back();
+                victim.chunks.pop_back();
+                stolen = true;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void work(unsigned worker, const Options &options, const HttpAcceptParser::OfferSet &offerSet, const std::vector<Chunk> &chunks,
+        std::vector<WorkQueue> &queues, std::vector<ChunkResult> &chunkResults, WorkerResult &result)
+    {
+        HttpAcceptParser::NegotiationScratch scratch;
+        std::string acceptValue;
+        result.winners.assign(options.offers.size() + 1, 0);
+        result.stolenChunks = 0;
+
+        size_t index;
+        bool stolen;
+        while (takeChunk(queues, worker, index, stolen))
+        {
+            result.stolenChunks += stolen ? 1 : 0;
+            ChunkResult &chunkResult = chunkResults[index];
+            const auto start = std::chrono::steady_clock::now();
+            for (const char *line = chunks[index].begin; line < chunks[index].end; )
+            {
+                const char *lineFeed = static_cast<const char *>(std::memchr(line, '\n', static_cast<size_t>(chunks[index].end - line)));
+                const char *lineEnd = lineFeed ? lineFeed + 1 : chunks[index].end;
+                if (extractHeader(line, lineEnd, options.field, acceptValue))
+                {
+                    const uint64_t hash = HttpAcceptHash::hash(acceptValue);
+                    chunkResult.headerHashes.push_back(hash);
+                    HeaderStats &header = result.headers[hash];
+                    if (header.count++ == 0)
+                    {
+                        header.value = acceptValue;
+                    }
+                    const int selected = HttpAcceptParser::select(acceptValue, offerSet, scratch);
+                    ++result.winners[(selected < 0) ? options.offers.size() : static_cast<size_t>(selected)];
+                }
+                line = lineEnd;
+            }
+            chunkResult.nanoseconds = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+        }
+    }
+
+    // Fenwick tree over the positions of the requests, marking the last
+    // request of every header.
+    class FenwickTree
+    {
+    public:
+
+        explicit FenwickTree(size_t size)
+            : m_tree(size + 1, 0)
+        {
+        }
+
+        void add(size_t position, int value)
+        {
+            for (++position; position < m_tree.size(); position += position & (~position + 1))
+            {
+                m_tree[position] += value;
+            }
+        }
+
+        // Sum of the positions before position.
+        int64_t prefix(size_t position) const
+        {
+            int64_t sum = 0;
+            for (; position > 0; position -= position & (~position + 1))
+            {
+                sum += m_tree[position];
+            }
+            return sum;
+        }
+
+    private:
+
+        std::vector<int32_t> m_tree;
+    };
+
+    // Computes the LRU stack distance of every request, the number of
+    // distinct headers requested since the previous request of the same
+    // header: an LRU cache of N entries hits exactly the requests at a
+    // distance below N. The distances are counted in power of two buckets,
+    // bucket b holding the distances from 2^(b-1) to 2^b - 1.
+    std::vector<uint64_t> stackDistances(const std::vector<ChunkResult> &chunkResults, uint64_t requests, uint64_t &coldMisses)
+    {
+        std::vector<uint64_t> buckets(kMaxCacheSizeBits + 2, 0);
+        std::unordered_map<uint64_t, size_t> lastPositions;
+        FenwickTree marks(static_cast<size_t>(requests));
+        size_t position = 0;
+        coldMisses = 0;
+        for (const auto &chunkResult : chunkResults)
+        {
+            for (const uint64_t hash : chunkResult.headerHashes)
+            {
+                auto inserted = lastPositions.insert(std::make_pair(hash, position));
+                if (inserted.second)
+                {
+                    ++coldMisses;
+                }
+                else
+                {
+                    const size_t previous = inserted.first->second;
+                    const uint64_t distance = static_cast<uint64_t>(marks.prefix(position) - marks.prefix(previous + 1));
+                    unsigned bucket = 0;
+                    for (uint64_t d = distance; d && (bucket <= kMaxCacheSizeBits); d >>= 1)
+                    {
+                        ++bucket;
+                    }
+                    ++buckets[bucket];
+                    marks.add(previous, -1);
+                    inserted.first->second = position;
+                }
+                marks.add(position, 1);
+                ++position;
+            }
+        }
+        return buckets;
+    }
+
+    std::string printable(const std::string &s, size_t maxLength)
+    {
+        std::string printable = s.substr(0, maxLength);
+        for (auto &c : printable)
+        {
+            if ((static_cast<unsigned char>(c) < 0x20) || (static_cast<unsigned char>(c) >= 0x7f))
+            {
+                c = '?';
+            }
+        }
+        return (s.size() > maxLength) ? printable + "..." : printable;
+    }
+}
+
+int main(int argc, char **argv)
+{
+    Options options;
+    if (!parseOptions(argc, argv, options))
+    {
+        std::fprintf(stderr, "usage: %s [--offers=type/subtype,...] [--field=N] [--threads=N] [--match-parameters] [--match-suffixes] log...\n", argv[0]);
+        return 1;
+    }
+
+    std::vector<MappedFile> files(options.paths.size());
+    std::vector<Chunk> chunks;
+    size_t totalBytes = 0;
+    for (size_t i = 0; i < options.paths.size(); ++i)
+    {
+        if (!mapFile(options.paths[i], files[i]))
+        {
+            std::fprintf(stderr, "cannot map the log '%s': %s\n", options.paths[i], std::strerror(errno));
+            return 1;
+        }
+        splitFile(files[i], chunks);
+        totalBytes += files[i].size;
+    }
+
+    // Every worker starts with a contiguous share of the chunks.
+    const HttpAcceptParser::OfferSet offerSet(options.offers, 0, options.flags);
+    const unsigned threads = static_cast<unsigned>(std::min<size_t>(options.threads, std::max<size_t>(chunks.size(), 1)));
+    std::vector<WorkQueue> queues(threads);
+    for (size_t i = 0; i < chunks.size(); ++i)
+    {
+        queues[i * threads / chunks.size()].chunks.push_back(i);
+    }
+    std::vector<ChunkResult> chunkResults(chunks.size());
+    std::vector<WorkerResult> workerResults(threads);
+    const HttpAcceptCounters::Stats before = HttpAcceptCounters::getStats();
+    const auto start = std::chrono::steady_clock::now();
+    {
+        std::vector<std::thread> workers;
+        for (unsigned worker = 0; worker < threads; ++worker)
+        {
+            workers.emplace_back(work, worker, std::cref(options), std::cref(offerSet), std::cref(chunks), std::ref(queues), std::ref(chunkResults),
+                std::ref(workerResults[worker]));
+        }
+        for (auto &worker : workers)
+        {
+            worker.join();
+        }
+    }
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    const HttpAcceptCounters::Stats after = HttpAcceptCounters::getStats();
+
+    // Merge the results of the workers.
+    std::unordered_map<uint64_t, HeaderStats> headers;
+    std::vector<uint64_t> winners(options.offers.size() + 1, 0);
+    uint64_t requests = 0;
+    uint64_t stolenChunks = 0;
+    double nanoseconds = 0;
+    for (auto &workerResult : workerResults)
+    {
+        for (auto &header : workerResult.headers)
+        {
+            HeaderStats &merged = headers[header.first];
+            if (merged.count == 0)
+            {
+                merged.value.swap(header.second.value);
+            }
+            merged.count += header.second.count;
+        }
+        for (size_t i = 0; i < winners.size(); ++i)
+        {
+            winners[i] += workerResult.winners[i];
+            requests += workerResult.winners[i];
+        }
+        stolenChunks += workerResult.stolenChunks;
+    }
+    for (const auto &chunkResult : chunkResults)
+    {
+        nanoseconds += chunkResult.nanoseconds;
+    }
+    if (requests == 0)
+    {
+        std::fprintf(stderr, "no header found in the logs\n");
+        return 1;
+    }
+
+    std::printf("%llu requests, %zu bytes in %zu chunks, %u threads, %llu chunks stolen, %.2f s (%.1f MB/s)\n",
+        static_cast<unsigned long long>(requests), totalBytes, chunks.size(), threads, static_cast<unsigned long long>(stolenChunks), seconds,
+        static_cast<double>(totalBytes) / seconds * 1e-6);
+
+    // Cardinality and hottest headers.
+    std::vector<const HeaderStats *> ranked;
+    for (const auto &header : headers)
+    {
+        ranked.push_back(&header.second);
+    }
+    std::sort(ranked.begin(), ranked.end(), [](const HeaderStats *a, const HeaderStats *b) { return a->count > b->count; });
+    std::printf("\n%zu distinct headers\n%10s %8s  %s\n", headers.size(), "requests", "share", "header");
+    for (size_t i = 0; (i < ranked.size()) && (i < kTopHeaders); ++i)
+    {
+        std::printf("%10llu %7.2f%%  %s\n", static_cast<unsigned long long>(ranked[i]->count), 100.0 * ranked[i]->count / requests,
+            printable(ranked[i]->value, 100).c_str());
+    }
+
+    // Hit rates by cache size: an LRU cache, and a static table of the
+    // hottest headers such as the one HttpAcceptHotHeaderCache promotes.
+    uint64_t coldMisses;
+    const std::vector<uint64_t> distances = stackDistances(chunkResults, requests, coldMisses);
+    std::printf("\n%10s %10s %12s\n", "entries", "LRU", "hottest");
+    uint64_t lruHits = 0;
+    uint64_t staticHits = 0;
+    size_t rank = 0;
+    for (unsigned bits = 0; bits <= kMaxCacheSizeBits; ++bits)
+    {
+        const size_t entries = static_cast<size_t>(1) << bits;
+        lruHits += distances[bits];
+        for (; (rank < ranked.size()) && (rank < entries); ++rank)
+        {
+            staticHits += ranked[rank]->count;
+        }
+        std::printf("%10zu %9.2f%% %11.2f%%\n", entries, 100.0 * lruHits / requests, 100.0 * staticHits / requests);
+        if (entries >= headers.size())
+        {
+            break;
+        }
+    }
+    std::printf("%10s %9.2f%% of the requests are first requests of their header\n", "", 100.0 * coldMisses / requests);
+
+    // Winners and fallbacks.
+    std::printf("\n%10s %8s  %s\n", "selected", "share", "offer");
+    for (size_t i = 0; i < winners.size(); ++i)
+    {
+        if (winners[i])
+        {
+            std::printf("%10llu %7.2f%%  %s\n", static_cast<unsigned long long>(winners[i]), 100.0 * winners[i] / requests,
+                (i < options.offers.size()) ? options.offers[i].c_str() : "(none)");
+        }
+    }
+    std::printf("%10llu %7.2f%%  no acceptable offer, answered with the best ranked one\n",
+        static_cast<unsigned long long>(after.unacceptableFallbacks - before.unacceptableFallbacks),
+        100.0 * (after.unacceptableFallbacks - before.unacceptableFallbacks) / requests);
+    std::printf("%10llu %7.2f%%  empty header, answered with the first offer\n",
+        static_cast<unsigned long long>(after.emptyHeaderFallbacks - before.emptyHeaderFallbacks),
+        100.0 * (after.emptyHeaderFallbacks - before.emptyHeaderFallbacks) / requests);
+
+    // Cost, including the extraction of the headers from the lines.
+    std::printf("\n%.1f ns per request, over all the threads\n", nanoseconds / requests);
+#ifdef HTTP_ACCEPT_PARSER_INSTRUMENTATION
+    static const char *const kStageNames[HttpAcceptCounters::kStageCount] = { "tokenize", "rank ranges", "normalize offers", "match", "rank offers" };
+    std::printf("%-16s %12s %14s\n", "stage", "samples", "ticks/sample");
+    for (unsigned stage = 0; stage < HttpAcceptCounters::kStageCount; ++stage)
+    {
+        const uint64_t samples = after.stages[stage].samples - before.stages[stage].samples;
+        const uint64_t ticks = after.stages[stage].ticks - before.stages[stage].ticks;
+        std::printf("%-16s %12llu %14.1f\n", kStageNames[stage], static_cast<unsigned long long>(samples), samples ? static_cast<double>(ticks) / samples : 0.0);
+    }
+#else
+    std::printf("build with HTTP_ACCEPT_PARSER_INSTRUMENTATION for the cost of every stage\n");
+#endif
+
+    for (const auto &file : files)
+    {
+        if (file.data)
+        {
+            munmap(const_cast<char *>(file.data), file.size);
+        }
+    }
+    return 0;
+}